@@ -0,0 +1,146 @@
+#include "epoch.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// Cada thread que usa a tabela tem um registo com a época em que entrou. Os objetos que retira
+// ficam em três listas (limbo), uma por época módulo 3: os de uma época g podem ser libertados
+// quando a época global chega a g + 2.
+typedef struct EpochRecord {
+  atomic_uint_fast64_t epoch;
+  atomic_int active;
+  atomic_int in_use; // 0 quando a thread dona terminou e o registo pode ser reutilizado
+  EpochEntry *limbo[3];
+  uint64_t limbo_epoch[3];
+  size_t retired;
+  struct EpochRecord *next;
+} EpochRecord;
+
+static _Atomic(EpochRecord *) records = NULL;
+static atomic_uint_fast64_t global_epoch = 0;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochRecord *my_record = NULL;
+
+// Destrutor da chave: quando a thread termina o registo fica livre. Os objetos no limbo
+// passam para a próxima thread que ficar com o registo.
+static void release_record(void *arg) {
+  EpochRecord *record = arg;
+  atomic_store(&record->active, 0);
+  atomic_store(&record->in_use, 0);
+}
+
+static void create_record_key() {
+  pthread_key_create(&record_key, release_record);
+}
+
+static EpochRecord *get_record() {
+  if (my_record != NULL) return my_record;
+
+  pthread_once(&record_key_once, create_record_key);
+  EpochRecord *record;
+  for (record = atomic_load(&records); record != NULL; record = record->next) {
+    int free_slot = 0;
+    if (atomic_compare_exchange_strong(&record->in_use, &free_slot, 1)) break;
+  }
+
+  if (record == NULL) {
+    record = calloc(1, sizeof(EpochRecord));
+    if (record == NULL) abort(); // Sem registo não conseguimos proteger as leituras
+    atomic_init(&record->in_use, 1);
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record))
+      ;
+  }
+
+  pthread_setspecific(record_key, record);
+  my_record = record;
+  return record;
+}
+
+// A época só avança quando todas as threads numa secção crítica já viram a época atual.
+static void try_advance() {
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+    if (atomic_load(&record->active) && atomic_load(&record->epoch) != epoch) return;
+  }
+  atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+static void free_entries(EpochEntry *entry) {
+  while (entry != NULL) {
+    EpochEntry *next = entry->next;
+    entry->free_fn(entry);
+    entry = next;
+  }
+}
+
+// Liberta as listas do limbo cuja época já tem um grace period completo.
+static void collect(EpochRecord *record) {
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  for (int i = 0; i < 3; i++) {
+    if (record->limbo[i] != NULL && record->limbo_epoch[i] + 2 <= epoch) {
+      free_entries(record->limbo[i]);
+      record->limbo[i] = NULL;
+    }
+  }
+}
+
+void epoch_enter() {
+  EpochRecord *record = get_record();
+  atomic_store(&record->active, 1);
+  atomic_store(&record->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit() {
+  atomic_store(&my_record->active, 0);
+}
+
+void epoch_retire(EpochEntry *entry, void (*free_fn)(EpochEntry *entry)) {
+  EpochRecord *record = get_record();
+  uint_fast64_t epoch = atomic_load(&global_epoch);
+  int index = (int)(epoch % 3);
+
+  if (record->limbo_epoch[index] != epoch) {
+    // A lista é de uma época <= epoch - 3, portanto já pode ser libertada
+    free_entries(record->limbo[index]);
+    record->limbo[index] = NULL;
+    record->limbo_epoch[index] = epoch;
+  }
+
+  entry->free_fn = free_fn;
+  entry->next = record->limbo[index];
+  record->limbo[index] = entry;
+
+  if (++record->retired % EPOCH_RETIRE_THRESHOLD == 0) {
+    try_advance();
+    collect(record);
+  }
+}
+
+uint64_t epoch_current() {
+  return atomic_load(&global_epoch);
+}
+
+int epoch_grace_elapsed(uint64_t epoch) {
+  if (atomic_load(&global_epoch) >= epoch + 2) return 1;
+  try_advance();
+  return atomic_load(&global_epoch) >= epoch + 2;
+}
+
+void epoch_reclaim_all() {
+  EpochRecord *record = atomic_exchange(&records, NULL);
+  while (record != NULL) {
+    EpochRecord *next = record->next;
+    for (int i = 0; i < 3; i++) {
+      free_entries(record->limbo[i]);
+    }
+    free(record);
+    record = next;
+  }
+  if (my_record != NULL) {
+    pthread_setspecific(record_key, NULL);
+    my_record = NULL;
+  }
+}
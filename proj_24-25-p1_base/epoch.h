@@ -0,0 +1,44 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+#include <stdint.h>
+
+/* Reclamação de memória baseada em épocas (epoch-based reclamation).
+ Os leitores percorrem a tabela sem locks dentro de uma secção epoch_enter/epoch_exit. Um nó
+ que é retirado da tabela não pode ser libertado logo, porque um leitor pode ainda estar a
+ usá-lo: é entregue a epoch_retire e só é libertado quando a época global tiver avançado duas
+ vezes, o que garante que todos os leitores que o podiam ver já saíram. */
+
+// Número de objetos retirados por thread a partir do qual se tenta avançar a época
+#define EPOCH_RETIRE_THRESHOLD 64
+
+typedef struct EpochEntry {
+  struct EpochEntry *next;
+  void (*free_fn)(struct EpochEntry *entry);
+} EpochEntry;
+
+/// Enters a read-side critical section. Sections can't be nested.
+void epoch_enter();
+
+/// Leaves the read-side critical section.
+void epoch_exit();
+
+/// Hands an object that is no longer reachable to the reclaimer.
+/// @param entry Entry embedded in the object.
+/// @param free_fn Function that frees the object once no reader can see it.
+void epoch_retire(EpochEntry *entry, void (*free_fn)(EpochEntry *entry));
+
+/// Returns the current global epoch.
+uint64_t epoch_current();
+
+/// Checks whether a grace period has elapsed since the given epoch, i.e. every reader that
+/// was inside a critical section at that epoch has left it. Tries to advance the epoch.
+/// @param epoch Epoch returned by epoch_current.
+/// @return 1 if the grace period is over, 0 otherwise.
+int epoch_grace_elapsed(uint64_t epoch);
+
+/// Frees every retired object and the per-thread records. Only safe when no other thread uses
+/// the table anymore.
+void epoch_reclaim_all();
+
+#endif // KVS_EPOCH_H
@@ -0,0 +1,490 @@
+#include "jobs.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Output de um comando da janela, copiado daqui para JobSlot.output no fim do comando
+static _Thread_local OutputBuffer command_output;
+
+// Ficheiros ainda por acabar, pelo seu número (o thread_id de um WAIT)
+static struct {
+  pthread_mutex_t mutex;
+  in_out_fds **jobs; // jobs[id - 1], NULL depois de o ficheiro acabar
+  size_t count, capacity;
+} registry = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+int job_register(in_out_fds *fd) {
+  pthread_mutex_lock(&registry.mutex);
+  if (registry.count == registry.capacity) {
+    size_t capacity = registry.capacity == 0 ? 64 : 2 * registry.capacity;
+    in_out_fds **jobs = realloc(registry.jobs, capacity * sizeof(in_out_fds *));
+    if (jobs == NULL) {
+      pthread_mutex_unlock(&registry.mutex);
+      return 1;
+    }
+    registry.jobs = jobs;
+    registry.capacity = capacity;
+  }
+  registry.jobs[registry.count++] = fd;
+  fd->id = (unsigned int)registry.count;
+  atomic_init(&fd->delay, 0);
+  pthread_mutex_unlock(&registry.mutex);
+  return 0;
+}
+
+void job_unregister(in_out_fds *fd) {
+  pthread_mutex_lock(&registry.mutex);
+  registry.jobs[fd->id - 1] = NULL;
+  pthread_mutex_unlock(&registry.mutex);
+}
+
+// Atrasa o próximo comando de outro ficheiro (ignorado se já acabou ou não existe).
+static void delay_job(unsigned int id, unsigned int delay) {
+  pthread_mutex_lock(&registry.mutex);
+  if (id >= 1 && id <= registry.count && registry.jobs[id - 1] != NULL) {
+    atomic_fetch_add(&registry.jobs[id - 1]->delay, delay);
+  }
+  pthread_mutex_unlock(&registry.mutex);
+}
+
+enum Command job_parse_command(JobReader *reader, JobCommand *command) {
+  command->invalid = 0;
+  switch (command->type = get_next(reader)) {
+    case CMD_WRITE:
+      command->num_pairs = parse_write(reader, command->keys, command->values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      command->invalid = command->num_pairs == 0;
+      break;
+
+    case CMD_READ:
+    case CMD_DELETE:
+      command->num_pairs = parse_read_delete(reader, command->keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
+      command->invalid = command->num_pairs == 0;
+      break;
+
+    case CMD_SCAN:
+      command->invalid = parse_scan(reader, command->keys[0], MAX_STRING_SIZE) != 0;
+      break;
+
+    case CMD_WAIT:
+      switch (parse_wait(reader, &command->delay, &command->thread_id)) {
+        case -1:
+          command->invalid = 1;
+          break;
+        case 0:
+          command->thread_id = 0;
+          break;
+        default:
+          break;
+      }
+      break;
+
+    case CMD_SHOW:
+    case CMD_STATS:
+    case CMD_BACKUP:
+    case CMD_HELP:
+    case CMD_EMPTY:
+    case CMD_INVALID:
+    case EOC:
+      break;
+  }
+  return command->type;
+}
+
+unsigned int job_run_command(JobCommand *command, in_out_fds *fd, OutputBuffer *out) {
+  if (command->invalid) {
+    output_string(out, "\n");
+    return 0;
+  }
+
+  switch (command->type) {
+    case CMD_WRITE:
+      if (kvs_write(command->num_pairs, command->keys, command->values, out)) {
+        output_string(out, "Failed to write pair\n");
+      }
+      break;
+
+    case CMD_READ:
+      if (kvs_read(command->num_pairs, command->keys, out)) {
+        output_string(out, "Failed to read pair\n");
+      }
+      break;
+
+    case CMD_DELETE:
+      if (kvs_delete(command->num_pairs, command->keys, out)) {
+        output_string(out, "Failed to delete pair\n");
+      }
+      break;
+
+    case CMD_SHOW:
+      kvs_show(out);
+      break;
+
+    case CMD_SCAN:
+      if (kvs_scan(command->keys[0], out)) {
+        output_string(out, "Failed to scan pairs\n");
+      }
+      break;
+
+    case CMD_STATS:
+      kvs_stats(out);
+      break;
+
+    case CMD_WAIT:
+      if (command->thread_id != 0 && command->thread_id != fd->id) {
+        delay_job(command->thread_id, command->delay);
+      } else if (command->delay > 0) {
+        output_string(out, "Waiting...\n");
+        return command->delay;
+      }
+      break;
+
+    case CMD_BACKUP:
+      // O processo filho herda uma cópia do buffer, que nunca despeja
+      output_flush(out);
+      // Os backups de cada ficheiro são numerados pela ordem dos comandos; o backup corre em
+      // segundo plano e só esperamos se já houver max_backups a correr
+      if (kvs_backup(fd->fileName, &fd->backup, fd->max_backups)) {
+        write(STDERR_FILENO, "Failed to perform backup\n", strlen("Failed to perform backup\n"));
+      }
+      break;
+
+    case CMD_INVALID:
+      output_string(out, "\n");
+      break;
+
+    case CMD_HELP:
+      output_string(out,
+                    "Available commands:\n"
+                    "  WRITE [(key,value)(key2,value2),...]\n"
+                    "  READ [key,key2,...]\n"
+                    "  DELETE [key,key2,...]\n"
+                    "  SHOW\n"
+                    "  SCAN [prefix]\n"
+                    "  STATS\n"
+                    "  WAIT <delay_ms> [thread_id]\n"
+                    "  BACKUP\n"
+                    "  HELP\n");
+      break;
+
+    case CMD_EMPTY:
+    case EOC:
+      break;
+  }
+  return 0;
+}
+
+void job_finish(in_out_fds *fd) {
+  job_unregister(fd);
+  output_flush(&fd->out);
+  kvs_backup_done(&fd->backup);
+  reader_close(&fd->reader);
+  cleanFds(fd->input, fd->output);
+  free(fd);
+}
+
+// Suspende o ficheiro: resume só volta a uma deque da pool depois do atraso, e o worker fica
+// livre para outros ficheiros. Devolve 1 se não foi possível (e já esperámos aqui).
+static int suspend(in_out_fds *fd, unsigned int delay, TaskFunction resume, void *arg) {
+  // Não deixamos output por escrever enquanto o ficheiro espera
+  output_flush(&fd->out);
+  if (pool_submit_after(fd->pool, delay, resume, arg) == 0) return 0;
+  kvs_wait(delay);
+  return 1;
+}
+
+void job_run(void *fd_info) {
+  in_out_fds *fd = fd_info;
+  JobCommand command;
+  while (1) {
+    // Um WAIT de outro ficheiro para este atrasa o próximo comando
+    unsigned int delay = atomic_exchange(&fd->delay, 0);
+    if (delay == 0) {
+      if (job_parse_command(&fd->reader, &command) == EOC) break;
+      delay = job_run_command(&command, fd, &fd->out);
+    }
+    if (delay > 0 && suspend(fd, delay, job_run, fd) == 0) return;
+  }
+  job_finish(fd);
+}
+
+// Comandos que não entram em janelas: leem a tabela toda, param a tarefa ou usam o estado
+// de backups do ficheiro.
+static int is_barrier(enum Command type) {
+  return type == CMD_SHOW || type == CMD_SCAN || type == CMD_STATS || type == CMD_WAIT || type == CMD_BACKUP;
+}
+
+static void add_edge(ParallelJob *job, int from, int to) {
+  if (from == -1 || from == to) return; // Um comando pode repetir uma chave
+  JobEdge *edge = &job->edges[job->num_edges];
+  edge->to = to;
+  edge->next = job->slots[from].first_edge;
+  job->slots[from].first_edge = (int)job->num_edges++;
+  atomic_fetch_add_explicit(&job->slots[to].waiting, 1, memory_order_relaxed);
+}
+
+// Entrada da tabela de chaves da janela atual para uma chave (criada se ainda não existir).
+static JobKey *find_key(ParallelJob *job, const char *key) {
+  size_t hash = 14695981039346656037u;
+  for (const char *c = key; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char)*c) * 1099511628211u;
+  }
+  size_t size = 2 * job->max_keys;
+  for (size_t i = hash % size;; i = (i + 1) % size) {
+    JobKey *entry = &job->keys[i];
+    if (entry->window != job->window) {
+      *entry = (JobKey){.key = key, .window = job->window, .last_writer = -1, .readers = -1};
+      return entry;
+    }
+    if (strcmp(entry->key, key) == 0) return entry;
+  }
+}
+
+// Liga o comando index aos comandos anteriores da janela que usam as mesmas chaves.
+static void add_dependencies(ParallelJob *job, int index) {
+  JobCommand *command = job->commands[index];
+  if (command->invalid) return;
+  int reads = command->type == CMD_READ;
+  for (size_t i = 0; i < command->num_pairs; i++) {
+    JobKey *entry = find_key(job, command->keys[i]);
+    add_edge(job, entry->last_writer, index);
+    if (reads) {
+      JobEdge *reader = &job->reader_nodes[job->num_reader_nodes];
+      reader->to = index;
+      reader->next = entry->readers;
+      entry->readers = (int)job->num_reader_nodes++;
+    } else {
+      // Quem escreve espera também pelos leitores desde a última escrita
+      for (int r = entry->readers; r != -1; r = job->reader_nodes[r].next) {
+        add_edge(job, job->reader_nodes[r].to, index);
+      }
+      entry->readers = -1;
+      entry->last_writer = index;
+    }
+  }
+}
+
+// Garante que as tabelas do grafo comportam as chaves de uma janela.
+// @return 0 se comportam, 1 se faltou memória.
+static int reserve_keys(ParallelJob *job, size_t num_keys) {
+  if (num_keys <= job->max_keys) return 0;
+  size_t max_keys = job->max_keys > 0 ? job->max_keys : JOB_MIN_KEYS;
+  while (max_keys < num_keys) max_keys *= 2;
+  // As entradas novas ficam na janela 0, que nunca é a atual
+  JobKey *keys = calloc(2 * max_keys, sizeof(JobKey));
+  JobEdge *edges = malloc(2 * max_keys * sizeof(JobEdge));
+  JobEdge *readerNodes = malloc(max_keys * sizeof(JobEdge));
+  if (keys == NULL || edges == NULL || readerNodes == NULL) {
+    free(keys);
+    free(edges);
+    free(readerNodes);
+    return 1;
+  }
+  free(job->keys);
+  free(job->edges);
+  free(job->reader_nodes);
+  job->keys = keys;
+  job->edges = edges;
+  job->reader_nodes = readerNodes;
+  job->max_keys = max_keys;
+  return 0;
+}
+
+static void free_parallel_job(ParallelJob *job) {
+  for (size_t i = 0; i < job->num_allocated; i++) {
+    free(job->commands[i]);
+  }
+  free(job->barrier);
+  free(job->keys);
+  free(job->edges);
+  free(job->reader_nodes);
+  free(job);
+}
+
+static void run_slot(void *arg);
+static void advance(ParallelJob *job);
+
+static void resume_parallel(void *arg) {
+  advance(arg);
+}
+
+static void submit_slot(ParallelJob *job, JobSlot *slot) {
+  if (pool_submit(job->pool, run_slot, slot) != 0) {
+    run_slot(slot); // Sem memória para a deque corremo-lo já
+  }
+}
+
+// Escreve o output da janela no .out, pela ordem dos comandos.
+static void write_window(ParallelJob *job) {
+  for (size_t i = 0; i < job->num_commands; i++) {
+    JobSlot *slot = &job->slots[i];
+    output_write(&job->fd->out, slot->output, slot->output_len);
+    free(slot->output);
+  }
+  job->num_commands = 0;
+}
+
+// Corre o comando index da janela e liberta os que dependiam dele. Devolve um desses
+// comandos para a mesma tarefa continuar com ele (os outros vão para a pool), ou -1.
+static int run_window_command(ParallelJob *job, int index) {
+  JobSlot *slot = &job->slots[index];
+  output_init(&command_output, -1);
+  job_run_command(job->commands[index], job->fd, &command_output);
+  slot->output_len = command_output.len;
+  slot->output = malloc(command_output.len);
+  if (slot->output == NULL) {
+    slot->output_len = 0;
+  } else {
+    memcpy(slot->output, command_output.data, command_output.len);
+  }
+
+  int next = -1;
+  for (int e = slot->first_edge; e != -1; e = job->edges[e].next) {
+    int to = job->edges[e].to;
+    if (atomic_fetch_sub_explicit(&job->slots[to].waiting, 1, memory_order_acq_rel) == 1) {
+      if (next == -1) {
+        next = to;
+      } else {
+        submit_slot(job, &job->slots[to]);
+      }
+    }
+  }
+  // O último comando da janela escreve o output e continua o ficheiro
+  if (atomic_fetch_sub_explicit(&job->remaining, 1, memory_order_acq_rel) == 1) {
+    write_window(job);
+    advance(job);
+  }
+  return next;
+}
+
+static void run_slot(void *arg) {
+  JobSlot *slot = arg;
+  ParallelJob *job = slot->job;
+  int index = (int)(slot - job->slots);
+  while (index != -1) {
+    index = run_window_command(job, index);
+  }
+}
+
+// Corre um grupo de comandos prontos desde o início da janela.
+static void run_chunk(void *arg) {
+  JobChunk *chunk = arg;
+  ParallelJob *job = chunk->job;
+  // A janela não acaba antes do último comando do grupo, por isso podemos ler ready até lá
+  size_t first = chunk->first;
+  size_t count = chunk->count;
+  for (size_t i = 0; i < count; i++) {
+    int index = job->ready[first + i];
+    while (index != -1) {
+      index = run_window_command(job, index);
+    }
+  }
+}
+
+// Corre a barreira pendente e lê a próxima janela; só corre quando não há comandos do
+// ficheiro a correr.
+static void advance(ParallelJob *job) {
+  while (1) {
+    unsigned int delay = 0;
+    if (job->has_barrier) {
+      job->has_barrier = 0;
+      delay = job_run_command(job->barrier, job->fd, &job->fd->out);
+    }
+    // Os WAIT de outros ficheiros para este atrasam a próxima janela
+    delay += atomic_exchange(&job->fd->delay, 0);
+    if (delay > 0 && suspend(job->fd, delay, resume_parallel, job) == 0) return;
+    if (job->finished) {
+      job_finish(job->fd);
+      free_parallel_job(job);
+      return;
+    }
+
+    job->window++;
+    job->num_edges = 0;
+    job->num_reader_nodes = 0;
+    size_t numKeys = 0;
+    while (job->num_commands < JOB_WINDOW_SIZE) {
+      if (job->num_commands == job->num_allocated) {
+        // Sem memória para mais um comando, a janela fica com os que já tem
+        JobCommand *command = malloc(sizeof(JobCommand));
+        if (command == NULL) break;
+        job->commands[job->num_allocated++] = command;
+      }
+      JobCommand *command = job->commands[job->num_commands];
+      enum Command type = job_parse_command(&job->fd->reader, command);
+      if (type == EOC) {
+        job->finished = 1;
+        break;
+      }
+      if (type == CMD_EMPTY) continue;
+      if (is_barrier(type)) {
+        // Trocamos os buffers: o comando passa a barreira sem ser copiado
+        job->commands[job->num_commands] = job->barrier;
+        job->barrier = command;
+        job->has_barrier = 1;
+        break;
+      }
+      JobSlot *slot = &job->slots[job->num_commands++];
+      slot->job = job;
+      slot->first_edge = -1;
+      atomic_init(&slot->waiting, 0);
+      if (!command->invalid) numKeys += command->num_pairs;
+    }
+    if (job->num_commands == 0) continue;
+
+    if (reserve_keys(job, numKeys) != 0) {
+      // Sem memória para o grafo, os comandos da janela correm por ordem nesta tarefa
+      for (size_t i = 0; i < job->num_commands; i++) {
+        job_run_command(job->commands[i], job->fd, &job->fd->out);
+      }
+      job->num_commands = 0;
+      continue;
+    }
+    for (size_t i = 0; i < job->num_commands; i++) {
+      add_dependencies(job, (int)i);
+    }
+
+    // Os comandos prontos são escolhidos antes de algum correr: os outros passam a zero
+    // dependências quando os anteriores acabam e são submetidos por eles
+    size_t num_ready = 0;
+    for (size_t i = 0; i < job->num_commands; i++) {
+      if (atomic_load_explicit(&job->slots[i].waiting, memory_order_relaxed) == 0) {
+        job->ready[num_ready++] = (int)i;
+      }
+    }
+    // Contamos também esta tarefa, para a janela não acabar antes de submetermos tudo
+    atomic_store(&job->remaining, job->num_commands + 1);
+    // Os prontos vão para a pool em grupos, para não pagarmos uma tarefa por comando
+    size_t num_chunks = 0;
+    for (size_t first = 0; first < num_ready; first += JOB_CHUNK_SIZE) {
+      JobChunk *chunk = &job->chunks[num_chunks++];
+      *chunk = (JobChunk){.job = job, .first = first,
+                          .count = num_ready - first < JOB_CHUNK_SIZE ? num_ready - first : JOB_CHUNK_SIZE};
+    }
+    for (size_t i = 0; i < num_chunks; i++) {
+      if (pool_submit(job->pool, run_chunk, &job->chunks[i]) != 0) {
+        run_chunk(&job->chunks[i]);
+      }
+    }
+    if (atomic_fetch_sub_explicit(&job->remaining, 1, memory_order_acq_rel) != 1) return;
+    write_window(job);
+  }
+}
+
+void job_run_parallel(in_out_fds *fd) {
+  ParallelJob *job = calloc(1, sizeof(ParallelJob));
+  if (job != NULL) {
+    job->commands[0] = malloc(sizeof(JobCommand));
+    job->barrier = malloc(sizeof(JobCommand));
+    job->num_allocated = job->commands[0] != NULL;
+  }
+  if (job == NULL || job->commands[0] == NULL || job->barrier == NULL) {
+    // Sem memória para a janela, o ficheiro corre por ordem
+    if (job != NULL) free_parallel_job(job);
+    job_run(fd);
+    return;
+  }
+  job->fd = fd;
+  job->pool = fd->pool;
+  advance(job);
+}
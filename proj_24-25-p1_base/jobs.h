@@ -0,0 +1,135 @@
+#ifndef KVS_JOBS_H
+#define KVS_JOBS_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "constants.h"
+#include "parser.h"
+#include "output.h"
+#include "operations.h"
+
+/* Execução dos comandos de um ficheiro .job. Por omissão os comandos correm por ordem na
+ tarefa do ficheiro. Com -p, o ficheiro é lido em janelas de até JOB_WINDOW_SIZE comandos e
+ cada janela vira um grafo de dependências pelas chaves: um WRITE/DELETE espera pelos comandos
+ anteriores da janela que usam as mesmas chaves, um READ só pelos WRITE/DELETE anteriores.
+ Os comandos sem dependências por resolver correm em paralelo na pool e o output de cada
+ um é guardado à parte, para ser escrito no .out pela ordem original quando a janela acaba.
+ SHOW, SCAN, WAIT e BACKUP não entram em janelas: correm sozinhos entre duas janelas.
+
+ Um WAIT não prende o worker: o ficheiro é suspenso e volta à pool como tarefa adiada
+ (pool_submit_after), e o worker passa a outros ficheiros entretanto. "WAIT delay thread_id"
+ atrasa o ficheiro número thread_id (pela ordem em que a main os encontra, a partir de 1)
+ antes do seu próximo comando (ou da próxima janela, com -p), sem atrasar quem o pediu. */
+
+// Número máximo de comandos de uma janela
+#define JOB_WINDOW_SIZE 128
+// Comandos prontos no início de uma janela que vão juntos numa tarefa da pool
+#define JOB_CHUNK_SIZE 16
+
+// Um comando já lido do ficheiro
+typedef struct JobCommand {
+  enum Command type;
+  int invalid;        // Argumentos inválidos: o output do comando é só "\n"
+  size_t num_pairs;
+  unsigned int delay;
+  unsigned int thread_id; // Ficheiro que um WAIT atrasa, 0 para o próprio
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE]; // keys[0] é o prefixo de um SCAN
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+} JobCommand;
+
+// Comando de uma janela e as arestas do grafo que saem dele
+typedef struct JobSlot {
+  struct ParallelJob *job;
+  atomic_size_t waiting; // Comandos anteriores de que ainda depende
+  int first_edge;        // Primeira aresta para um comando que depende deste (-1 se nenhum)
+  char *output;          // Output do comando, escrito no .out quando a janela acaba
+  size_t output_len;
+} JobSlot;
+
+// Grupo de comandos prontos (em ParallelJob.ready) corridos por uma tarefa
+typedef struct JobChunk {
+  struct ParallelJob *job;
+  size_t first, count;
+} JobChunk;
+
+typedef struct JobEdge {
+  int to;
+  int next;
+} JobEdge;
+
+// Chave usada na janela: o último WRITE/DELETE e os READ que vieram depois dele
+typedef struct JobKey {
+  const char *key;
+  size_t window;   // Janela em que a entrada foi usada (as outras estão livres)
+  int last_writer; // -1 se nenhum
+  int readers;     // Lista de leitores em JobParallel.reader_nodes (-1 se vazia)
+} JobKey;
+
+// Chaves para que as tabelas de uma janela são alocadas da primeira vez
+#define JOB_MIN_KEYS 64
+
+// Os comandos (cerca de 20 KB cada) e as tabelas do grafo são alocados à medida que as
+// janelas os usam e reaproveitados nas seguintes, para um ficheiro curto ou de comandos
+// pequenos não pagar o tamanho da maior janela possível.
+typedef struct ParallelJob {
+  in_out_fds *fd;
+  ThreadPool *pool;
+  JobCommand *commands[JOB_WINDOW_SIZE];
+  size_t num_allocated;    // Comandos já alocados, do início de commands
+  JobSlot slots[JOB_WINDOW_SIZE];
+  size_t num_commands;
+  int ready[JOB_WINDOW_SIZE];        // Comandos sem dependências no início da janela
+  JobChunk chunks[JOB_WINDOW_SIZE];
+  atomic_size_t remaining; // Comandos da janela ainda por acabar
+  JobCommand *barrier;     // Comando que fechou a janela e corre depois dela
+  int has_barrier;
+  int finished;            // Chegámos ao fim do ficheiro
+  size_t window;
+  size_t max_keys;         // Chaves que as tabelas seguintes comportam
+  JobKey *keys;            // 2 * max_keys entradas
+  JobEdge *edges;          // 2 * max_keys arestas
+  size_t num_edges;
+  JobEdge *reader_nodes;   // max_keys leitores; to é o leitor
+  size_t num_reader_nodes;
+} ParallelJob;
+
+/// Reads the next command of a job file.
+/// @param reader Reader of the job file.
+/// @param command Set to the command and its arguments.
+/// @return Type of the command (EOC at the end of the file).
+enum Command job_parse_command(JobReader *reader, JobCommand *command);
+
+/// Numbers a job file (its thread_id) so WAITs in other files can delay it. Files are
+/// numbered from 1 in the order they are registered.
+/// @param fd The job file.
+/// @return 0 if the file was registered, 1 otherwise.
+int job_register(in_out_fds *fd);
+
+/// Forgets a job file, so WAITs no longer delay it.
+/// @param fd The job file.
+void job_unregister(in_out_fds *fd);
+
+/// Runs a command. A WAIT doesn't sleep: it returns its delay for the caller to suspend the
+/// job.
+/// @param command Command to run.
+/// @param fd Job file the command belongs to (for WAIT and BACKUP).
+/// @param out Buffer to write the output of the command.
+/// @return Delay in milliseconds before the next command of the file, 0 for none.
+unsigned int job_run_command(JobCommand *command, in_out_fds *fd, OutputBuffer *out);
+
+/// Flushes the output of a job file, closes it and frees its in_out_fds.
+/// @param fd The job file.
+void job_finish(in_out_fds *fd);
+
+/// Runs the commands of a job file in order (a task of fd->pool). Returns when the file is
+/// suspended by a WAIT, which resubmits it to the pool afterwards, or finished (job_finish).
+/// @param fd_info in_out_fds of the job file, already open.
+void job_run(void *fd_info);
+
+/// Runs the commands of a job file in parallel on fd->pool, keeping the output in order.
+/// Returns as soon as the first window is submitted; the file is finished (job_finish) by
+/// the task that completes its last command.
+/// @param fd The job file, already open.
+void job_run_parallel(in_out_fds *fd);
+
+#endif  // KVS_JOBS_H
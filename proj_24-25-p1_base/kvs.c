@@ -2,117 +2,1068 @@
 #include "string.h"
 
 #include <stdlib.h>
-#include <ctype.h>
-#include "operations.h"
+#include <stddef.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+
+// Hash function: FNV-1a over the whole key, followed by a 64-bit finalizer (the one
+// used by MurmurHash3) so that keys sharing long prefixes still spread over every bucket.
+// @param key Null terminated key.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+uint64_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)key; *c != '\0'; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline size_t stripe_of(uint64_t h) {
+    return (size_t)(h & (LOCK_STRIPES - 1));
+}
+
+uint64_t key_stripe(const char *key) {
+    return 1ULL << stripe_of(hash(key));
+}
+
+void lock_stripes(HashTable *ht, uint64_t stripes, int write) {
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        if (stripes & (1ULL << s)) {
+            if (write) {
+                pthread_rwlock_wrlock(&ht->stripe_locks[s]);
+            } else {
+                pthread_rwlock_rdlock(&ht->stripe_locks[s]);
+            }
+        }
+    }
+}
+
+void unlock_stripes(HashTable *ht, uint64_t stripes) {
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        if (stripes & (1ULL << s)) {
+            pthread_rwlock_unlock(&ht->stripe_locks[s]);
+        }
+    }
+}
+
+static void free_node(EpochEntry *entry) {
+    slab_free((char *)entry - offsetof(KeyNode, retire));
+}
+
+static void free_bucket_array(EpochEntry *entry) {
+    free((BucketArray *)((char *)entry - offsetof(BucketArray, retire)));
+}
+
+static BucketArray *new_bucket_array(size_t size) {
+    // Os contadores do filtro vêm na mesma alocação, a seguir aos buckets
+    size_t counters = size * BLOOM_COUNTERS_PER_BUCKET;
+    BucketArray *array = malloc(sizeof(BucketArray) + size * sizeof(_Atomic(KeyNode *)) + counters);
+    if (array == NULL) return NULL;
+    array->size = size;
+    array->bloom = (_Atomic uint8_t *)(void *)&array->buckets[size];
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&array->buckets[i], NULL);
+    }
+    for (size_t i = 0; i < counters; i++) {
+        atomic_init(&array->bloom[i], 0);
+    }
+    return array;
+}
+
+// Positions of a key in the filter of an array, all in the part of the key's stripe. The
+// low bits of h already choose the stripe and the bucket, so h is mixed again first.
+static void bloom_positions(const BucketArray *array, uint64_t h, size_t positions[BLOOM_HASHES]) {
+    size_t stripeCounters = array->size * BLOOM_COUNTERS_PER_BUCKET / LOCK_STRIPES;
+    size_t base = stripe_of(h) * stripeCounters;
+    uint64_t mixed = h * 0x9e3779b97f4a7c15ULL;
+    uint32_t h1 = (uint32_t)(mixed >> 32);
+    uint32_t h2 = (uint32_t)mixed | 1;
+    for (uint32_t i = 0; i < BLOOM_HASHES; i++) {
+        positions[i] = base + ((size_t)(h1 + i * h2) & (stripeCounters - 1));
+    }
+}
+
+// 0 se a chave de hash h não está de certeza no array, 1 se pode estar.
+static int bloom_maybe(const BucketArray *array, uint64_t h) {
+    size_t positions[BLOOM_HASHES];
+    bloom_positions(array, h, positions);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        if (atomic_load_explicit(&array->bloom[positions[i]], memory_order_relaxed) == 0) return 0;
+    }
+    return 1;
+}
+
+// Conta uma chave que vai entrar no array, antes de o nó ser publicado. Quem chama tem a
+// stripe da chave bloqueada para escrita.
+static void bloom_add(BucketArray *array, uint64_t h) {
+    size_t positions[BLOOM_HASHES];
+    bloom_positions(array, h, positions);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint8_t count = atomic_load_explicit(&array->bloom[positions[i]], memory_order_relaxed);
+        if (count < UINT8_MAX) {
+            atomic_store_explicit(&array->bloom[positions[i]], (uint8_t)(count + 1), memory_order_relaxed);
+        }
+    }
+}
+
+// Desconta uma chave que saiu do array, depois de o nó ser retirado da lista.
+static void bloom_remove(BucketArray *array, uint64_t h) {
+    size_t positions[BLOOM_HASHES];
+    bloom_positions(array, h, positions);
+    for (int i = 0; i < BLOOM_HASHES; i++) {
+        uint8_t count = atomic_load_explicit(&array->bloom[positions[i]], memory_order_relaxed);
+        if (count > 0 && count < UINT8_MAX) {
+            atomic_store_explicit(&array->bloom[positions[i]], (uint8_t)(count - 1), memory_order_relaxed);
+        }
+    }
+}
+
+// Como uma pesquisa falhou, para as estatísticas dos filtros
+enum BloomMiss {
+    MISS_NONE,     // A chave existe (ou nem podia existir): não conta
+    MISS_FILTERED, // Os filtros excluíram a chave
+    MISS_SEARCHED  // Falso positivo: um bucket foi pesquisado em vão
+};
+
+// Regista uma pesquisa de uma chave que não existia.
+static void bloom_count_miss(HashTable *ht, uint64_t h, int filtered) {
+    BloomStats *stats = &ht->bloom_stats[stripe_of(h)];
+    atomic_fetch_add_explicit(filtered ? &stats->negatives : &stats->false_positives, 1, memory_order_relaxed);
+}
+
+// Copia uma chave para um slot de MAX_STRING_SIZE bytes com zeros depois do '\0', que é como
+// as chaves estão nos nós. Devolve 1 se a chave não cabe (e então não pode estar na tabela).
+static int pad_key(char slot[MAX_STRING_SIZE], const char *key) {
+    size_t keyLen = strnlen(key, MAX_STRING_SIZE);
+    if (keyLen >= MAX_STRING_SIZE) return 1;
+    memcpy(slot, key, keyLen);
+    memset(slot + keyLen, 0, MAX_STRING_SIZE - keyLen);
+    return 0;
+}
+
+// Compares two padded keys (pad_key) as fixed-width blocks, without looking for the '\0'.
+static inline int key_equals(const char *a, const char *b) {
+#ifdef __SSE2__
+    _Static_assert(MAX_STRING_SIZE % 8 == 0, "keys are compared in blocks of 16 and 8 bytes");
+    __m128i equal = _mm_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 16 <= MAX_STRING_SIZE; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(const void *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(const void *)(b + i));
+        equal = _mm_and_si128(equal, _mm_cmpeq_epi8(x, y));
+    }
+    for (; i < MAX_STRING_SIZE; i += 8) {
+        // As metades de cima vêm a zeros nos dois lados
+        __m128i x = _mm_loadl_epi64((const __m128i *)(const void *)(a + i));
+        __m128i y = _mm_loadl_epi64((const __m128i *)(const void *)(b + i));
+        equal = _mm_and_si128(equal, _mm_cmpeq_epi8(x, y));
+    }
+    return _mm_movemask_epi8(equal) == 0xffff;
+#else
+    return memcmp(a, b, MAX_STRING_SIZE) == 0;
+#endif
+}
+
+// A chave e o valor são guardados no próprio nó, por isso um nó novo é uma única alocação
+// (da cache da thread, na maior parte das vezes). key já vem num slot (pad_key).
+static KeyNode *new_node(HashTable *ht, const char key[MAX_STRING_SIZE], const char *value, uint64_t h, uint64_t version, KeyNode *next) {
+    size_t valueLen = strlen(value);
+    if (valueLen >= MAX_STRING_SIZE) return NULL;
+
+    KeyNode *keyNode = slab_alloc(&ht->nodes);
+    if (keyNode == NULL) return NULL;
+    memcpy(keyNode->key, key, MAX_STRING_SIZE);
+    memcpy(keyNode->value, value, valueLen + 1);
+    keyNode->hash = h;
+    keyNode->version = version;
+    keyNode->index = NULL;
+    atomic_init(&keyNode->next, next);
+    return keyNode;
+}
+
+// Marks a stripe (already locked for writing) as being modified for the optimistic readers.
+static void stripe_begin_write(HashTable *ht, size_t stripe) {
+    atomic_store_explicit(&ht->stripe_seq[stripe],
+                          atomic_load_explicit(&ht->stripe_seq[stripe], memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void stripe_write_lock(HashTable *ht, size_t stripe) {
+    pthread_rwlock_wrlock(&ht->stripe_locks[stripe]);
+    stripe_begin_write(ht, stripe);
+}
+
+static int stripe_write_trylock(HashTable *ht, size_t stripe) {
+    if (pthread_rwlock_trywrlock(&ht->stripe_locks[stripe]) != 0) return 1;
+    stripe_begin_write(ht, stripe);
+    return 0;
+}
+
+static void stripe_write_unlock(HashTable *ht, size_t stripe) {
+    atomic_store_explicit(&ht->stripe_seq[stripe],
+                          atomic_load_explicit(&ht->stripe_seq[stripe], memory_order_relaxed) + 1,
+                          memory_order_release);
+    pthread_rwlock_unlock(&ht->stripe_locks[stripe]);
+}
+
+// Returns the bucket where a key with hash h lives (and its array). While a resize is in
+// progress the buckets of the old array that were not migrated yet are still the valid ones.
+// The caller must hold the stripe of h.
+static _Atomic(KeyNode *) *bucket_for(HashTable *ht, uint64_t h, BucketArray **array) {
+    BucketArray *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old != NULL) {
+        size_t oldIndex = (size_t)(h & (old->size - 1));
+        if (oldIndex / LOCK_STRIPES >= ht->stripe_rehash[stripe_of(h)]) {
+            *array = old;
+            return &old->buckets[oldIndex];
+        }
+    }
+    BucketArray *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    *array = current;
+    return &current->buckets[h & (current->size - 1)];
+}
+
+// Moves up to REHASH_STEP old buckets of one stripe to the current array, so that the
+// cost of a resize is spread over many writes instead of stalling a single one.
+// Both arrays have a multiple of LOCK_STRIPES buckets, so the nodes of an old bucket
+// stay in the same stripe. The caller must hold the stripe in write mode.
+//
+// Readers look at the old bucket and then at the new one, so the nodes are copied to the
+// new bucket before the old one is emptied, and the migration only starts after a grace
+// period, when no reader is still using the array that was current before the resize.
+static void rehash_step(HashTable *ht, size_t stripe) {
+    BucketArray *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old == NULL) return;
+
+    size_t stripeBuckets = old->size / LOCK_STRIPES;
+    if (ht->stripe_rehash[stripe] == stripeBuckets) return;
+    if (!epoch_grace_elapsed(ht->rehash_epoch)) return;
+
+    BucketArray *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    for (int step = 0; step < REHASH_STEP && ht->stripe_rehash[stripe] < stripeBuckets; step++) {
+        size_t oldIndex = stripe + ht->stripe_rehash[stripe] * LOCK_STRIPES;
+        KeyNode *first = atomic_load_explicit(&old->buckets[oldIndex], memory_order_relaxed);
+        KeyNode *keyNode;
+        for (keyNode = first; keyNode != NULL; keyNode = atomic_load_explicit(&keyNode->next, memory_order_relaxed)) {
+            _Atomic(KeyNode *) *bucket = &current->buckets[keyNode->hash & (current->size - 1)];
+            KeyNode *copy = new_node(ht, keyNode->key, keyNode->value, keyNode->hash, keyNode->version,
+                                     atomic_load_explicit(bucket, memory_order_relaxed));
+            if (copy == NULL) break;
+            copy->index = keyNode->index;
+            copy->index->node = copy;
+            bloom_add(current, keyNode->hash);
+            atomic_store_explicit(bucket, copy, memory_order_release);
+        }
+        if (keyNode != NULL) {
+            // Sem memória: desfazemos as cópias deste bucket e tentamos mais tarde
+            for (KeyNode *copied = first; copied != keyNode; copied = atomic_load_explicit(&copied->next, memory_order_relaxed)) {
+                copied->index->node = copied;
+                _Atomic(KeyNode *) *bucket = &current->buckets[copied->hash & (current->size - 1)];
+                KeyNode *copy = atomic_load_explicit(bucket, memory_order_relaxed);
+                atomic_store_explicit(bucket, atomic_load_explicit(&copy->next, memory_order_relaxed), memory_order_release);
+                bloom_remove(current, copy->hash);
+                epoch_retire(&copy->retire, free_node);
+            }
+            return;
+        }
+        atomic_store_explicit(&old->buckets[oldIndex], NULL, memory_order_release);
+        while (first != NULL) {
+            KeyNode *next = atomic_load_explicit(&first->next, memory_order_relaxed);
+            epoch_retire(&first->retire, free_node);
+            first = next;
+        }
+        ht->stripe_rehash[stripe]++;
+    }
+
+    if (ht->stripe_rehash[stripe] == stripeBuckets) {
+        atomic_fetch_add(&ht->stripes_rehashed, 1);
     }
-    return -1; // Invalid index for non-alphabetic or number strings
 }
 
+// Called after every write, without any stripe locked. Starting and finishing a resize
+// need the whole table, but both only swap pointers: the nodes are moved by rehash_step,
+// either by writers of the stripe or here, by helping a stripe that isn't busy.
+static void maybe_resize(HashTable *ht) {
+    if (atomic_load(&ht->resizing)) {
+        size_t stripe = atomic_fetch_add(&ht->rehash_cursor, 1) % LOCK_STRIPES;
+        if (stripe_write_trylock(ht, stripe) == 0) {
+            rehash_step(ht, stripe);
+            stripe_write_unlock(ht, stripe);
+        }
+        if (atomic_load(&ht->stripes_rehashed) < LOCK_STRIPES) return;
+
+        lock_stripes(ht, ALL_STRIPES, 1);
+        BucketArray *old = atomic_load(&ht->old_table);
+        if (old != NULL && atomic_load(&ht->stripes_rehashed) == LOCK_STRIPES) {
+            // Um leitor pode ainda estar a olhar para o array antigo (já vazio)
+            atomic_store(&ht->old_table, NULL);
+            epoch_retire(&old->retire, free_bucket_array);
+            atomic_store(&ht->resizing, 0);
+        }
+        unlock_stripes(ht, ALL_STRIPES);
+        return;
+    }
+
+    if (atomic_load(&ht->count) <= atomic_load(&ht->grow_at)) return;
+
+    lock_stripes(ht, ALL_STRIPES, 1);
+    BucketArray *current = atomic_load(&ht->table);
+    if (atomic_load(&ht->old_table) == NULL && atomic_load(&ht->count) > atomic_load(&ht->grow_at)) {
+        // Só alocamos o novo array (vazio); se falhar continuamos com a tabela atual
+        BucketArray *newTable = new_bucket_array(current->size * 2);
+        if (newTable != NULL) {
+            // old_table é publicado antes de table: um leitor que veja o array novo também vê o antigo
+            atomic_store(&ht->old_table, current);
+            atomic_store(&ht->table, newTable);
+            ht->rehash_epoch = epoch_current();
+            memset(ht->stripe_rehash, 0, sizeof(ht->stripe_rehash));
+            atomic_store(&ht->stripes_rehashed, 0);
+            atomic_store(&ht->grow_at, newTable->size * MAX_LOAD_FACTOR);
+            atomic_store(&ht->resizing, 1);
+        }
+    }
+    unlock_stripes(ht, ALL_STRIPES);
+}
 
 struct HashTable* create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));
+  // A tabela tem campos alinhados à linha de cache (BloomStats), que o malloc não garante
+  HashTable *ht = aligned_alloc(_Alignof(HashTable), sizeof(HashTable));
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
+  BucketArray *table = new_bucket_array(INITIAL_TABLE_SIZE);
+  if (!table) {
+      free(ht);
+      return NULL;
+  }
+  atomic_init(&ht->table, table);
+  atomic_init(&ht->old_table, NULL);
+  if (slab_init(&ht->nodes, sizeof(KeyNode), KEY_NODE_ALIGNMENT) != 0) {
+      free(table);
+      free(ht);
+      return NULL;
+  }
+  if (index_pools_init(&ht->index_pools) != 0) {
+      slab_destroy(&ht->nodes);
+      free(table);
+      free(ht);
+      return NULL;
   }
+  for (int i = 0; i < LOCK_STRIPES; i++) {
+      if (skiplist_init(&ht->index[i]) != 0) {
+          while (i-- > 0) skiplist_destroy(&ht->index[i]);
+          index_pools_destroy(&ht->index_pools);
+          slab_destroy(&ht->nodes);
+          free(table);
+          free(ht);
+          return NULL;
+      }
+  }
+  ht->rehash_epoch = 0;
+  memset(ht->stripe_rehash, 0, sizeof(ht->stripe_rehash));
+  atomic_init(&ht->stripes_rehashed, 0);
+  atomic_init(&ht->rehash_cursor, 0);
+  atomic_init(&ht->resizing, 0);
+  atomic_init(&ht->grow_at, INITIAL_TABLE_SIZE * MAX_LOAD_FACTOR);
+  atomic_init(&ht->count, 0);
+  for (int i = 0; i < LOCK_STRIPES; i++) {
+      atomic_init(&ht->stripe_seq[i], 0);
+      pthread_rwlock_init(&ht->stripe_locks[i], NULL);
+  }
+  atomic_init(&ht->track_changes, 0);
+  atomic_init(&ht->version, 0);
+  atomic_init(&ht->changes_floor, UINT64_MAX);
+  atomic_init(&ht->changes_lost, 0);
+  memset(ht->changes, 0, sizeof(ht->changes));
+  pthread_mutex_init(&ht->snapshot_mutex, NULL);
+  ht->snapshots = NULL;
+  atomic_init(&ht->snapshots_active, 0);
+  atomic_init(&ht->snapshot_max, 0);
+  memset(ht->stale, 0, sizeof(ht->stale));
+  for (int i = 0; i < LOCK_STRIPES; i++) {
+      atomic_init(&ht->bloom_stats[i].negatives, 0);
+      atomic_init(&ht->bloom_stats[i].false_positives, 0);
+  }
+  ht->batch_hook = NULL;
+  ht->batch_hook_arg = NULL;
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    write_lock_kvs_mutex();
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
+// Returns the version of a change made with its stripe locked for writing. The version only
+// advances while someone needs it (change tracking or a snapshot); otherwise the change gets
+// the current version, which is enough since no snapshot can start in the middle of it.
+static uint64_t next_version(HashTable *ht) {
+    if (atomic_load_explicit(&ht->track_changes, memory_order_relaxed) || atomic_load(&ht->snapshots_active) > 0) {
+        return atomic_fetch_add(&ht->version, 1) + 1;
+    }
+    return atomic_load_explicit(&ht->version, memory_order_relaxed);
+}
+
+// A lista stale de uma stripe é ligada pelo retire.next dos nós, que ainda não foram retirados
+static void push_stale(HashTable *ht, size_t stripe, KeyNode *keyNode) {
+    keyNode->retire.next = ht->stale[stripe] ? &ht->stale[stripe]->retire : NULL;
+    ht->stale[stripe] = keyNode;
+}
+
+static KeyNode *stale_next(KeyNode *keyNode) {
+    if (keyNode->retire.next == NULL) return NULL;
+    return (KeyNode *)(void *)((char *)keyNode->retire.next - offsetof(KeyNode, retire));
+}
+
+// Hands over a node that was replaced or deleted (at the given version). If a registered
+// snapshot may still see it, it goes to the stripe's stale list instead of the reclaimer.
+// The caller holds the stripe in write mode.
+static void supersede_node(HashTable *ht, size_t stripe, KeyNode *keyNode, uint64_t version) {
+    if (atomic_load(&ht->snapshots_active) > 0 && keyNode->version <= atomic_load(&ht->snapshot_max)) {
+        keyNode->superseded = version;
+        push_stale(ht, stripe, keyNode);
+        return;
+    }
+    epoch_retire(&keyNode->retire, free_node);
+}
+
+// Records that a key of a stripe changed. The caller holds the stripe in write mode, so the
+// versions of each stripe's log are increasing.
+static void record_change(HashTable *ht, size_t stripe, const char *key, uint64_t version) {
+    if (!atomic_load_explicit(&ht->track_changes, memory_order_relaxed)) return;
+    ChangeLog *log = &ht->changes[stripe];
+
+    // Descartamos primeiro as entradas que nenhum backup vai pedir
+    uint64_t floor = atomic_load(&ht->changes_floor);
+    while (log->start < log->len && log->entries[log->start].version <= floor) {
+        log->start++;
+    }
+    if (log->start == log->len) {
+        log->start = log->len = 0;
+    }
+    if (log->len == log->capacity) {
+        if (log->start > 0) {
+            memmove(log->entries, log->entries + log->start, (log->len - log->start) * sizeof(ChangeEntry));
+            log->len -= log->start;
+            log->start = 0;
+        } else {
+            size_t capacity = log->capacity ? 2 * log->capacity : 16;
+            ChangeEntry *entries = realloc(log->entries, capacity * sizeof(ChangeEntry));
+            if (entries == NULL) {
+                // Os backups anteriores a esta versão deixam de poder ter deltas
+                atomic_store(&ht->changes_lost, version);
+                return;
+            }
+            log->entries = entries;
+            log->capacity = capacity;
+        }
+    }
+    ChangeEntry *entry = &log->entries[log->len++];
+    entry->version = version;
+    strcpy(entry->key, key);
+}
+
+// Writes one pair. The caller holds the stripe of h in write mode.
+static int write_locked(HashTable *ht, const char *key, const char *value, uint64_t h) {
+    char slot[MAX_STRING_SIZE];
+    if (pad_key(slot, key)) return 1;
+    size_t stripe = stripe_of(h);
+    BucketArray *array;
+    _Atomic(KeyNode *) *bucket = bucket_for(ht, h, &array);
+    _Atomic(KeyNode *) *link = bucket;
+    // Uma chave que o filtro exclui é nova: não é preciso procurá-la na lista
+    KeyNode *keyNode = bloom_maybe(array, h) ? atomic_load_explicit(link, memory_order_relaxed) : NULL;
 
     // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            unlock_kvs_mutex();
+        if (keyNode->hash == h && key_equals(keyNode->key, slot)) {
+            // Substituímos o nó por uma cópia com o novo valor; o antigo pode estar a ser lido
+            uint64_t version = next_version(ht);
+            KeyNode *newNode = new_node(ht, slot, value, h, version, atomic_load_explicit(&keyNode->next, memory_order_relaxed));
+            if (newNode == NULL) return 1;
+            newNode->index = keyNode->index;
+            newNode->index->node = newNode;
+            atomic_store_explicit(link, newNode, memory_order_release);
+            supersede_node(ht, stripe, keyNode, version);
+            record_change(ht, stripe, key, version);
             return 0;
         }
-        keyNode = keyNode->next; // Move to the next node
+        link = &keyNode->next;
+        keyNode = atomic_load_explicit(link, memory_order_relaxed); // Move to the next node
     }
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
-    unlock_kvs_mutex();
+    // Key not found, create a new key node at the start of the list
+    uint64_t version = next_version(ht);
+    keyNode = new_node(ht, slot, value, h, version, atomic_load_explicit(bucket, memory_order_relaxed));
+    if (keyNode == NULL) return 1;
+    keyNode->index = skiplist_insert(&ht->index[stripe], &ht->index_pools, keyNode, h);
+    if (keyNode->index == NULL) {
+        slab_free(keyNode); // Ainda não foi publicado
+        return 1;
+    }
+    bloom_add(array, h);
+    atomic_store_explicit(bucket, keyNode, memory_order_release);
+    atomic_fetch_add(&ht->count, 1);
+    record_change(ht, stripe, key, version);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    char* value;
+// Deletes one key. The caller holds the stripe of h in write mode.
+static int delete_locked(HashTable *ht, const char *key, uint64_t h) {
+    char slot[MAX_STRING_SIZE];
+    if (pad_key(slot, key)) return 1;
+    BucketArray *array;
+    _Atomic(KeyNode *) *link = bucket_for(ht, h, &array);
+    if (!bloom_maybe(array, h)) {
+        bloom_count_miss(ht, h, 1);
+        return 1;
+    }
+    KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
 
+    // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            unlock_kvs_mutex();
-            return value; // Return copy of the value if found
+        if (keyNode->hash == h && key_equals(keyNode->key, slot)) {
+            // Key found; bypass it. The node keeps its next pointer for readers that are on it
+            atomic_store_explicit(link, atomic_load_explicit(&keyNode->next, memory_order_relaxed), memory_order_release);
+            bloom_remove(array, h);
+            skiplist_remove(&ht->index[stripe_of(h)], keyNode->index);
+            uint64_t version = next_version(ht);
+            supersede_node(ht, stripe_of(h), keyNode, version);
+            atomic_fetch_sub(&ht->count, 1);
+            record_change(ht, stripe_of(h), key, version);
+            return 0;
         }
-        keyNode = keyNode->next; // Move to the next node
+        link = &keyNode->next;
+        keyNode = atomic_load_explicit(link, memory_order_relaxed); // Move to the next node
     }
-    return NULL; // Key not found
+    bloom_count_miss(ht, h, 0);
+    return 1;
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    write_lock_kvs_mutex();
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+// Locks every stripe of a batch in write mode (in ascending order) and marks them all as
+// being modified before any change, so the batch is seen as a unit.
+static void batch_lock(HashTable *ht, uint64_t stripes) {
+    lock_stripes(ht, stripes, 1);
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        if (stripes & (1ULL << s)) {
+            stripe_begin_write(ht, s);
+            rehash_step(ht, s);
+        }
+    }
+}
 
-    // Search for the key node
+static void batch_unlock(HashTable *ht, uint64_t stripes) {
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        if (stripes & (1ULL << s)) {
+            stripe_write_unlock(ht, s);
+        }
+    }
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    uint64_t h = hash(key);
+    size_t stripe = stripe_of(h);
+    stripe_write_lock(ht, stripe);
+    rehash_step(ht, stripe);
+    int result = write_locked(ht, key, value, h);
+    stripe_write_unlock(ht, stripe);
+    maybe_resize(ht);
+    return result;
+}
+
+uint64_t write_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int failed[]) {
+    uint64_t hashes[MAX_WRITE_SIZE];
+    uint64_t stripes = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+        hashes[i] = hash(keys[i]);
+        stripes |= 1ULL << stripe_of(hashes[i]);
+    }
+
+    batch_lock(ht, stripes);
+    // Pela ordem do comando, para que a última escrita de uma chave repetida prevaleça
+    for (size_t i = 0; i < num_pairs; i++) {
+        failed[i] = write_locked(ht, keys[i], values[i], hashes[i]);
+    }
+    uint64_t record = 0;
+    if (ht->batch_hook != NULL) {
+        record = ht->batch_hook(ht->batch_hook_arg, num_pairs, keys, values, failed);
+    }
+    batch_unlock(ht, stripes);
+    maybe_resize(ht);
+    return record;
+}
+
+// Searches one bucket without locks. The key comes padded (pad_key).
+static KeyNode *find_in_bucket(BucketArray *array, const char *key, uint64_t h) {
+    KeyNode *keyNode = atomic_load_explicit(&array->buckets[h & (array->size - 1)], memory_order_acquire);
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+        if (keyNode->hash == h && key_equals(keyNode->key, key)) {
+            return keyNode;
+        }
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire); // Move to the next node
+    }
+    return NULL;
+}
+
+// Lock-free lookup. table is loaded before old_table (the reverse of the order in which a
+// resize publishes them) and the old bucket is searched first, because a migrated node is
+// always copied to the new bucket before it disappears from the old one.
+// Each array is only searched if its filter doesn't rule the key out. The miss isn't
+// counted here: *miss says how the lookup failed, and the caller counts it once the read
+// is kept (an optimistic read may be repeated).
+static KeyNode *find_node(HashTable *ht, const char *key, uint64_t h, enum BloomMiss *miss) {
+    char slot[MAX_STRING_SIZE];
+    *miss = MISS_NONE;
+    if (pad_key(slot, key)) return NULL;
+    BucketArray *current = atomic_load_explicit(&ht->table, memory_order_acquire);
+    BucketArray *old = atomic_load_explicit(&ht->old_table, memory_order_acquire);
+    int searched = 0;
+    if (old != NULL && bloom_maybe(old, h)) {
+        KeyNode *keyNode = find_in_bucket(old, slot, h);
+        if (keyNode != NULL) return keyNode;
+        searched = 1;
+    }
+    if (bloom_maybe(current, h)) {
+        KeyNode *keyNode = find_in_bucket(current, slot, h);
+        if (keyNode != NULL) return keyNode;
+        searched = 1;
+    }
+    *miss = searched ? MISS_SEARCHED : MISS_FILTERED;
+    return NULL;
+}
+
+static void count_miss(HashTable *ht, uint64_t h, enum BloomMiss miss) {
+    if (miss != MISS_NONE) bloom_count_miss(ht, h, miss == MISS_FILTERED);
+}
+
+static const char *read_key(HashTable *ht, const char *key, uint64_t h, enum BloomMiss *miss) {
+    KeyNode *keyNode = find_node(ht, key, h, miss);
+    if (keyNode == NULL) return NULL; // Key not found
+    return keyNode->value; // O nó não é libertado enquanto estivermos na secção da época
+}
+
+const char *read_pair(HashTable *ht, const char *key) {
+    uint64_t h = hash(key);
+    enum BloomMiss miss;
+    const char *value = read_key(ht, key, h, &miss);
+    count_miss(ht, h, miss);
+    return value;
+}
+
+void read_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                void (*visit)(void *arg, size_t index, const char *value), void *arg) {
+    uint64_t hashes[MAX_WRITE_SIZE];
+    enum BloomMiss misses[MAX_WRITE_SIZE];
+    uint64_t stripes = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        hashes[i] = hash(keys[i]);
+        stripes |= 1ULL << stripe_of(hashes[i]);
+    }
+
+    unsigned int seqs[LOCK_STRIPES];
+    int stable = 0;
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_TRIES; attempt++) {
+        stable = 1;
+        for (size_t s = 0; s < LOCK_STRIPES; s++) {
+            if (stripes & (1ULL << s)) {
+                seqs[s] = atomic_load_explicit(&ht->stripe_seq[s], memory_order_acquire);
+                if (seqs[s] & 1) stable = 0; // Há um escritor a meio
+            }
+        }
+        if (!stable) continue;
+
+        epoch_enter();
+        for (size_t i = 0; i < num_keys; i++) {
+            visit(arg, i, read_key(ht, keys[i], hashes[i], &misses[i]));
+        }
+        epoch_exit();
+
+        atomic_thread_fence(memory_order_acquire);
+        for (size_t s = 0; s < LOCK_STRIPES && stable; s++) {
+            if ((stripes & (1ULL << s)) && atomic_load_explicit(&ht->stripe_seq[s], memory_order_relaxed) != seqs[s]) {
+                stable = 0;
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            unlock_kvs_mutex();
-            return 0; // Exit the function
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        if (stable) break;
+    }
+
+    if (!stable) {
+        // Demasiados escritores nestas stripes: lemos com as stripes bloqueadas
+        lock_stripes(ht, stripes, 0);
+        epoch_enter();
+        for (size_t i = 0; i < num_keys; i++) {
+            visit(arg, i, read_key(ht, keys[i], hashes[i], &misses[i]));
+        }
+        epoch_exit();
+        unlock_stripes(ht, stripes);
+    }
+    // Os misses só contam na leitura que ficou, não nas tentativas repetidas
+    for (size_t i = 0; i < num_keys; i++) {
+        count_miss(ht, hashes[i], misses[i]);
     }
-    unlock_kvs_mutex();
-    return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
+int delete_pair(HashTable *ht, const char *key) {
+    uint64_t h = hash(key);
+    size_t stripe = stripe_of(h);
+    stripe_write_lock(ht, stripe);
+    rehash_step(ht, stripe);
+    int result = delete_locked(ht, key, h);
+    stripe_write_unlock(ht, stripe);
+    maybe_resize(ht);
+    return result;
+}
+
+uint64_t delete_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], int missing[]) {
+    uint64_t hashes[MAX_WRITE_SIZE];
+    uint64_t stripes = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        hashes[i] = hash(keys[i]);
+        stripes |= 1ULL << stripe_of(hashes[i]);
+    }
+
+    batch_lock(ht, stripes);
+    for (size_t i = 0; i < num_keys; i++) {
+        missing[i] = delete_locked(ht, keys[i], hashes[i]);
+    }
+    uint64_t record = 0;
+    if (ht->batch_hook != NULL) {
+        record = ht->batch_hook(ht->batch_hook_arg, num_keys, keys, NULL, missing);
+    }
+    batch_unlock(ht, stripes);
+    maybe_resize(ht);
+    return record;
+}
+
+static int iter_less(const IndexNode *a, const IndexNode *b) {
+    return strcmp(a->node->key, b->node->key) < 0;
+}
+
+static void iter_sift_down(TableIterator *it, size_t i) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < it->size && iter_less(it->heap[left], it->heap[smallest])) smallest = left;
+        if (right < it->size && iter_less(it->heap[right], it->heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        IndexNode *temp = it->heap[i];
+        it->heap[i] = it->heap[smallest];
+        it->heap[smallest] = temp;
+        i = smallest;
+    }
+}
+
+static int iter_matches(TableIterator *it, const IndexNode *index) {
+    return strncmp(index->node->key, it->prefix, it->prefix_len) == 0;
+}
+
+void table_iter_init(HashTable *ht, TableIterator *it, const char *prefix) {
+    it->prefix = prefix == NULL ? "" : prefix;
+    it->prefix_len = strlen(it->prefix);
+    it->size = 0;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        // Sem prefixo começamos no início de cada lista, sem procurar
+        IndexNode *first = it->prefix_len == 0 ? ht->index[s].head->forward[0] : skiplist_seek(&ht->index[s], it->prefix);
+        if (first != NULL && iter_matches(it, first)) {
+            it->heap[it->size++] = first;
+        }
+    }
+    for (size_t i = it->size / 2; i-- > 0;) {
+        iter_sift_down(it, i);
+    }
+}
+
+KeyNode *table_iter_next(TableIterator *it) {
+    if (it->size == 0) return NULL;
+
+    IndexNode *top = it->heap[0];
+    IndexNode *next = top->forward[0];
+    // As chaves com o prefixo são contíguas em cada lista: a primeira que não o tem termina a stripe
+    if (next != NULL && iter_matches(it, next)) {
+        it->heap[0] = next;
+    } else {
+        it->heap[0] = it->heap[--it->size];
+    }
+    iter_sift_down(it, 0);
+    return top->node;
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+    stats->keys = atomic_load(&ht->count);
+    stats->buckets = atomic_load(&ht->table)->size;
+    stats->bloom_negatives = 0;
+    stats->bloom_false_positives = 0;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        stats->bloom_negatives += atomic_load_explicit(&ht->bloom_stats[s].negatives, memory_order_relaxed);
+        stats->bloom_false_positives += atomic_load_explicit(&ht->bloom_stats[s].false_positives, memory_order_relaxed);
+    }
+}
+
+void table_set_batch_hook(HashTable *ht, BatchHook hook, void *arg) {
+    ht->batch_hook = hook;
+    ht->batch_hook_arg = arg;
+}
+
+int table_reserve(HashTable *ht, size_t count) {
+    int result = 0;
+    lock_stripes(ht, ALL_STRIPES, 1);
+    BucketArray *current = atomic_load(&ht->table);
+    // Só uma tabela vazia e sem resize a decorrer troca de array sem migrar nós
+    if (atomic_load(&ht->count) == 0 && atomic_load(&ht->old_table) == NULL && count > atomic_load(&ht->grow_at)) {
+        size_t size = current->size;
+        while (size * MAX_LOAD_FACTOR < count) size *= 2;
+        BucketArray *newTable = new_bucket_array(size);
+        if (newTable != NULL) {
+            atomic_store(&ht->table, newTable);
+            atomic_store(&ht->grow_at, size * MAX_LOAD_FACTOR);
+            epoch_retire(&current->retire, free_bucket_array);
+        } else {
+            result = 1;
+        }
+    }
+    unlock_stripes(ht, ALL_STRIPES);
+    return result;
+}
+
+void table_track_changes(HashTable *ht, int enable) {
+    atomic_store(&ht->track_changes, enable);
+}
+
+uint64_t table_version(HashTable *ht) {
+    return atomic_load(&ht->version);
+}
+
+void table_forget_changes(HashTable *ht, uint64_t version) {
+    atomic_store(&ht->changes_floor, version);
+}
+
+static int compare_changed_keys(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+int table_changed_keys(HashTable *ht, uint64_t since, char (**keys)[MAX_STRING_SIZE], size_t *num_keys) {
+    if (since < atomic_load(&ht->changes_lost)) return 1;
+
+    // Cada registo está ordenado por versão: as entradas que interessam estão no fim
+    size_t total = 0;
+    size_t first[LOCK_STRIPES];
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        ChangeLog *log = &ht->changes[s];
+        size_t i = log->len;
+        while (i > log->start && log->entries[i - 1].version > since) i--;
+        first[s] = i;
+        total += log->len - i;
+    }
+
+    char (*changed)[MAX_STRING_SIZE] = malloc((total ? total : 1) * MAX_STRING_SIZE);
+    if (changed == NULL) return 1;
+    size_t n = 0;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        ChangeLog *log = &ht->changes[s];
+        for (size_t i = first[s]; i < log->len; i++) {
+            strcpy(changed[n++], log->entries[i].key);
+        }
+    }
+
+    // Uma chave alterada várias vezes aparece uma só vez
+    qsort(changed, n, MAX_STRING_SIZE, compare_changed_keys);
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(changed[unique - 1], changed[i]) != 0) {
+            if (unique != i) strcpy(changed[unique], changed[i]);
+            unique++;
+        }
+    }
+    *keys = changed;
+    *num_keys = unique;
+    return 0;
+}
+
+void table_snapshot_begin(HashTable *ht, TableSnapshot *snap) {
+    // A versão avança para que tudo o que for escrito a partir de agora fique depois dela
+    snap->version = atomic_fetch_add(&ht->version, 1) + 1;
+    snap->pairs = NULL;
+    snap->heap_size = 0;
+    pthread_mutex_lock(&ht->snapshot_mutex);
+    snap->next = ht->snapshots;
+    ht->snapshots = snap;
+    atomic_store(&ht->snapshot_max, snap->version);
+    atomic_fetch_add(&ht->snapshots_active, 1);
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+}
+
+void table_snapshot_release(HashTable *ht, TableSnapshot *snap) {
+    pthread_mutex_lock(&ht->snapshot_mutex);
+    TableSnapshot **link = &ht->snapshots;
+    while (*link != snap) link = &(*link)->next;
+    *link = snap->next;
+    uint64_t max = 0;
+    for (TableSnapshot *other = ht->snapshots; other != NULL; other = other->next) {
+        if (other->version > max) max = other->version;
+    }
+    atomic_store(&ht->snapshot_max, max);
+    atomic_fetch_sub(&ht->snapshots_active, 1);
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+
+    // Os nós stale que nenhum snapshot registado pode ver vão para o reclaimer. Por
+    // simplicidade guardamos os que algum snapshot mais recente talvez veja.
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        pthread_rwlock_wrlock(&ht->stripe_locks[s]);
+        int active = atomic_load(&ht->snapshots_active) > 0;
+        uint64_t keep = atomic_load(&ht->snapshot_max);
+        KeyNode *keyNode = ht->stale[s];
+        ht->stale[s] = NULL;
         while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            KeyNode *next = stale_next(keyNode);
+            if (active && keyNode->version <= keep) {
+                push_stale(ht, s, keyNode);
+            } else {
+                epoch_retire(&keyNode->retire, free_node);
+            }
+            keyNode = next;
+        }
+        pthread_rwlock_unlock(&ht->stripe_locks[s]);
+    }
+}
+static int compare_snapshot_pairs(const void *a, const void *b) {
+    return strcmp(((const SnapshotPair *)a)->key, ((const SnapshotPair *)b)->key);
+}
+
+// Appends a pair to the snapshot, growing the array when needed.
+static int snapshot_append(SnapshotPair **pairs, size_t *capacity, size_t len, const KeyNode *keyNode) {
+    if (len == *capacity) {
+        size_t newCapacity = *capacity ? 2 * *capacity : 64;
+        SnapshotPair *grown = realloc(*pairs, newCapacity * sizeof(SnapshotPair));
+        if (grown == NULL) return 1;
+        *pairs = grown;
+        *capacity = newCapacity;
+    }
+    strcpy((*pairs)[len].key, keyNode->key);
+    strcpy((*pairs)[len].value, keyNode->value);
+    return 0;
+}
+
+// Acrescenta a *pairs os pares da stripe s que a versão version vê, por ordem, bloqueando só essa stripe.
+static int copy_stripe(HashTable *ht, uint64_t version, size_t s, SnapshotPair **pairs, size_t *capacity, size_t *len) {
+    size_t start = *len;
+    int result = 0;
+    pthread_rwlock_rdlock(&ht->stripe_locks[s]);
+    // As chaves atuais escritas até à versão do snapshot, já por ordem...
+    for (IndexNode *index = ht->index[s].head->forward[0]; index != NULL && result == 0; index = index->forward[0]) {
+        if (index->node->version <= version) {
+            result = snapshot_append(pairs, capacity, *len, index->node);
+            if (result == 0) (*len)++;
         }
     }
+    // ... e os valores que valiam nessa versão mas entretanto foram substituídos ou apagados
+    int stale = 0;
+    for (KeyNode *keyNode = ht->stale[s]; keyNode != NULL && result == 0; keyNode = stale_next(keyNode)) {
+        if (keyNode->version <= version && version < keyNode->superseded) {
+            result = snapshot_append(pairs, capacity, *len, keyNode);
+            if (result == 0) (*len)++;
+            stale = 1;
+        }
+    }
+    pthread_rwlock_unlock(&ht->stripe_locks[s]);
+    if (result == 0 && stale) {
+        qsort(*pairs + start, *len - start, sizeof(SnapshotPair), compare_snapshot_pairs);
+    }
+    return result;
+}
+
+static int snapshot_less(TableSnapshot *snap, size_t a, size_t b) {
+    return strcmp(snap->pairs[snap->cursor[a]].key, snap->pairs[snap->cursor[b]].key) < 0;
+}
+
+static void snapshot_sift_down(TableSnapshot *snap, size_t i) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < snap->heap_size && snapshot_less(snap, snap->heap[left], snap->heap[smallest])) smallest = left;
+        if (right < snap->heap_size && snapshot_less(snap, snap->heap[right], snap->heap[smallest])) smallest = right;
+        if (smallest == i) return;
+        size_t tmp = snap->heap[i];
+        snap->heap[i] = snap->heap[smallest];
+        snap->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+int table_snapshot_copy(HashTable *ht, TableSnapshot *snap) {
+    size_t capacity = 0;
+    size_t len = 0;
+    int result = 0;
+    for (size_t s = 0; s < LOCK_STRIPES && result == 0; s++) {
+        result = copy_stripe(ht, snap->version, s, &snap->pairs, &capacity, &len);
+        snap->end[s] = len;
+    }
+    // A tabela já não precisa de guardar nada para este snapshot
+    table_snapshot_release(ht, snap);
+    if (result != 0) {
+        table_snapshot_free(snap);
+        return 1;
+    }
+
+    snap->heap_size = 0;
+    for (size_t s = 0; s < LOCK_STRIPES; s++) {
+        snap->cursor[s] = s == 0 ? 0 : snap->end[s - 1];
+        if (snap->cursor[s] < snap->end[s]) {
+            snap->heap[snap->heap_size++] = s;
+        }
+    }
+    for (size_t i = snap->heap_size / 2; i-- > 0;) {
+        snapshot_sift_down(snap, i);
+    }
+    return 0;
+}
+
+int table_snapshot_copy_stripe(HashTable *ht, const TableSnapshot *snap, size_t stripe, SnapshotPair **pairs, size_t *len) {
+    size_t capacity = 0;
+    *pairs = NULL;
+    *len = 0;
+    if (copy_stripe(ht, snap->version, stripe, pairs, &capacity, len) != 0) {
+        free(*pairs);
+        *pairs = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+const SnapshotPair *table_snapshot_next(TableSnapshot *snap) {
+    if (snap->heap_size == 0) return NULL;
+    size_t s = snap->heap[0];
+    const SnapshotPair *pair = &snap->pairs[snap->cursor[s]++];
+    if (snap->cursor[s] == snap->end[s]) {
+        snap->heap[0] = snap->heap[--snap->heap_size];
+    }
+    snapshot_sift_down(snap, 0);
+    return pair;
+}
+
+void table_snapshot_free(TableSnapshot *snap) {
+    free(snap->pairs);
+    snap->pairs = NULL;
+    snap->heap_size = 0;
+}
+
+void free_table(HashTable *ht) {
+    // Os nós não são percorridos um a um: os slabs da pool são libertados de uma vez
+    slab_destroy(&ht->nodes);
+    index_pools_destroy(&ht->index_pools);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        skiplist_destroy(&ht->index[i]);
+    }
+    free(atomic_load(&ht->table));
+    free(atomic_load(&ht->old_table));
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_destroy(&ht->stripe_locks[i]);
+        free(ht->changes[i].entries);
+    }
+    pthread_mutex_destroy(&ht->snapshot_mutex);
     free(ht);
-}
\ No newline at end of file
+}
@@ -1,28 +1,205 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// Número inicial de buckets (tem de ser uma potência de 2, múltiplo de LOCK_STRIPES)
+#define INITIAL_TABLE_SIZE 64
+// A tabela cresce quando o número médio de chaves por bucket passa este valor
+#define MAX_LOAD_FACTOR 2
+// Número de buckets antigos migrados por cada escrita durante um resize
+#define REHASH_STEP 8
+// Número de locks da tabela. O bucket i é protegido pelo lock i % LOCK_STRIPES, tanto no
+// array atual como no antigo, por isso um conjunto de stripes cabe num uint64_t.
+#define LOCK_STRIPES 64
+#define ALL_STRIPES UINT64_MAX
+// Tentativas de leitura otimista (sem locks) de um READ antes de bloquear as stripes
+#define OPTIMISTIC_READ_TRIES 4
+// Os nós são alinhados a uma linha de cache
+#define KEY_NODE_ALIGNMENT 64
+// Contadores do filtro de Bloom de um array por cada bucket (com MAX_LOAD_FACTOR chaves por
+// bucket, 8 contadores por chave e BLOOM_HASHES posições dão ~3% de falsos positivos)
+#define BLOOM_COUNTERS_PER_BUCKET 16
+// Posições de cada chave no filtro
+#define BLOOM_HASHES 3
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include "constants.h"
+#include "epoch.h"
+#include "slab.h"
+#include "skiplist.h"
 
+/* Os leitores percorrem as listas sem locks. Por isso um nó nunca é alterado depois de
+ publicado: escrever uma chave existente cria um nó novo que substitui o antigo, e os nós
+ removidos (e os arrays antigos) só são libertados pelo epoch_retire. */
 typedef struct KeyNode
 {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    // Primeira linha de cache: tudo o que é lido ao percorrer uma lista
+    _Alignas(KEY_NODE_ALIGNMENT) _Atomic(struct KeyNode *) next;
+    // O hash completo é comparado antes da chave, e não é recalculado ao migrar o nó
+    uint64_t hash;
+    uint64_t version; // Versão da tabela em que o valor foi escrito (para os snapshots)
+    // Com zeros depois do '\0' até ao fim, para ser comparada como um bloco de tamanho fixo
+    char key[MAX_STRING_SIZE];
+    // Segunda linha de cache: só é lida quando a chave é encontrada
+    char value[MAX_STRING_SIZE];
+    union {
+        IndexNode *index;    // Entrada da chave no índice ordenado da stripe
+        uint64_t superseded; // Depois de substituído/apagado: versão em que deixou de valer
+    };
+    // Enquanto um snapshot precisar do nó substituído, retire.next liga-o à lista stale da stripe
+    EpochEntry retire;
 } KeyNode;
 
+/* Cada array tem um filtro de Bloom com contadores das chaves que estão nos seus buckets, para
+ que uma chave que não existe seja quase sempre excluída sem percorrer nenhuma lista. Os
+ contadores de uma chave ficam todos na parte do filtro da sua stripe, que só é alterada com
+ a stripe bloqueada para escrita: os escritores não precisam de operações atómicas de
+ leitura-escrita e os leitores leem os contadores sem locks. Um contador que chega a
+ UINT8_MAX fica assim para sempre (nunca pode excluir uma chave que existe). */
+typedef struct BucketArray
+{
+    EpochEntry retire;
+    size_t size; // Número de buckets (potência de 2)
+    _Atomic uint8_t *bloom; // size * BLOOM_COUNTERS_PER_BUCKET contadores, a seguir aos buckets
+    _Atomic(KeyNode *) buckets[];
+} BucketArray;
+
+// Pesquisas de chaves que não existem numa stripe (READ e DELETE). Cada stripe tem a sua
+// linha de cache, e só as pesquisas falhadas as alteram.
+typedef struct BloomStats
+{
+    _Alignas(KEY_NODE_ALIGNMENT) atomic_uint_fast64_t negatives; // Excluídas pelo filtro
+    atomic_uint_fast64_t false_positives; // O filtro deixou passar e a lista não tinha a chave
+} BloomStats;
+
+// Estatísticas da tabela (table_stats)
+typedef struct TableStats
+{
+    size_t keys;
+    size_t buckets;
+    uint64_t bloom_negatives;
+    uint64_t bloom_false_positives;
+} TableStats;
+
+// Chave alterada (escrita ou apagada) de uma stripe, para os backups incrementais
+typedef struct ChangeEntry
+{
+    uint64_t version; // Versão da tabela depois da alteração
+    char key[MAX_STRING_SIZE];
+} ChangeEntry;
+
+// Registo das alterações de uma stripe, por ordem de versão. As entradas [start, len) são
+// as que ainda podem ser pedidas por algum backup.
+typedef struct ChangeLog
+{
+    ChangeEntry *entries;
+    size_t start, len, capacity;
+} ChangeLog;
+
+// Par copiado para um snapshot
+typedef struct SnapshotPair
+{
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} SnapshotPair;
+
+/* Snapshot de uma versão da tabela. Enquanto um snapshot está registado, os nós que ele
+ ainda vê não são libertados quando são substituídos ou apagados: ficam na lista stale da
+ stripe. A cópia é feita stripe a stripe, cada uma bloqueada só enquanto é copiada, e
+ depois o snapshot é percorrido por ordem sem tocar na tabela. */
+typedef struct TableSnapshot
+{
+    uint64_t version;             // Versão vista pelo snapshot
+    struct TableSnapshot *next;   // Snapshots registados na tabela
+    SnapshotPair *pairs;          // Pares copiados, ordenados dentro de cada stripe
+    size_t end[LOCK_STRIPES];     // Fim dos pares de cada stripe
+    size_t cursor[LOCK_STRIPES];  // Próximo par de cada stripe
+    size_t heap[LOCK_STRIPES];    // Stripes por percorrer, ordenadas pelo próximo par
+    size_t heap_size;
+} TableSnapshot;
+
+// Chamada por write_pairs e delete_pairs depois de aplicarem um comando e ainda com as
+// stripes bloqueadas, por isso as chamadas de comandos com chaves em comum vêm pela ordem
+// em que foram aplicados. values é NULL num delete; os pares com skip[i] != 0 não mudaram.
+// Devolve um número que identifica o registo do comando (0 se não registou nada), que
+// write_pairs e delete_pairs devolvem a quem aplicou o comando.
+typedef uint64_t (*BatchHook)(void *arg, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                              char values[][MAX_STRING_SIZE], const int skip[]);
+
 typedef struct HashTable
 {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t *table_mutex;
+    _Atomic(BucketArray *) table;     // Array de buckets atual
+    _Atomic(BucketArray *) old_table; // Array antigo enquanto decorre um resize, NULL caso contrário
+    uint64_t rehash_epoch; // Época em que o resize começou; a migração espera por um grace period
+    // Para cada stripe, quantos dos seus buckets antigos (s, s + LOCK_STRIPES, ...) já foram migrados
+    size_t stripe_rehash[LOCK_STRIPES];
+    atomic_size_t stripes_rehashed; // Stripes que já terminaram a migração
+    atomic_size_t rehash_cursor;    // Próxima stripe a ajudar a migrar
+    atomic_int resizing;
+    atomic_size_t grow_at;          // Número de chaves a partir do qual a tabela cresce
+    atomic_size_t count;            // Número de chaves na tabela
+    // Contador de sequência de cada stripe, ímpar enquanto um escritor a está a alterar.
+    // Permite a um READ de várias chaves validar que viu um estado consistente.
+    atomic_uint stripe_seq[LOCK_STRIPES];
+    pthread_rwlock_t stripe_locks[LOCK_STRIPES];
+    SlabPool nodes; // Todos os nós da tabela vêm desta pool
+    // Índice ordenado das chaves de cada stripe, protegido pelo lock da stripe
+    SkipList index[LOCK_STRIPES];
+    IndexPools index_pools;
+    // Registo das chaves alteradas, protegido pelo lock da stripe (só com track_changes)
+    atomic_int track_changes;
+    atomic_uint_fast64_t version;   // Número de alterações registadas até agora
+    atomic_uint_fast64_t changes_floor; // As alterações até esta versão já não são precisas
+    atomic_uint_fast64_t changes_lost;  // Última versão que não foi registada (falta de memória)
+    ChangeLog changes[LOCK_STRIPES];
+    // Snapshots registados. snapshot_max só muda com todas as stripes bloqueadas ou
+    // com snapshot_mutex (quando um snapshot deixa de precisar da tabela).
+    pthread_mutex_t snapshot_mutex;
+    TableSnapshot *snapshots;
+    atomic_int snapshots_active;
+    atomic_uint_fast64_t snapshot_max; // Versão do snapshot registado mais recente
+    KeyNode *stale[LOCK_STRIPES];      // Nós substituídos que algum snapshot pode ver
+    BloomStats bloom_stats[LOCK_STRIPES];
+    BatchHook batch_hook; // Registo dos comandos aplicados (o WAL), NULL se não houver
+    void *batch_hook_arg;
 } HashTable;
 
+// Percurso ordenado da tabela: junta as skip lists das stripes com uma heap de cursores.
+typedef struct TableIterator
+{
+    IndexNode *heap[LOCK_STRIPES];
+    size_t size;
+    const char *prefix;
+    size_t prefix_len;
+} TableIterator;
+
+/// Hashes a key (FNV-1a followed by a 64-bit finalizer).
+/// @param key Null terminated key.
+/// @return 64-bit hash of the key.
+uint64_t hash(const char *key);
+
 /// Creates a new event hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
+/// Returns the stripe set (one bit) that protects a key.
+/// @param key Key to look up.
+/// @return Bit mask with the stripe of the key.
+uint64_t key_stripe(const char *key);
+
+/// Locks a set of stripes in ascending order, so that any two callers can't deadlock.
+/// @param ht Hash table to lock.
+/// @param stripes Bit mask of the stripes to lock (ALL_STRIPES for the whole table).
+/// @param write 1 to lock in write mode, 0 for read mode.
+void lock_stripes(HashTable *ht, uint64_t stripes, int write);
+
+/// Unlocks a set of stripes locked with lock_stripes.
+/// @param ht Hash table to unlock.
+/// @param stripes Bit mask of the stripes to unlock.
+void unlock_stripes(HashTable *ht, uint64_t stripes);
+
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
@@ -30,19 +207,150 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-/// Deletes the value of given key.
+/// Writes a batch of pairs atomically. The stripes of all keys are locked once (in write
+/// mode) for the whole batch, so other commands see either none or all of it.
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of pairs (at most MAX_WRITE_SIZE).
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param failed Set to 1 for every pair that couldn't be written, 0 otherwise.
+/// @return What the batch hook returned for the batch (0 if there is no hook).
+uint64_t write_pairs(HashTable *ht, size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int failed[]);
+
+/// Reads the value of a given key without taking any lock. The caller must be inside
+/// an epoch_enter/epoch_exit section.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @return Value borrowed from the table, valid until epoch_exit. NULL if the key doesn't exist.
+const char *read_pair(HashTable *ht, const char *key);
+
+/// Reads several keys as one consistent snapshot. The keys are read without locks and the
+/// stripe sequence counters are validated afterwards; only after OPTIMISTIC_READ_TRIES
+/// failed attempts are the stripes locked in read mode.
+/// @param ht Hash table to read from.
+/// @param num_keys Number of keys to read.
+/// @param keys Array of keys' strings.
+/// @param visit Called for every key, in order, with the value borrowed from the table
+///              (NULL for missing keys), valid only during the call. An attempt that turns
+///              out inconsistent is repeated from index 0, so visit restarts there.
+/// @param arg Argument passed to visit.
+void read_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE],
+                void (*visit)(void *arg, size_t index, const char *value), void *arg);
+
+/// Deletes the pair of the given key.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-char *read_pair(HashTable *ht, const char *key);
-
-/// Appends a new node to the list.
-/// @param list Event list to be modified.
-/// @param key Key of the pair to read.
-/// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
-/// Frees the hashtable.
+/// Deletes a batch of keys atomically, with the stripes of all keys locked once.
+/// @param ht Hash table to delete from.
+/// @param num_keys Number of keys (at most MAX_WRITE_SIZE).
+/// @param keys Array of keys' strings.
+/// @param missing Set to 1 for every key that didn't exist, 0 otherwise.
+/// @return What the batch hook returned for the batch (0 if there is no hook).
+uint64_t delete_pairs(HashTable *ht, size_t num_keys, char keys[][MAX_STRING_SIZE], int missing[]);
+
+/// Starts an ordered walk over the table. The caller must hold every stripe (read mode is
+/// enough) until the walk is over.
+/// @param ht Hash table to walk.
+/// @param it Iterator to initialize.
+/// @param prefix Only keys starting with prefix are returned (NULL or "" for every key).
+void table_iter_init(HashTable *ht, TableIterator *it, const char *prefix);
+
+/// Returns the next node of an ordered walk.
+/// @param it Iterator initialized by table_iter_init.
+/// @return Next node in key order, NULL at the end.
+KeyNode *table_iter_next(TableIterator *it);
+
+/// Sets the function called with every WRITE/DELETE batch once it is applied.
+/// Must be called before other threads use the table.
+/// @param ht Hash table.
+/// @param hook Function to call (NULL for none).
+/// @param arg Argument passed to hook.
+void table_set_batch_hook(HashTable *ht, BatchHook hook, void *arg);
+
+/// Grows the bucket array of an empty table so that it can take count keys without
+/// resizing (used before loading a snapshot).
+/// @param ht Hash table.
+/// @param count Number of keys that will be written.
+/// @return 0 on success (or if nothing had to be done), 1 if out of memory.
+int table_reserve(HashTable *ht, size_t count);
+
+/// Starts or stops recording which keys are written and deleted (see table_changed_keys).
+/// @param ht Hash table.
+/// @param enable 1 to record changes, 0 to stop.
+void table_track_changes(HashTable *ht, int enable);
+
+/// Returns the version of the table, i.e. the number of recorded changes. The caller must
+/// hold every stripe so that the version matches the contents.
+/// @param ht Hash table.
+/// @return Current version.
+uint64_t table_version(HashTable *ht);
+
+/// Tells the table that no one will ask for the changes up to a version, so they can be
+/// dropped from the log.
+/// @param ht Hash table.
+/// @param version Oldest version still needed (UINT64_MAX if none is).
+void table_forget_changes(HashTable *ht, uint64_t version);
+
+/// Collects the keys changed after a version, sorted and without repetitions. A key may be
+/// in the table or deleted. The caller must hold every stripe (read mode is enough).
+/// @param ht Hash table.
+/// @param since Version of the previous snapshot.
+/// @param keys Set to a malloc'ed array with the keys (to be freed by the caller).
+/// @param num_keys Set to the number of keys.
+/// @return 0 on success, 1 if the changes since that version are no longer known.
+int table_changed_keys(HashTable *ht, uint64_t since, char (**keys)[MAX_STRING_SIZE], size_t *num_keys);
+
+/// Reads the size of the table and how well its Bloom filters answer lookups of missing
+/// keys. The counters are read without locks, so they may be slightly behind.
+/// @param ht Hash table.
+/// @param stats Receives the statistics.
+void table_stats(HashTable *ht, TableStats *stats);
+
+/// Registers a snapshot of the current version of the table. The caller must hold every
+/// stripe (read mode is enough). Must be followed by table_snapshot_copy or
+/// table_snapshot_release.
+/// @param ht Hash table.
+/// @param snap Snapshot to register.
+void table_snapshot_begin(HashTable *ht, TableSnapshot *snap);
+
+/// Copies the pairs that the snapshot sees, locking one stripe at a time (writers keep
+/// going on the others), and releases the snapshot from the table. Afterwards the pairs
+/// are read with table_snapshot_next. Must be called without any stripe locked.
+/// @param ht Hash table.
+/// @param snap Snapshot registered with table_snapshot_begin.
+/// @return 0 on success, 1 if out of memory.
+int table_snapshot_copy(HashTable *ht, TableSnapshot *snap);
+
+/// Copies the pairs of a single stripe that a registered snapshot sees, in key order,
+/// locking only that stripe. The snapshot stays registered. Must be called without any
+/// stripe locked.
+/// @param ht Hash table.
+/// @param snap Snapshot registered with table_snapshot_begin.
+/// @param stripe Stripe to copy.
+/// @param pairs Receives the pairs (allocated with malloc, NULL if there are none).
+/// @param len Receives the number of pairs.
+/// @return 0 on success, 1 if out of memory.
+int table_snapshot_copy_stripe(HashTable *ht, const TableSnapshot *snap, size_t stripe, SnapshotPair **pairs, size_t *len);
+
+/// Unregisters a snapshot without copying it, so the table can free the nodes it kept.
+/// @param ht Hash table.
+/// @param snap Snapshot registered with table_snapshot_begin.
+void table_snapshot_release(HashTable *ht, TableSnapshot *snap);
+
+/// Returns the next pair of a copied snapshot, in key order.
+/// @param snap Snapshot filled by table_snapshot_copy.
+/// @return Next pair, NULL at the end.
+const SnapshotPair *table_snapshot_next(TableSnapshot *snap);
+
+/// Frees the pairs of a snapshot.
+/// @param snap Snapshot to free.
+void table_snapshot_free(TableSnapshot *snap);
+
+/// Frees the hashtable. Retired nodes must have been reclaimed before (epoch_reclaim_all),
+/// since they live in the table's node pool.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
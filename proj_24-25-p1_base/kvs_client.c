@@ -0,0 +1,172 @@
+// syscall (para o futex) não faz parte do POSIX
+#define _DEFAULT_SOURCE
+
+#include "kvs_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Voltas à espera de uma resposta antes de começarmos a ceder o CPU
+#define CLIENT_SPIN_ROUNDS 256
+// Cedências do CPU entre verificações de que o kvs ainda existe
+#define CLIENT_CHECK_ROUNDS 1024
+
+// O kvs já não responde: parou normalmente ou o processo desapareceu
+static int server_gone(KvsShmRegion *region) {
+  return !atomic_load_explicit(&region->running, memory_order_acquire) ||
+         (kill(region->server, 0) == -1 && errno == ESRCH);
+}
+
+// O dono de um canal morreu sem o devolver
+static int owner_gone(int32_t owner) {
+  return owner != 0 && kill(owner, 0) == -1 && errno == ESRCH;
+}
+
+KvsClient *kvs_client_open(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return NULL;
+  struct stat regionStat;
+  if (fstat(fd, &regionStat) == -1 || (size_t)regionStat.st_size < sizeof(KvsShmRegion)) {
+    close(fd);
+    return NULL;
+  }
+  KvsShmRegion *region = mmap(NULL, sizeof(KvsShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) return NULL;
+  if (atomic_load_explicit(&region->magic, memory_order_acquire) != KVS_SHM_MAGIC ||
+      region->version != KVS_SHM_VERSION || server_gone(region)) {
+    munmap(region, sizeof(KvsShmRegion));
+    return NULL;
+  }
+
+  KvsClient *client = malloc(sizeof(KvsClient));
+  if (client == NULL) {
+    munmap(region, sizeof(KvsShmRegion));
+    return NULL;
+  }
+  client->region = region;
+  client->channel = NULL;
+
+  // Um canal livre, ou um canal cujo dono já morreu
+  int32_t self = (int32_t)getpid();
+  for (int pass = 0; pass < 2 && client->channel == NULL; pass++) {
+    for (int i = 0; i < KVS_SHM_CHANNELS; i++) {
+      KvsShmChannel *channel = &region->channels[i];
+      int32_t owner = atomic_load(&channel->owner);
+      if ((pass == 0 ? owner == 0 : owner_gone(owner)) &&
+          atomic_compare_exchange_strong(&channel->owner, &owner, self)) {
+        client->channel = channel;
+        break;
+      }
+    }
+  }
+  if (client->channel == NULL) {
+    munmap(region, sizeof(KvsShmRegion));
+    free(client);
+    return NULL;
+  }
+
+  // Os pedidos que o dono anterior deixou ainda são respondidos antes de reutilizarmos os slots
+  client->next = atomic_load_explicit(&client->channel->head, memory_order_relaxed);
+  if (kvs_client_wait(client, client->next - 1)) {
+    kvs_client_close(client);
+    return NULL;
+  }
+  return client;
+}
+
+void kvs_client_close(KvsClient *client) {
+  atomic_store_explicit(&client->channel->owner, 0, memory_order_release);
+  munmap(client->region, sizeof(KvsShmRegion));
+  free(client);
+}
+
+KvsShmSlot *kvs_client_reserve(KvsClient *client) {
+  // O slot é reutilizado depois de respondido o pedido de há KVS_SHM_SLOTS pedidos
+  if (kvs_client_wait(client, client->next - KVS_SHM_SLOTS)) {
+    return NULL;
+  }
+  return kvs_client_slot(client, client->next);
+}
+
+uint32_t kvs_client_submit(KvsClient *client) {
+  KvsShmRegion *region = client->region;
+  uint32_t ticket = client->next++;
+  // seq_cst: o kvs que marcou sleeping antes de voltar a ver os canais vê este pedido, ou
+  // nós vemos sleeping e acordamo-lo
+  atomic_store(&client->channel->head, client->next);
+  if (atomic_load(&region->sleeping) && atomic_exchange(&region->sleeping, 0)) {
+    atomic_fetch_add(&region->doorbell, 1);
+    syscall(SYS_futex, &region->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+  }
+  return ticket;
+}
+
+int kvs_client_wait(KvsClient *client, uint32_t ticket) {
+  KvsShmChannel *channel = client->channel;
+  // Respondido quando tail já passou o pedido (com os contadores a dar a volta)
+  for (unsigned int round = 0;; round++) {
+    uint32_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+    if ((int32_t)(tail - ticket) > 0) {
+      return 0;
+    }
+    if (round >= CLIENT_SPIN_ROUNDS) {
+      if ((round - CLIENT_SPIN_ROUNDS) % CLIENT_CHECK_ROUNDS == 0 && server_gone(client->region)) {
+        return 1;
+      }
+      sched_yield();
+    }
+  }
+}
+
+KvsShmSlot *kvs_client_slot(KvsClient *client, uint32_t ticket) {
+  return &client->channel->slots[ticket % KVS_SHM_SLOTS];
+}
+
+// Corre um pedido de uma só chave e devolve o seu status (-1 se falhou)
+static int single_request(KvsClient *client, enum KvsShmCommand command, const char *key, const char *value) {
+  size_t keyLength = strlen(key);
+  size_t valueLength = value == NULL ? 0 : strlen(value);
+  if (keyLength >= MAX_STRING_SIZE || valueLength >= MAX_STRING_SIZE) {
+    return -1;
+  }
+  KvsShmSlot *slot = kvs_client_reserve(client);
+  if (slot == NULL) return -1;
+  slot->command = command;
+  slot->num_keys = 1;
+  memcpy(slot->keys[0], key, keyLength + 1);
+  if (value != NULL) {
+    memcpy(slot->values[0], value, valueLength + 1);
+  }
+  uint32_t ticket = kvs_client_submit(client);
+  if (kvs_client_wait(client, ticket) || slot->result != 0) {
+    return -1;
+  }
+  return slot->status[0];
+}
+
+int kvs_client_read(KvsClient *client, const char *key, char value[MAX_STRING_SIZE]) {
+  int status = single_request(client, KVS_SHM_READ, key, NULL);
+  if (status == -1) return -1;
+  if (status == 0) return 1;
+  // O slot só é reutilizado no próximo reserve deste cliente
+  strcpy(value, client->channel->slots[(client->next - 1) % KVS_SHM_SLOTS].values[0]);
+  return 0;
+}
+
+int kvs_client_write(KvsClient *client, const char *key, const char *value) {
+  return single_request(client, KVS_SHM_WRITE, key, value) == 0 ? 0 : -1;
+}
+
+int kvs_client_delete(KvsClient *client, const char *key) {
+  return single_request(client, KVS_SHM_DELETE, key, NULL);
+}
@@ -0,0 +1,120 @@
+#ifndef KVS_CLIENT_H
+#define KVS_CLIENT_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+
+/* Acesso local ao kvs por memória partilhada (kvs -M NAME). O kvs cria uma região POSIX
+ (shm_open) com KVS_SHM_CHANNELS canais; cada cliente fica com um canal só para si, que é um
+ anel SPSC de KVS_SHM_SLOTS pedidos. O cliente escreve as chaves e os valores diretamente
+ num slot do anel e publica-o avançando head; uma thread do kvs percorre os canais, corre
+ cada pedido pelos mesmos caminhos de kvs_write/kvs_read/kvs_delete, escreve a resposta no
+ próprio slot e avança tail. Nenhum dos lados faz chamadas ao sistema enquanto há pedidos:
+ a thread do kvs só adormece (num futex, em doorbell) depois de algum tempo sem pedidos, e
+ o cliente só a acorda quando ela marca sleeping.
+
+ Este ficheiro é a interface partilhada pelos dois lados e a biblioteca dos clientes
+ (kvs_client.o). Cada KvsClient só pode ser usado por uma thread de cada vez. */
+
+#define KVS_SHM_MAGIC 0x4b56534du // "KVSM"
+#define KVS_SHM_VERSION 1
+// Clientes ligados ao mesmo tempo
+#define KVS_SHM_CHANNELS 16
+// Pedidos por responder de cada cliente (potência de 2)
+#define KVS_SHM_SLOTS 8
+
+enum KvsShmCommand {
+  KVS_SHM_WRITE = 1,
+  KVS_SHM_READ = 2,
+  KVS_SHM_DELETE = 3,
+};
+
+// Um pedido e a sua resposta. status[i] é 1 se a chave i de um READ existe (e o valor está
+// em values[i]), se o par i de um WRITE falhou ou se a chave i de um DELETE não existia.
+typedef struct KvsShmSlot {
+  uint32_t command;  // enum KvsShmCommand
+  uint32_t num_keys; // 1 a MAX_WRITE_SIZE
+  int32_t result;    // 0, ou -1 se o pedido foi recusado (chaves ou valores inválidos) ou falhou
+  int32_t status[MAX_WRITE_SIZE];
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+} KvsShmSlot;
+
+// Os contadores de cada lado ficam em linhas de cache diferentes
+typedef struct KvsShmChannel {
+  alignas(64) _Atomic int32_t owner; // pid do cliente, 0 se o canal está livre
+  alignas(64) _Atomic uint32_t head; // Pedidos publicados pelo cliente
+  alignas(64) _Atomic uint32_t tail; // Pedidos respondidos pelo kvs
+  KvsShmSlot slots[KVS_SHM_SLOTS];
+} KvsShmChannel;
+
+typedef struct KvsShmRegion {
+  _Atomic uint32_t magic; // Escrito por último, quando a região está pronta
+  uint32_t version;
+  int32_t server;           // pid do kvs
+  _Atomic int32_t running;  // 0 depois de o kvs parar de responder
+  alignas(64) _Atomic uint32_t sleeping; // A thread do kvs vai adormecer (ou dorme) em doorbell
+  _Atomic uint32_t doorbell;
+  KvsShmChannel channels[KVS_SHM_CHANNELS];
+} KvsShmRegion;
+
+// Os atómicos têm de funcionar entre processos, sem locks escondidos
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared atomics must be lock-free");
+
+typedef struct KvsClient {
+  KvsShmRegion *region;
+  KvsShmChannel *channel;
+  uint32_t next; // Número do próximo pedido (o head que vai ser publicado)
+} KvsClient;
+
+/// Connects to a kvs started with -M, taking one of its channels.
+/// @param name Name of the shared memory region (as given to -M).
+/// @return The client, or NULL if the region does not exist or every channel is taken.
+KvsClient *kvs_client_open(const char *name);
+
+/// Gives the channel back and unmaps the region. Requests still unanswered are answered
+/// before another client can take the channel.
+/// @param client Client returned by kvs_client_open.
+void kvs_client_close(KvsClient *client);
+
+/// Returns the slot of the next request, to be filled in place and published with
+/// kvs_client_submit. Waits for the oldest request when all KVS_SHM_SLOTS are in use.
+/// @param client Client.
+/// @return The slot, or NULL if the kvs stopped.
+KvsShmSlot *kvs_client_reserve(KvsClient *client);
+
+/// Publishes the slot returned by kvs_client_reserve. The slot must not be touched until
+/// kvs_client_wait returns for its ticket.
+/// @param client Client.
+/// @return Ticket of the request.
+uint32_t kvs_client_submit(KvsClient *client);
+
+/// Waits for the answer to a request. The answer stays in the slot of the request
+/// (kvs_client_slot) until KVS_SHM_SLOTS more requests are reserved.
+/// @param client Client.
+/// @param ticket Ticket returned by kvs_client_submit.
+/// @return 0 once the request is answered, 1 if the kvs stopped.
+int kvs_client_wait(KvsClient *client, uint32_t ticket);
+
+/// Slot of a request.
+/// @param client Client.
+/// @param ticket Ticket returned by kvs_client_submit.
+KvsShmSlot *kvs_client_slot(KvsClient *client, uint32_t ticket);
+
+/// Reads one key.
+/// @param value Receives the value of the key.
+/// @return 0 if the key exists, 1 if it does not, -1 on failure.
+int kvs_client_read(KvsClient *client, const char *key, char value[MAX_STRING_SIZE]);
+
+/// Writes one key value pair.
+/// @return 0 if the pair was written, -1 on failure.
+int kvs_client_write(KvsClient *client, const char *key, const char *value);
+
+/// Deletes one key.
+/// @return 0 if the key was deleted, 1 if it did not exist, -1 on failure.
+int kvs_client_delete(KvsClient *client, const char *key);
+
+#endif  // KVS_CLIENT_H
@@ -15,191 +15,200 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <sys/wait.h>
-#include <semaphore.h>
 #include <errno.h>
-
-pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER; // o mutex pros backups é inicializado
-int backup_counter = 0;                                   // counter para o numero de backups em simultaneo
-
-/* Para o exercicio 3, temos de criar tarefas para o programa conseguir tratar de vários ficheiros
- .job em simultâneo. Para isso, vamos usar threads, com mutexes de leitura e escrita para proteger
- a manipulação da tabela. Para não ultrapassar o número máximo de threads, usaremos semáforos.
- */
-
-// Semaforo que garante que não se ultrapassa max_threads em simultâneo
-sem_t semaforo_max_threads;
-
-/* pthread_mutex_t active_threads_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex para controlar que threads estão ativos é inicializado
+#include "pool.h"
+#include "jobs.h"
+#include "server.h"
+#include "shm_server.h"
+#include <signal.h>
+
+/* Para o exercicio 3, temos de tratar de vários ficheiros .job em simultâneo, com mutexes de
+ leitura e escrita para proteger a manipulação da tabela. Em vez de uma thread por ficheiro,
+ uma pool de max_threads workers (pool.h) vai buscando os ficheiros que a main lhe entrega.
  */
 
-// Esta é a função que vai fazer as operações na tabela, que vai ser chamada em threads.
-void *tableOperations(void *fd_info)
+// Esta é a função que vai fazer as operações na tabela, corrida como tarefa da pool.
+void tableOperations(void *fd_info)
 {
-  // printf("THREAD CREATED\n");
   in_out_fds *fd = fd_info;
-  enum Command fileOver = 0;
-  while (fileOver != EOC)
+  // Os ficheiros só são abertos quando o ficheiro chega a um worker, para não termos
+  // milhares de ficheiros abertos à espera na pool
+  if ((fd->input = open(fd->fileName, O_RDONLY)) == -1)
+  {
+    perror("Couldn't open file");
+    job_unregister(fd);
+    free(fd_info);
+    return;
+  }
+  if ((fd->output = outputFile(fd->fileName)) == -1)
   {
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+    close(fd->input); // temos de fechar o fd mesmo em caso de erro
+    job_unregister(fd);
+    free(fd_info);
+    return;
+  }
+  reader_init(&fd->reader, fd->input);
+  output_init(&fd->out, fd->output);
 
-    switch (fileOver = get_next(fd->input))
-    {
-    case CMD_WRITE:
-      num_pairs = parse_write(fd->input, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-      if (num_pairs == 0)
-      {
-        write(fd->output, "\n", strlen("\n"));
-        continue;
-      }
+  if (fd->parallel)
+  {
+    // Os comandos do ficheiro correm em paralelo na pool e o ficheiro é terminado por ela
+    job_run_parallel(fd);
+  }
+  else
+  {
+    job_run(fd);
+  }
+}
 
-      if (kvs_write(num_pairs, keys, values, fd->output))
-      {
-        write(fd->output, "Failed to write pair\n", strlen("Failed to write pair\n"));
-      }
+// Mensagem de erro dos argumentos, com as duas formas de correr o programa
+static void usage()
+{
+  const char *message = "Wrong arguments.\n"
+                        "Usage: ./kvs [-d] [-s] [-b] [-r SNAPSHOT] [-w WAL [-y group|interval|none]] [-p] [-k SHARDS] [-S SOCKET] [-M SHM_NAME] FOLDER_NAME max_backups(>0) max_threads(>0)\n"
+                        "       ./kvs -F FULL_BACKUP [DELTA_BACKUP...]\n";
+  write(STDERR_FILENO, message, strlen(message));
+}
 
+int main(int argc, char *argv[])
+{
+  // -d: backups incrementais; -s: backups por snapshot em vez de fork; -b: backups binários (.snap);
+  // -r: arranca com a tabela de um snapshot binário; -w: repõe e mantém um write-ahead log
+  // (com a política de fsync de -y); -p: comandos de um ficheiro em paralelo; -k: as chaves
+  // são repartidas por shards, cada um com uma thread dona (shard.h); -S: no fim dos
+  // ficheiros continua a servir clientes num socket UNIX; -M: e clientes locais por memória
+  // partilhada (kvs_client.h); -F: reconstrói um backup completo a partir de um backup e dos seus deltas
+  int delta_backups = 0;
+  int snapshot_backups = 0;
+  int binary_backups = 0;
+  const char *restore = NULL;
+  const char *wal = NULL;
+  enum WalSync walSync = WAL_SYNC_GROUP;
+  int parallel_jobs = 0;
+  int shards = 0;
+  const char *socketPath = NULL;
+  const char *shmName = NULL;
+  int fold = 0;
+  int option;
+  while ((option = getopt(argc, argv, "dsbr:w:y:pk:S:M:F")) != -1)
+  {
+    switch (option)
+    {
+    case 'b':
+      binary_backups = 1;
       break;
-
-    case CMD_READ:
-      num_pairs = parse_read_delete(fd->input, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-      if (num_pairs == 0)
-      {
-        write(fd->output, "\n", strlen("\n"));
-        continue;
-      }
-
-      if (kvs_read(num_pairs, keys, fd->output))
-      {
-        write(fd->output, "Failed to read pair\n", strlen("Failed to read pair\n"));
-      }
+    case 'r':
+      restore = optarg;
       break;
-
-    case CMD_DELETE:
-      num_pairs = parse_read_delete(fd->input, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-
-      if (num_pairs == 0)
-      {
-        write(fd->output, "\n", strlen("\n"));
-        continue;
-      }
-
-      if (kvs_delete(num_pairs, keys, fd->output))
+    case 'w':
+      wal = optarg;
+      break;
+    case 'y':
+      if (wal_parse_sync(optarg, &walSync))
       {
-        write(fd->output, "Failed to delete pair\n", strlen("Failed to delete pair\n"));
+        usage();
+        return (EXIT_FAILURE);
       }
       break;
-
-    case CMD_SHOW:
-
-      kvs_show(fd->output);
+    case 'd':
+      delta_backups = 1;
       break;
-
-    case CMD_WAIT:
-      if (parse_wait(fd->input, &delay, NULL) == -1)
-      {
-        write(fd->output, "\n", strlen("\n"));
-        continue;
-      }
-
-      if (delay > 0)
-      {
-        write(fd->output, "Waiting...\n", strlen("Waiting...\n"));
-        kvs_wait(delay);
-      }
+    case 's':
+      snapshot_backups = 1;
       break;
-
-    case CMD_BACKUP:
-      if (backup_counter >= fd->max_backups)
-      {
-        // Espera até que algum processo filho termine
-        pid_t finished_pid = wait(NULL);
-        if (finished_pid == -1)
-        {
-          perror("Erro ao esperar pelo processo filho\n");
-        }
-        else
-        {
-          printf("Processo filho %d terminou\n", finished_pid); // Debug
-          kvs_backup(fd->fileName, &backup_mutex, &backup_counter, &(fd->backupNum), fd->dir, fd);
-        }
-      }
-      else
+    case 'p':
+      parallel_jobs = 1;
+      break;
+    case 'k':
+      shards = atoi(optarg);
+      if (shards <= 0)
       {
-        pthread_mutex_lock(&backup_mutex);
-        backup_counter++;
-        pthread_mutex_unlock(&backup_mutex);
-        kvs_backup(fd->fileName, &backup_mutex, &backup_counter, &(fd->backupNum), fd->dir, fd);
+        usage();
+        return (EXIT_FAILURE);
       }
       break;
-
-    case CMD_INVALID:
-      write(fd->output, "\n", strlen("\n"));
+    case 'S':
+      socketPath = optarg;
       break;
-
-    case CMD_HELP:
-      write(fd->output,
-            "Available commands:\n"
-            "  WRITE [(key,value)(key2,value2),...]\n"
-            "  READ [key,key2,...]\n"
-            "  DELETE [key,key2,...]\n"
-            "  SHOW\n"
-            "  WAIT <delay_ms>\n"
-            "  BACKUP\n" // Not implemented
-            "  HELP\n",
-            strlen("Available commands:\n"
-                   "  WRITE [(key,value)(key2,value2),...]\n"
-                   "  READ [key,key2,...]\n"
-                   "  DELETE [key,key2,...]\n"
-                   "  SHOW\n"
-                   "  WAIT <delay_ms>\n"
-                   "  BACKUP\n" // Not implemented
-                   "  HELP\n"));
-
+    case 'M':
+      shmName = optarg;
       break;
-
-    case CMD_EMPTY:
+    case 'F':
+      fold = 1;
       break;
+    default:
+      usage();
+      return (EXIT_FAILURE);
+    }
+  }
 
-    case EOC:
-      cleanFds(fd->input, fd->output);
-      break;
+  if (fold)
+  {
+    if (optind >= argc || kvs_init())
+    {
+      usage();
+      return (EXIT_FAILURE);
     }
+    int result = kvs_fold(argc - optind, argv + optind, STDOUT_FILENO);
+    kvs_terminate();
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
   }
-  cleanFds(fd->input, fd->output);
-  // printf("THREAD FINISHED\n");
-  free(fd_info);
-  sem_post(&semaforo_max_threads);
-  return NULL;
-}
 
-int main(int argc, char *argv[])
-{
-  if (argc != 4)
+  if (argc - optind != 3)
   {
-    write(STDERR_FILENO, "Wrong arguments.\n", strlen("Wrong arguments.\n"));                                                     // perguntar ao stor
-    write(STDERR_FILENO, "Usage: ./kvs [FOLDER_NAME] [max_threads(>0)]\n", strlen("Usage: ./kvs [FOLDER_NAME] [max_threads]\n")); // perguntar ao stor
+    usage();
     return (EXIT_FAILURE);
   }
 
   // O número máximo de backups em simultaneo é dado pelo input do user
-  int max_backups = atoi(argv[2]);
+  int max_backups = atoi(argv[optind + 1]);
   // Definimos o número máximo de threads que podemos ter, a partir do input do utilizador
-  int max_threads = atoi(argv[3]);
+  int max_threads = atoi(argv[optind + 2]);
 
   // Verificamos se o atoi retornou 0, o que acontece quando há algum erro. Neste caso, consideramos também que se o utilizador escolher
   // 0 como max_threads ou como max_backups, o programa também não corre. Verificamos também se não foram colocados números negativos.
   if ((max_threads <= 0) | (max_backups <= 0))
   {
-    write(STDERR_FILENO, "Wrong arguments.\n", strlen("Wrong arguments.\n"));                                                     // perguntar ao stor
-    write(STDERR_FILENO, "Usage: ./kvs [FOLDER_NAME] [max_threads(>0)]\n", strlen("Usage: ./kvs [FOLDER_NAME] [max_threads]\n")); // perguntar ao stor
+    usage();
     return (EXIT_FAILURE);
   }
 
+  // O snapshot e o WAL são abertos antes do chdir, porque os caminhos são relativos à diretoria atual
+  int restoreFd = -1;
+  if (restore != NULL && (restoreFd = open(restore, O_RDONLY)) == -1)
+  {
+    perror("Couldn't open snapshot");
+    return (EXIT_FAILURE);
+  }
+  int walFd = -1;
+  if (wal != NULL && (walFd = open(wal, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1)
+  {
+    perror("Couldn't open WAL");
+    return (EXIT_FAILURE);
+  }
+  // O socket também é criado antes de qualquer tarefa, porque bloqueia os sinais de paragem
+  int listenFd = -1;
+  if (socketPath != NULL && (listenFd = server_listen(socketPath)) == -1)
+  {
+    return (EXIT_FAILURE);
+  }
+  // Sem socket, a main só espera pelo sinal de paragem, que nenhuma tarefa pode receber
+  sigset_t stopSignals;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  ShmServer *shm = NULL;
+  if (shmName != NULL)
+  {
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    if ((shm = shm_server_open(shmName)) == NULL)
+    {
+      return (EXIT_FAILURE);
+    }
+  }
+
   // aqui na main eu abro a diretoria e vejo se ela existe (!= NULL)
-  char *dirPath = argv[1];
+  char *dirPath = argv[optind];
   DIR *dir = opendir(dirPath);
   if (dir == NULL)
   {
@@ -221,13 +230,50 @@ int main(int argc, char *argv[])
     closedir(dir);
     return 1;
   }
+  kvs_set_delta_backups(delta_backups);
+  kvs_set_snapshot_backups(snapshot_backups);
+  kvs_set_binary_backups(binary_backups);
+  if (restoreFd != -1)
+  {
+    int failed = kvs_restore(restoreFd);
+    close(restoreFd);
+    if (failed)
+    {
+      write(STDERR_FILENO, "Failed to restore snapshot\n", strlen("Failed to restore snapshot\n"));
+      kvs_terminate();
+      closedir(dir);
+      return 1;
+    }
+  }
+  // O WAL é reposto por cima do snapshot e passa a registar os comandos dos ficheiros
+  if (walFd != -1 && kvs_open_wal(walFd, walSync))
+  {
+    write(STDERR_FILENO, "Failed to open WAL\n", strlen("Failed to open WAL\n"));
+    kvs_terminate();
+    closedir(dir);
+    return 1;
+  }
+
+  // Os shards só começam depois de o WAL ser reposto, que escreve diretamente na tabela
+  if (shards > 0 && kvs_start_shards((size_t)shards))
+  {
+    write(STDERR_FILENO, "Failed to start shards\n", strlen("Failed to start shards\n"));
+    kvs_terminate();
+    closedir(dir);
+    return 1;
+  }
+  ThreadPool *pool = pool_create((size_t)max_threads);
+  if (pool == NULL)
+  {
+    write(STDERR_FILENO, "Error in creating threads\n", strlen("Error in creating threads\n"));
+    kvs_terminate();
+    closedir(dir);
+    return 1;
+  }
 
   struct dirent *fileDir;
-  sem_init(&semaforo_max_threads, 0, (unsigned int)max_threads);
-  pthread_t *threads = malloc(0); // Array para guardar as threads, para, no final, podermos fazer join.
-  size_t countThreads = 0;
   while ((fileDir = readdir(dir)) != NULL)
-  { // leio a diretoria e dentro deste while tenho de fazer open_file para os ficheiros do tipo ".job"
+  { // leio a diretoria e dentro deste while entrego à pool os ficheiros do tipo ".job"
     struct stat fileStat;
     if (stat(fileDir->d_name, &fileStat) == -1)
     {
@@ -243,79 +289,71 @@ int main(int argc, char *argv[])
       // só leio ficheiros do tipo ".job":
       if (MAX_JOB_FILE_NAME_SIZE > fileNameLength && fileNameLength > 4 && strcmp(fileName + (fileNameLength - 4), ".job") == 0)
       {
-        int fd = open(fileDir->d_name, O_RDONLY);
-        // O backupNum é um counter para o numero de backups de cada file NO TOTAL e é inicializado quando abrimos um ficheiro, porque cada ficheiro tem o seu backupNum
-        int backupNum = 0;
-        int outputFd;
-        if (fd == -1)
+        // Temos de criar esta estrutura para enviar à tarefa o ficheiro e o seu estado.
+        in_out_fds *fds = malloc(sizeof(in_out_fds));
+        if (fds == NULL)
         {
-          perror("Couldn't open file");
+          write(STDERR_FILENO, "Error in creating task\n", strlen("Error in creating task\n"));
           continue;
         }
-        if ((outputFd = outputFile(fileName)) == -1){
-          close(fd); // temos de fechar o fd mesmo em caso de erro
-          continue;
-        }
-
-        // Temos de criar esta estrutura para guardar os fd's para conseguirmos enviar à função da thread.
-        threads = realloc(threads, (countThreads + 1) * sizeof(threads));
-        in_out_fds *fds = malloc(sizeof(in_out_fds));
-        fds->input = fd;
-        fds->output = outputFd;
         fds->max_backups = max_backups;
-        fds->backupNum = backupNum;
-        fds->fileName = fileName;
-        fds->dir = dir;
-        fds->threads = threads;
-        sem_wait(&semaforo_max_threads);
-        if (pthread_create(&(threads[countThreads]), NULL, &tableOperations, fds) != 0)
+        fds->pool = pool;
+        fds->parallel = parallel_jobs;
+        // O número dos backups conta os backups de cada file NO TOTAL, por isso começa em 0 para cada ficheiro
+        fds->backup = (BackupState){0};
+        // O nome é copiado: a entrada do readdir pode ser reutilizada antes de a tarefa correr
+        memcpy(fds->fileName, fileName, fileNameLength + 1);
+        // Os ficheiros são numerados pela ordem em que os encontramos (o thread_id dos WAIT)
+        if (job_register(fds) != 0)
         {
-          write(STDERR_FILENO, "Error in creating thread\n", strlen("Error in creating thread\n"));
-          sem_post(&semaforo_max_threads);
-          cleanFds(fds->input, fds->output);
+          write(STDERR_FILENO, "Error in creating task\n", strlen("Error in creating task\n"));
           free(fds);
-          free(threads);// fazemos free da estrutura em caso de erro
         }
-        else
-          countThreads++;
+        else if (pool_submit(pool, tableOperations, fds) != 0)
+        {
+          write(STDERR_FILENO, "Error in creating task\n", strlen("Error in creating task\n"));
+          job_unregister(fds);
+          free(fds); // fazemos free da estrutura em caso de erro
+        }
       }
     }
   }
 
-  // Wait for all child processes to finish
-  while (1)
+  // Esperamos que todos os ficheiros sejam tratados e paramos os workers
+  pool_destroy(pool);
+  // No modo servidor a tabela fica a servir clientes até ao SIGINT/SIGTERM
+  int status = 0;
+  if (shm != NULL && shm_server_start(shm) != 0)
   {
-    pid_t pid = waitpid(-1, NULL, 0);
-    if (pid == -1)
+    write(STDERR_FILENO, "Failed to start shared memory server\n", strlen("Failed to start shared memory server\n"));
+    // Os clientes já ligados à região veem que o kvs parou; os do -S continuam a ser servidos
+    shm_server_close(shm);
+    shm = NULL;
+    if (listenFd == -1)
     {
-      if (errno == ECHILD)
-      {
-        // No more child processes
-        break;
-      }
-      else if (errno == EINTR)
-      {
-        // Interrupted by a signal, continue waiting
-        continue;
-      }
-      else
-      {
-        perror("Error waiting for child process");
-        break;
-      }
+      status = 1;
     }
   }
-
-  for (size_t i = 0; i < countThreads; i++)
+  if (listenFd != -1)
+  {
+    server_run(listenFd, max_backups);
+  }
+  else if (shm != NULL)
+  {
+    int signal;
+    sigwait(&stopSignals, &signal);
+  }
+  if (shm != NULL)
   {
-    pthread_join(threads[i], NULL);
+    shm_server_close(shm);
   }
-  sem_destroy(&semaforo_max_threads);
-  free(threads);
+  // Os backups pedidos pelas tarefas podem ainda estar a correr
+  kvs_wait_backup();
   closedir(dir);
   if (kvs_terminate())
   {
     write(STDERR_FILENO, "Failed to terminate KVS\n", strlen("Failed to terminate KVS\n"));
     return 1;
   }
+  return status;
 }
\ No newline at end of file
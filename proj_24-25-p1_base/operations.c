@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,9 +6,13 @@
 #include <unistd.h>
 
 #include "kvs.h"
+#include "epoch.h"
 #include "constants.h"
 #include "operations.h"
 #include "parser.h"
+#include "snapshot.h"
+#include "shard.h"
+#include "wal.h"
 #include <fcntl.h>      
 #include <sys/types.h>  
 #include <sys/stat.h>   
@@ -19,6 +24,77 @@
 
 
 static struct HashTable* kvs_table = NULL;
+// Write-ahead log dos comandos, NULL se não for usado (kvs_open_wal)
+static Wal *kvs_wal = NULL;
+// Donos dos shards, NULL se os comandos acederem diretamente à tabela (kvs_start_shards)
+static ShardSet *kvs_shards = NULL;
+
+// Maior linha de um par no output de um SHOW: "(chave, valor)\n"
+#define SHOW_LINE_SIZE (2 * MAX_STRING_SIZE + 3)
+_Static_assert(SHOW_LINE_SIZE <= UINT8_MAX, "line lengths are kept in a uint8_t");
+
+// Texto de um SHOW já formatado, partilhado por quem o está a escrever
+typedef struct ShowImage {
+  atomic_uint refs;
+  unsigned int seq[LOCK_STRIPES]; // stripe_seq de cada stripe no estado que a imagem mostra
+  char *data;
+  size_t len;
+} ShowImage;
+
+// Cache do SHOW: os pares de cada stripe copiados pelo último SHOW que a percorreu, as suas
+// linhas já formatadas e o texto que saiu delas. Uma escrita muda o stripe_seq da sua stripe,
+// por isso o texto serve enquanto nenhum stripe_seq mudar, e quando algum muda só essas
+// stripes são copiadas e formatadas outra vez. O texto novo é feito com memcpy das linhas:
+// as das stripes que não mudaram ficam pela ordem que tinham (order) e só as das outras são
+// comparadas. mutex serializa as atualizações e é pedido antes dos locks das stripes;
+// image_mutex só protege image e nunca se pede outro lock com ele.
+static struct {
+  pthread_mutex_t mutex;
+  pthread_mutex_t image_mutex;
+  ShowImage *image;
+  int copied[LOCK_STRIPES]; // pairs[s] e text[s] têm a stripe s quando o seu seq era seq[s]
+  unsigned int seq[LOCK_STRIPES];
+  SnapshotPair *pairs[LOCK_STRIPES];
+  size_t len[LOCK_STRIPES];
+  char *text[LOCK_STRIPES]; // Linhas dos pares de pairs[s], seguidas
+  size_t text_len[LOCK_STRIPES];
+  uint8_t *line_len[LOCK_STRIPES];
+  int ordered;    // order tem a stripe de cada linha do último texto, feito com as stripes copiadas
+  uint8_t *order;
+  size_t lines;
+} show_cache = {.mutex = PTHREAD_MUTEX_INITIALIZER, .image_mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void clear_show_cache(void);
+
+// Backup feito por uma tarefa a partir de um snapshot da tabela (em vez de um fork)
+typedef struct SnapshotBackup {
+  TableSnapshot snap;
+  ShowImage *image; // Texto de um SHOW do mesmo estado, escrito em vez do snapshot (ou NULL)
+  char fileName[MAX_JOB_FILE_NAME_SIZE];
+  int num;
+  int delta;
+  char (*changed)[MAX_STRING_SIZE]; // Chaves do delta, ordenadas
+  size_t num_changed;
+  pthread_t thread;
+  struct SnapshotBackup *next; // Backups terminados, à espera do reaper
+} SnapshotBackup;
+
+// Escalonador dos backups: cada BACKUP reserva um lugar (no máximo max_backups em simultâneo)
+// e faz fork (ou lança uma tarefa com um snapshot); a tarefa reaper recolhe os processos
+// filhos e as tarefas à medida que terminam.
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  int reserved; // Backups com lugar reservado (a fazer fork ou a correr)
+  int running;  // Processos filhos ainda por recolher
+  int stop;
+  pthread_t reaper;
+  int delta;          // Backups incrementais (kvs_set_delta_backups)
+  BackupState *bases; // Ficheiros cujo próximo backup pode ser um delta
+  int snapshot;       // Backups por snapshot em vez de fork (kvs_set_snapshot_backups)
+  int binary;         // Backups no formato binário .snap (kvs_set_binary_backups)
+  SnapshotBackup *finished; // Tarefas de backup que terminaram e ainda não foram recolhidas
+} backups = {.mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -28,15 +104,57 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 }
 
 void write_lock_kvs_mutex(){
-  pthread_rwlock_wrlock(kvs_table->table_mutex);
+  lock_stripes(kvs_table, ALL_STRIPES, 1);
 }
 
 void read_lock_kvs_mutex(){
-  pthread_rwlock_rdlock(kvs_table->table_mutex);
+  lock_stripes(kvs_table, ALL_STRIPES, 0);
 }
 
 void unlock_kvs_mutex(){
-  pthread_rwlock_unlock(kvs_table->table_mutex);
+  unlock_stripes(kvs_table, ALL_STRIPES);
+}
+
+// Tarefa que recolhe os processos filhos dos backups, para que quem pediu o backup não tenha
+// de esperar por ele. Só chama waitpid quando há filhos a correr. Também faz join das
+// tarefas dos backups por snapshot (que nunca coexistem com filhos: o modo é global).
+static void *reap_backups(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&backups.mutex);
+  while (1) {
+    while (backups.running == 0 && backups.finished == NULL && !backups.stop) {
+      pthread_cond_wait(&backups.changed, &backups.mutex);
+    }
+    if (backups.finished != NULL) {
+      SnapshotBackup *job = backups.finished;
+      backups.finished = job->next;
+      pthread_mutex_unlock(&backups.mutex);
+      pthread_join(job->thread, NULL);
+      free(job);
+      pthread_mutex_lock(&backups.mutex);
+      backups.reserved--;
+      pthread_cond_broadcast(&backups.changed);
+      continue;
+    }
+    if (backups.running == 0) {
+      break;
+    }
+    pthread_mutex_unlock(&backups.mutex);
+
+    pid_t pid = waitpid(-1, NULL, 0);
+
+    pthread_mutex_lock(&backups.mutex);
+    if (pid > 0) {
+      backups.running--;
+      backups.reserved--;
+      pthread_cond_broadcast(&backups.changed);
+    } else if (errno != EINTR) {
+      perror("Error waiting for child process");
+      break;
+    }
+  }
+  pthread_mutex_unlock(&backups.mutex);
+  return NULL;
 }
 
 int kvs_init() {
@@ -45,11 +163,18 @@ int kvs_init() {
     write(STDERR_FILENO, "KVS state has already been initialized\n", strlen("KVS state has already been initialized\n"));
     return 1;
   }
-  //Inicializamos a mutex que protege as leituras e escritas na tabela
+  // Os locks que protegem as leituras e escritas são inicializados com a tabela (um por stripe)
   kvs_table = create_hash_table();
-  kvs_table->table_mutex = malloc(sizeof(pthread_rwlock_t));
-  pthread_rwlock_init(kvs_table->table_mutex, NULL);
-  return kvs_table == NULL;
+  if (kvs_table == NULL) {
+    return 1;
+  }
+  backups.stop = 0;
+  if (pthread_create(&backups.reaper, NULL, reap_backups, NULL) != 0) {
+    free_table(kvs_table);
+    kvs_table = NULL;
+    return 1;
+  }
+  return 0;
 }
 
 int kvs_terminate() {
@@ -57,121 +182,598 @@ int kvs_terminate() {
     write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
     return 1;
   }
-  pthread_rwlock_destroy(kvs_table->table_mutex);
-  free(kvs_table->table_mutex);
+  if (kvs_shards != NULL) {
+    shard_set_destroy(kvs_shards);
+    kvs_shards = NULL;
+  }
+  // Os backups ainda a correr terminam antes de a tarefa reaper parar
+  kvs_wait_backup();
+  pthread_mutex_lock(&backups.mutex);
+  backups.stop = 1;
+  pthread_cond_broadcast(&backups.changed);
+  pthread_mutex_unlock(&backups.mutex);
+  pthread_join(backups.reaper, NULL);
+  if (kvs_wal != NULL) {
+    table_set_batch_hook(kvs_table, NULL, NULL);
+    wal_close(kvs_wal);
+    kvs_wal = NULL;
+  }
 
+  // Nós e arrays que ainda esperavam pelo fim de um grace period (os nós têm de voltar
+  // à pool da tabela antes de esta ser destruída)
+  epoch_reclaim_all();
+  clear_show_cache();
+  // free_table também destrói os locks das stripes
   free_table(kvs_table);
   kvs_table = NULL;
-  //Destruímos a mutex que protege as leituras e escritas na tabela
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int outputFd) {
+int kvs_write_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int failed[]) {
   if (kvs_table == NULL) {
     write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
     return 1;
   }
+  // Depois de uma falha do WAL as alterações já não seriam registadas: a tabela deixa de
+  // mudar, para não ficar com o que se perderia num reinício
+  if (kvs_wal != NULL && wal_failed(kvs_wal)) {
+    return 1;
+  }
 
+  uint64_t record;
+  if (kvs_shards != NULL) {
+    // Cada dono aplica (e regista no WAL) as chaves do seu shard
+    record = shard_run(kvs_shards, SHARD_WRITE, num_pairs, keys, values, failed);
+  } else {
+    // O comando inteiro é aplicado de uma vez, com cada stripe bloqueada uma única vez
+    record = write_pairs(kvs_table, num_pairs, keys, values, failed);
+  }
+  // Com WAL, o comando só termina depois de o seu registo estar no ficheiro
+  if (kvs_wal != NULL && wal_commit(kvs_wal, record)) {
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], OutputBuffer *out) {
+  int failed[MAX_WRITE_SIZE];
+  if (kvs_write_pairs(num_pairs, keys, values, failed)) {
+    return 1;
+  }
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      write(outputFd, "Failed to write keypair (", strlen("Failed to write keypair ("));
-      write(outputFd, keys[i], strlen(keys[i]));
-      write(outputFd, ",", 1);
-      write(outputFd, values[i], strlen(values[i]));
-      write(outputFd, ")\n", 2);
+    if (failed[i]) {
+      output_string(out, "Failed to write keypair (");
+      output_string(out, keys[i]);
+      output_write(out, ",", 1);
+      output_string(out, values[i]);
+      output_write(out, ")\n", 2);
     }
   }
 
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int outputFd) {
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(a, b);
+}
+
+// Tamanho máximo da linha de output de um READ: "[" + "(key,value)" por chave + "]\n"
+#define READ_OUTPUT_MAX (MAX_WRITE_SIZE * (2 * MAX_STRING_SIZE + 1) + 3)
+
+// Linha de output de um READ, escrita diretamente no buffer de output a partir de start
+typedef struct ReadOutput {
+  char (*keys)[MAX_STRING_SIZE];
+  OutputBuffer *out;
+  size_t start;
+} ReadOutput;
+
+// Chamada por read_pairs com o valor ainda na tabela; se a leitura for repetida recomeçamos a linha.
+static void append_read_pair(void *arg, size_t index, const char *value) {
+  ReadOutput *line = arg;
+  if (index == 0) {
+    line->out->len = line->start;
+    output_write(line->out, "[", 1);
+  }
+  output_write(line->out, "(", 1);
+  output_string(line->out, line->keys[index]);
+  if (value == NULL) {
+    output_string(line->out, ",KVSERROR)");
+  } else {
+    output_write(line->out, ",", 1);
+    output_string(line->out, value);
+    output_write(line->out, ")", 1);
+  }
+}
+
+// Valores de um kvs_read_pairs, copiados da tabela para quem pediu
+typedef struct ReadValues {
+  char (*values)[MAX_STRING_SIZE];
+  int *found;
+} ReadValues;
+
+static void copy_read_pair(void *arg, size_t index, const char *value) {
+  ReadValues *result = arg;
+  result->found[index] = value != NULL;
+  if (value != NULL) {
+    strcpy(result->values[index], value);
+  }
+}
+
+int kvs_read_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int found[]) {
   if (kvs_table == NULL) {
     write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
     return 1;
   }
-  pthread_rwlock_wrlock(kvs_table->table_mutex);
-  for (size_t i = 1; i < num_pairs; i++) { //ordenar as keys antes de procurá-las na hashtable
-    char temp[MAX_STRING_SIZE];
-    strcpy(temp, keys[i]);
-    size_t j = i;
-    while (j > 0 && strcmp(keys[j - 1], temp) > 0) {
-      strcpy(keys[j], keys[j - 1]);
-      j--;
-    }
-    strcpy(keys[j], temp);
+  if (kvs_shards != NULL) {
+    shard_run(kvs_shards, SHARD_READ, num_pairs, keys, values, found);
+    return 0;
   }
-  write(outputFd, "[", 1);
-  for (size_t i = 0; i < num_pairs; i++) {
-    char* result = read_pair(kvs_table, keys[i]);
-    if (result == NULL) {
-      write(outputFd, "(", 1);
-      write(outputFd, keys[i], strlen(keys[i]));
-      write(outputFd, ",KVSERROR)", strlen(",KVSERROR)"));
-    } else {
-      write(outputFd,"(", 1);
-      write(outputFd, keys[i], strlen(keys[i]));
-      write(outputFd,",", 1);
-      write(outputFd, result, strlen(result));
-      write(outputFd,")", 1);
+  // Uma leitura repetida volta a escrever todos os valores, por isso não é preciso ordenar
+  ReadValues result = {.values = values, .found = found};
+  read_pairs(kvs_table, num_pairs, keys, copy_read_pair, &result);
+  return 0;
+}
+
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+  qsort(keys, num_pairs, MAX_STRING_SIZE, compare_keys); //ordenar as keys antes de procurá-las na hashtable
+  if (kvs_shards != NULL) {
+    // Os donos copiam os valores para aqui e a linha é escrita depois de todos responderem
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    int found[MAX_WRITE_SIZE];
+    shard_run(kvs_shards, SHARD_READ, num_pairs, keys, values, found);
+    ReadOutput line = {.keys = keys, .out = out, .start = out->len};
+    for (size_t i = 0; i < num_pairs; i++) {
+      append_read_pair(&line, i, found[i] ? values[i] : NULL);
     }
-    free(result);
+    output_write(out, "]\n", 2);
+    return 0;
   }
-  write(outputFd, "]\n", 2);
-  pthread_rwlock_unlock(kvs_table->table_mutex);
+  // As chaves são lidas sem locks, como um único snapshot consistente (ver read_pairs), e os
+  // valores são copiados diretamente da tabela para o buffer de output. Reservamos espaço para
+  // a linha inteira para que uma leitura repetida possa recomeçá-la sem ter sido despejada.
+  output_reserve(out, READ_OUTPUT_MAX);
+  ReadOutput line = {.keys = keys, .out = out, .start = out->len};
+  read_pairs(kvs_table, num_pairs, keys, append_read_pair, &line);
+  output_write(out, "]\n", 2);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int outputFd) {
+int kvs_delete_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], int missing[]) {
   if (kvs_table == NULL) {
     write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
     return 1;
   }
+  if (kvs_wal != NULL && wal_failed(kvs_wal)) {
+    return 1;
+  }
 
+  uint64_t record;
+  if (kvs_shards != NULL) {
+    record = shard_run(kvs_shards, SHARD_DELETE, num_pairs, keys, NULL, missing);
+  } else {
+    record = delete_pairs(kvs_table, num_pairs, keys, missing);
+  }
+  if (kvs_wal != NULL && wal_commit(kvs_wal, record)) {
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out) {
   int aux = 0;
+  int missing[MAX_WRITE_SIZE];
+  if (kvs_delete_pairs(num_pairs, keys, missing)) {
+    return 1;
+  }
 
   for (size_t i = 0; i < num_pairs; i++) {
-    if (delete_pair(kvs_table, keys[i]) != 0) {
+    if (missing[i]) {
       if (!aux) {
-        write(outputFd, "[", 1);
+        output_write(out, "[", 1);
         aux = 1;
       }
-      write(outputFd, "(", 1);
-      write(outputFd, keys[i], strlen(keys[i]));
-      write(outputFd, ",KVSMISSING)", strlen(",KVSMISSING)"));    }
+      output_write(out, "(", 1);
+      output_string(out, keys[i]);
+      output_string(out, ",KVSMISSING)");
+    }
   }
   if (aux) {
-    write(outputFd, "]\n", 2);
+    output_write(out, "]\n", 2);
   }
 
   return 0;
 }
 
-void kvs_show(int outputFd) {
+// Formata em line a linha de um par no output de um SHOW (e nos backups .bck).
+// @return O comprimento da linha (no máximo SHOW_LINE_SIZE).
+static size_t format_pair(char *line, const char *key, const char *value) {
+  size_t keyLen = strlen(key);
+  size_t valueLen = strlen(value);
+  line[0] = '(';
+  memcpy(line + 1, key, keyLen);
+  memcpy(line + 1 + keyLen, ", ", 2);
+  memcpy(line + 3 + keyLen, value, valueLen);
+  memcpy(line + 3 + keyLen + valueLen, ")\n", 2);
+  return keyLen + valueLen + 5;
+}
+
+static void show_pair(OutputBuffer *out, const char *key, const char *value) {
+  char line[SHOW_LINE_SIZE];
+  output_write(out, line, format_pair(line, key, value));
+}
+
+// Escreve todos os pares por ordem; quem chama garante que a tabela não muda entretanto.
+static void show_table(OutputBuffer *out) {
+  // O índice ordenado de cada stripe dá-nos as chaves por ordem sem ordenar nada
+  TableIterator it;
+  table_iter_init(kvs_table, &it, NULL);
+  KeyNode *keyNode;
+  while ((keyNode = table_iter_next(&it)) != NULL) {
+    show_pair(out, keyNode->key, keyNode->value);
+  }
+}
+
+// Escreve todos os pares num snapshot binário, nas mesmas condições que show_table.
+// @return 0 se o ficheiro foi escrito, -1 caso contrário.
+static int write_binary_snapshot(OutputBuffer *out) {
+  SnapshotWriter writer;
+  snapshot_writer_init(&writer, out);
+  TableIterator it;
+  table_iter_init(kvs_table, &it, NULL);
+  KeyNode *keyNode;
+  while ((keyNode = table_iter_next(&it)) != NULL) {
+    snapshot_write_pair(&writer, keyNode->key, keyNode->value);
+  }
+  return snapshot_writer_finish(&writer);
+}
+
+// Lê o stripe_seq de cada stripe; quem chama tem as stripes todas bloqueadas.
+static void read_stripe_seqs(unsigned int seq[LOCK_STRIPES]) {
+  for (size_t s = 0; s < LOCK_STRIPES; s++) {
+    seq[s] = atomic_load_explicit(&kvs_table->stripe_seq[s], memory_order_relaxed);
+  }
+}
+
+// Devolve (com uma referência) o texto em cache se ele mostrar o estado seq, NULL caso contrário.
+static ShowImage *show_image_get(const unsigned int seq[LOCK_STRIPES]) {
+  pthread_mutex_lock(&show_cache.image_mutex);
+  ShowImage *image = show_cache.image;
+  if (image != NULL && memcmp(image->seq, seq, sizeof(image->seq)) == 0) {
+    atomic_fetch_add(&image->refs, 1);
+  } else {
+    image = NULL;
+  }
+  pthread_mutex_unlock(&show_cache.image_mutex);
+  return image;
+}
+
+static void show_image_put(ShowImage *image) {
+  if (atomic_fetch_sub(&image->refs, 1) == 1) {
+    free(image->data);
+    free(image);
+  }
+}
+
+// Formata as linhas dos pares da stripe s da cache. Chamada com show_cache.mutex.
+// @return 0 se as linhas foram formatadas, -1 se faltou memória.
+static int format_stripe(size_t s) {
+  size_t len = show_cache.len[s];
+  char *text = NULL;
+  uint8_t *lineLen = NULL;
+  size_t textLen = 0;
+  if (len > 0) {
+    text = malloc(len * SHOW_LINE_SIZE);
+    lineLen = malloc(len);
+    if (text == NULL || lineLen == NULL) {
+      free(text);
+      free(lineLen);
+      return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+      const SnapshotPair *pair = &show_cache.pairs[s][i];
+      lineLen[i] = (uint8_t)format_pair(text + textLen, pair->key, pair->value);
+      textLen += lineLen[i];
+    }
+    // Sem memória para encolher, o texto fica no espaço que já tem
+    char *shrunk = realloc(text, textLen);
+    if (shrunk != NULL) text = shrunk;
+  }
+  free(show_cache.text[s]);
+  free(show_cache.line_len[s]);
+  show_cache.text[s] = text;
+  show_cache.text_len[s] = textLen;
+  show_cache.line_len[s] = lineLen;
+  return 0;
+}
+
+// Texto novo feito com as linhas das stripes da cache. As stripes que mudaram são juntadas
+// por ordem de chave com uma heap ordenada pelo par seguinte de cada uma, como em
+// table_snapshot_next.
+typedef struct CacheMerge {
+  ShowImage *image;
+  uint8_t *order; // Stripe de cada linha do texto novo
+  size_t lines;
+  size_t cursor[LOCK_STRIPES]; // Próximo par de cada stripe
+  size_t offset[LOCK_STRIPES]; // Posição da sua linha em show_cache.text
+  size_t heap[LOCK_STRIPES];
+  size_t heap_size;
+} CacheMerge;
+
+static const char *merge_key(CacheMerge *merge, size_t s) {
+  return show_cache.pairs[s][merge->cursor[s]].key;
+}
+
+static int merge_less(CacheMerge *merge, size_t a, size_t b) {
+  return strcmp(merge_key(merge, a), merge_key(merge, b)) < 0;
+}
+
+static void merge_sift_down(CacheMerge *merge, size_t i) {
+  while (1) {
+    size_t smallest = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < merge->heap_size && merge_less(merge, merge->heap[left], merge->heap[smallest])) smallest = left;
+    if (right < merge->heap_size && merge_less(merge, merge->heap[right], merge->heap[smallest])) smallest = right;
+    if (smallest == i) return;
+    size_t tmp = merge->heap[i];
+    merge->heap[i] = merge->heap[smallest];
+    merge->heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+// Acrescenta ao texto novo a próxima linha da stripe s
+static void merge_copy_line(CacheMerge *merge, size_t s) {
+  size_t len = show_cache.line_len[s][merge->cursor[s]++];
+  memcpy(merge->image->data + merge->image->len, show_cache.text[s] + merge->offset[s], len);
+  merge->image->len += len;
+  merge->offset[s] += len;
+  merge->order[merge->lines++] = (uint8_t)s;
+}
+
+// Acrescenta ao texto novo a menor linha das stripes da heap
+static void merge_pop(CacheMerge *merge) {
+  size_t s = merge->heap[0];
+  merge_copy_line(merge, s);
+  if (merge->cursor[s] == show_cache.len[s]) {
+    merge->heap[0] = merge->heap[--merge->heap_size];
+  }
+  merge_sift_down(merge, 0);
+}
+
+// Junta as linhas das stripes da cache num texto novo. As linhas das stripes fora de changed
+// seguem a ordem que tinham no texto anterior (show_cache.order), e só as das stripes em
+// changed são comparadas com elas. Chamada com show_cache.mutex.
+static ShowImage *build_show_image(const unsigned int seq[LOCK_STRIPES], uint64_t changed) {
+  if (!show_cache.ordered) {
+    changed = ALL_STRIPES;
+  }
+  size_t textLen = 0;
+  size_t lines = 0;
+  for (size_t s = 0; s < LOCK_STRIPES; s++) {
+    textLen += show_cache.text_len[s];
+    lines += show_cache.len[s];
+  }
+  ShowImage *image = calloc(1, sizeof(ShowImage));
+  uint8_t *order = malloc(lines > 0 ? lines : 1);
+  char *data = textLen > 0 ? malloc(textLen) : NULL;
+  if (image == NULL || order == NULL || (textLen > 0 && data == NULL)) {
+    free(image);
+    free(order);
+    free(data);
+    return NULL;
+  }
+  memcpy(image->seq, seq, sizeof(image->seq));
+  image->data = data;
+
+  CacheMerge merge = {.image = image, .order = order, .lines = 0, .heap_size = 0};
+  for (size_t s = 0; s < LOCK_STRIPES; s++) {
+    merge.cursor[s] = 0;
+    merge.offset[s] = 0;
+    if ((changed & (1ULL << s)) && show_cache.len[s] > 0) {
+      merge.heap[merge.heap_size++] = s;
+    }
+  }
+  for (size_t i = merge.heap_size / 2; i-- > 0;) {
+    merge_sift_down(&merge, i);
+  }
+  if (changed != ALL_STRIPES) {
+    for (size_t i = 0; i < show_cache.lines; i++) {
+      size_t s = show_cache.order[i];
+      if (changed & (1ULL << s)) continue;
+      // Antes da linha entram as das stripes que mudaram com chaves menores
+      const char *key = merge_key(&merge, s);
+      while (merge.heap_size > 0 && strcmp(merge_key(&merge, merge.heap[0]), key) < 0) {
+        merge_pop(&merge);
+      }
+      merge_copy_line(&merge, s);
+    }
+  }
+  while (merge.heap_size > 0) {
+    merge_pop(&merge);
+  }
+
+  free(show_cache.order);
+  show_cache.order = order;
+  show_cache.lines = lines;
+  show_cache.ordered = 1;
+  return image;
+}
+
+// Atualiza a cache com o estado atual da tabela, copiando e formatando só as stripes que
+// mudaram, e devolve o seu texto (com uma referência), ou NULL se faltou memória.
+static ShowImage *update_show_image(void) {
+  pthread_mutex_lock(&show_cache.mutex);
+  unsigned int seq[LOCK_STRIPES];
+  TableSnapshot snap;
   read_lock_kvs_mutex();
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i];
-    while (keyNode != NULL) {
-      write(outputFd,"(", 1);
-      write(outputFd, keyNode->key, strlen(keyNode->key));
-      write(outputFd,", ", 2);
-      write(outputFd, keyNode->value, strlen(keyNode->value));
-      write(outputFd,")\n", 2);
-      //printf("(%s, %s)\n", keyNode->key, keyNode->value);
-      keyNode = keyNode->next; // Move to the next node
+  read_stripe_seqs(seq);
+  // Outro SHOW pode ter atualizado a cache enquanto esperávamos
+  ShowImage *image = show_image_get(seq);
+  if (image != NULL) {
+    unlock_kvs_mutex();
+    pthread_mutex_unlock(&show_cache.mutex);
+    return image;
+  }
+  table_snapshot_begin(kvs_table, &snap);
+  unlock_kvs_mutex();
+
+  // As stripes cujo seq não mudou têm na cache o mesmo que o snapshot veria
+  int failed = 0;
+  uint64_t changed = 0;
+  for (size_t s = 0; s < LOCK_STRIPES && !failed; s++) {
+    if (show_cache.copied[s] && show_cache.seq[s] == seq[s]) continue;
+    SnapshotPair *pairs;
+    size_t len;
+    if (table_snapshot_copy_stripe(kvs_table, &snap, s, &pairs, &len) != 0) {
+      failed = 1;
+      break;
     }
+    free(show_cache.pairs[s]);
+    show_cache.pairs[s] = pairs;
+    show_cache.len[s] = len;
+    show_cache.seq[s] = seq[s];
+    changed |= 1ULL << s;
+    show_cache.copied[s] = format_stripe(s) == 0;
+    failed = !show_cache.copied[s];
+  }
+  table_snapshot_release(kvs_table, &snap);
+
+  if (!failed && (image = build_show_image(seq, changed)) != NULL) {
+    // Uma referência é da cache e a outra de quem pediu
+    atomic_init(&image->refs, 2);
+    pthread_mutex_lock(&show_cache.image_mutex);
+    ShowImage *old = show_cache.image;
+    show_cache.image = image;
+    pthread_mutex_unlock(&show_cache.image_mutex);
+    if (old != NULL) {
+      show_image_put(old);
+    }
+  } else {
+    // order já não diz onde ficam as linhas das stripes copiadas agora
+    show_cache.ordered = 0;
+  }
+  pthread_mutex_unlock(&show_cache.mutex);
+  return image;
+}
+
+// Esquece a cache do SHOW (a tabela a que ela se refere vai deixar de existir).
+static void clear_show_cache(void) {
+  if (show_cache.image != NULL) {
+    show_image_put(show_cache.image);
+    show_cache.image = NULL;
+  }
+  for (size_t s = 0; s < LOCK_STRIPES; s++) {
+    free(show_cache.pairs[s]);
+    free(show_cache.text[s]);
+    free(show_cache.line_len[s]);
+    show_cache.pairs[s] = NULL;
+    show_cache.text[s] = NULL;
+    show_cache.line_len[s] = NULL;
+    show_cache.len[s] = 0;
+    show_cache.text_len[s] = 0;
+    show_cache.copied[s] = 0;
+  }
+  free(show_cache.order);
+  show_cache.order = NULL;
+  show_cache.lines = 0;
+  show_cache.ordered = 0;
+}
+
+void kvs_show(OutputBuffer *out) {
+  // Sem nenhuma escrita desde o último SHOW, o texto dele serve tal como está
+  unsigned int seq[LOCK_STRIPES];
+  read_lock_kvs_mutex();
+  read_stripe_seqs(seq);
+  ShowImage *image = show_image_get(seq);
+  unlock_kvs_mutex();
+  if (image == NULL) {
+    image = update_show_image();
+  }
+  if (image != NULL) {
+    // O texto é escrito sem nenhum lock (e de uma vez, se não couber no buffer)
+    output_write(out, image->data, image->len);
+    show_image_put(image);
+    return;
   }
+
+  // Sem memória para a cache: as stripes só ficam todas bloqueadas enquanto a versão do
+  // snapshot é registada, a cópia bloqueia uma stripe de cada vez e o output é escrito a
+  // partir da cópia, sem nenhum lock.
+  TableSnapshot snap;
+  read_lock_kvs_mutex();
+  table_snapshot_begin(kvs_table, &snap);
   unlock_kvs_mutex();
+  if (table_snapshot_copy(kvs_table, &snap) != 0) {
+    // Nem para a cópia: percorremos a própria tabela com as stripes bloqueadas
+    read_lock_kvs_mutex();
+    show_table(out);
+    unlock_kvs_mutex();
+    return;
+  }
+  const SnapshotPair *pair;
+  while ((pair = table_snapshot_next(&snap)) != NULL) {
+    show_pair(out, pair->key, pair->value);
+  }
+  table_snapshot_free(&snap);
+}
+
+int kvs_scan(const char *prefix, OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+
+  read_lock_kvs_mutex();
+  TableIterator it;
+  table_iter_init(kvs_table, &it, prefix);
+  KeyNode *keyNode;
+  output_write(out, "[", 1);
+  while ((keyNode = table_iter_next(&it)) != NULL) {
+    output_write(out, "(", 1);
+    output_string(out, keyNode->key);
+    output_write(out, ",", 1);
+    output_string(out, keyNode->value);
+    output_write(out, ")", 1);
+  }
+  output_write(out, "]\n", 2);
+  unlock_kvs_mutex();
+  return 0;
+}
+
+void kvs_stats(OutputBuffer *out) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return;
+  }
+
+  TableStats stats;
+  read_lock_kvs_mutex();
+  table_stats(kvs_table, &stats);
+  unlock_kvs_mutex();
+  // Fração das procuras de chaves inexistentes que o filtro não evitou
+  uint64_t misses = stats.bloom_negatives + stats.bloom_false_positives;
+  double rate = misses == 0 ? 0.0 : (double)stats.bloom_false_positives / (double)misses;
+  char line[256];
+  int len = snprintf(line, sizeof(line),
+                     "[(keys,%zu)(buckets,%zu)(bloom_negatives,%" PRIu64 ")(bloom_false_positives,%" PRIu64
+                     ")(bloom_fp_rate,%.4f)]\n",
+                     stats.keys, stats.buckets, stats.bloom_negatives, stats.bloom_false_positives, rate);
+  output_write(out, line, (size_t)len);
 }
 
 /*Função para criar o file para colocar o backup: */
-int createBackupFile(const char *fileName, int backupNum)
-{ // função para criar o backup file
+int createBackupFile(const char *fileName, int backupNum, const char *extension)
+{ // função para criar o backup file (extension é "bck" ou "snap")
   size_t fileNameLen = strlen(fileName);
   // criar buffer para o nome do arquivo de backup
   char backupFileName[MAX_BACKUP_FILE_NAME_SIZE];
   // copiar nome do file que estamos a copiar
-  snprintf(backupFileName, MAX_BACKUP_FILE_NAME_SIZE, "%.*s-%d.bck", (int)(fileNameLen - 4), fileName, backupNum);
+  snprintf(backupFileName, MAX_BACKUP_FILE_NAME_SIZE, "%.*s-%d.%s", (int)(fileNameLen - 4), fileName, backupNum, extension);
   // abrir/criar o arquivo de backup
   int backupFd = open(backupFileName, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
   if (backupFd == -1)
@@ -182,56 +784,464 @@ int createBackupFile(const char *fileName, int backupNum)
   return backupFd; // return fd ou -1 em caso de erro
 }
 
-void kvs_backup(const char *fileName, pthread_mutex_t *backup_mutex, int *backup_counter, int *backupNum, DIR *directory, in_out_fds *fd) {
-    pid_t pid = fork();  // Cria o processo filho
-    pthread_mutex_lock(backup_mutex);
-    (*backupNum)++;  
-    pthread_mutex_unlock(backup_mutex);
-    if (pid == -1) {  // Erro no fork
-        perror("Failed to fork\n");
-        pthread_mutex_lock(backup_mutex);
-        (*backup_counter)--;  // Decrementa o contador de backups em caso de erro
-        pthread_mutex_unlock(backup_mutex);
-        return;
-    }
-    if (pid == 0) {  // Processo filho
-        int backupFd = createBackupFile(fileName, *backupNum); 
-        if (backupFd == -1) {
-            close(backupFd);
-            closedir(directory);
-            cleanFds(fd->input, fd->output);     
-            free(fd->threads); 
-            free(kvs_table->table_mutex);
-            free_table(kvs_table);
-            free(fd);
-            exit(EXIT_FAILURE);  
-        }
-        kvs_show(backupFd);  
-        close(backupFd);
-        closedir(directory);
-        free(fd->threads);
-        cleanFds(fd->input, fd->output);
-        free(kvs_table->table_mutex);
-        free_table(kvs_table);
-        free(fd);
-        exit(EXIT_SUCCESS);  
-    } 
-    // Wait for all child processes to finish
-  while (1) {
-    pid_t processId = waitpid(-1, NULL, 0);
-      if (processId == -1) {
-        if (errno == ECHILD) {
-          // No more child processes
-          break;
-        } else if (errno == EINTR) {
-          // Interrupted by a signal, continue waiting
-          continue;
+void kvs_set_delta_backups(int enable) {
+  backups.delta = enable;
+  table_track_changes(kvs_table, enable);
+}
+
+// A tabela só guarda as alterações posteriores ao backup base mais antigo.
+// Chamada com backups.mutex.
+static void update_changes_floor() {
+  uint64_t floor = UINT64_MAX;
+  for (BackupState *base = backups.bases; base != NULL; base = base->next) {
+    if (base->version < floor) {
+      floor = base->version;
+    }
+  }
+  table_forget_changes(kvs_table, floor);
+}
+
+// Escreve um delta: o número do backup base e, por ordem, cada chave alterada com o valor
+// atual, ou "(key)" se foi apagada. Corre no processo filho, onde a tabela não muda e
+// não há outras tarefas, por isso lê sem locks nem épocas.
+static void write_delta(OutputBuffer *out, int base, char keys[][MAX_STRING_SIZE], size_t num_keys) {
+  char header[32];
+  snprintf(header, sizeof(header), "DELTA %d\n", base);
+  output_string(out, header);
+  for (size_t i = 0; i < num_keys; i++) {
+    const char *value = read_pair(kvs_table, keys[i]);
+    output_write(out, "(", 1);
+    output_string(out, keys[i]);
+    if (value != NULL) {
+      output_write(out, ", ", 2);
+      output_string(out, value);
+    }
+    output_write(out, ")\n", 2);
+  }
+}
+
+void kvs_set_snapshot_backups(int enable) {
+  backups.snapshot = enable;
+}
+
+void kvs_set_binary_backups(int enable) {
+  backups.binary = enable;
+}
+
+static void reserve_restore(void *arg, uint64_t count) {
+  (void)arg;
+  // Sem memória para crescer de uma vez a tabela cresce aos poucos, como nas escritas
+  table_reserve(kvs_table, (size_t)count);
+}
+
+static int restore_pair(void *arg, const char *key, const char *value) {
+  (void)arg;
+  return write_pair(kvs_table, key, value);
+}
+
+int kvs_restore(int snapshotFd) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+  return snapshot_load(snapshotFd, reserve_restore, restore_pair, NULL);
+}
+
+// Aplica um registo do WAL à tabela (ainda sem o WAL ligado, para não o registar outra vez).
+static void replay_record(void *arg, enum WalRecord type, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+  (void)arg;
+  for (size_t i = 0; i < num_keys; i++) {
+    if (type == WAL_WRITE) {
+      write_pair(kvs_table, keys[i], values[i]);
+    } else {
+      delete_pair(kvs_table, keys[i]);
+    }
+  }
+}
+
+int kvs_start_shards(size_t num_shards) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+  kvs_shards = shard_set_create(kvs_table, num_shards);
+  return kvs_shards == NULL;
+}
+
+int kvs_open_wal(int walFd, enum WalSync policy) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+  kvs_wal = wal_open(walFd, policy, replay_record, NULL);
+  if (kvs_wal == NULL) {
+    return 1;
+  }
+  table_set_batch_hook(kvs_table, wal_append, kvs_wal);
+  return 0;
+}
+
+// Escreve o backup a partir de um snapshot já copiado: todos os pares, ou só as chaves do
+// delta (as que não estão no snapshot foram apagadas).
+// @return 0 se não houve erro (o texto ainda pode estar no buffer), -1 caso contrário.
+static int write_snapshot(OutputBuffer *out, SnapshotBackup *job) {
+  const SnapshotPair *pair = table_snapshot_next(&job->snap);
+  if (backups.binary) {
+    SnapshotWriter writer;
+    snapshot_writer_init(&writer, out);
+    for (; pair != NULL; pair = table_snapshot_next(&job->snap)) {
+      snapshot_write_pair(&writer, pair->key, pair->value);
+    }
+    return snapshot_writer_finish(&writer);
+  }
+  if (!job->delta) {
+    for (; pair != NULL; pair = table_snapshot_next(&job->snap)) {
+      show_pair(out, pair->key, pair->value);
+    }
+    return 0;
+  }
+
+  char header[32];
+  snprintf(header, sizeof(header), "DELTA %d\n", job->num - 1);
+  output_string(out, header);
+  for (size_t i = 0; i < job->num_changed; i++) {
+    while (pair != NULL && strcmp(pair->key, job->changed[i]) < 0) {
+      pair = table_snapshot_next(&job->snap);
+    }
+    output_write(out, "(", 1);
+    output_string(out, job->changed[i]);
+    if (pair != NULL && strcmp(pair->key, job->changed[i]) == 0) {
+      output_write(out, ", ", 2);
+      output_string(out, pair->value);
+    }
+    output_write(out, ")\n", 2);
+  }
+  return 0;
+}
+
+// Tarefa de um backup por snapshot: copia a versão registada stripe a stripe (as escritas
+// continuam entretanto) e escreve o ficheiro sem nenhum lock da tabela.
+static void *snapshot_backup(void *arg) {
+  SnapshotBackup *job = arg;
+  if (job->image != NULL || table_snapshot_copy(kvs_table, &job->snap) == 0) {
+    int backupFd = createBackupFile(job->fileName, job->num, backups.binary ? "snap" : "bck");
+    if (backupFd != -1) {
+      OutputBuffer *out = malloc(sizeof(OutputBuffer));
+      if (out != NULL) {
+        output_init(out, backupFd);
+        int status = 0;
+        if (job->image != NULL) {
+          output_write(out, job->image->data, job->image->len);
         } else {
-          perror("Error waiting for child process");
+          status = write_snapshot(out, job);
+        }
+        if (output_flush(out) != 0 || status != 0) {
+          write(STDERR_FILENO, "Failed to write backup\n", strlen("Failed to write backup\n"));
+        }
+        free(out);
+      }
+      close(backupFd);
+    }
+    if (job->image != NULL) {
+      show_image_put(job->image);
+    } else {
+      table_snapshot_free(&job->snap);
+    }
+  } else {
+    write(STDERR_FILENO, "Failed to copy snapshot\n", strlen("Failed to copy snapshot\n"));
+  }
+  free(job->changed);
+
+  pthread_mutex_lock(&backups.mutex);
+  job->thread = pthread_self();
+  job->next = backups.finished;
+  backups.finished = job;
+  pthread_cond_broadcast(&backups.changed);
+  pthread_mutex_unlock(&backups.mutex);
+  return NULL;
+}
+
+// Lança o backup por snapshot. Chamada com todas as stripes bloqueadas, para que o
+// snapshot fique com a versão atual. Fica com o array changed e com a referência a image,
+// o texto de um SHOW do estado atual (se houver, não é preciso snapshot).
+// @return 0 se a tarefa foi lançada, 1 caso contrário.
+static int start_snapshot_backup(const char *fileName, int backupNum, int delta, char (*changed)[MAX_STRING_SIZE], size_t num_changed, ShowImage *image) {
+  SnapshotBackup *job = malloc(sizeof(SnapshotBackup));
+  if (job == NULL) {
+    free(changed);
+    if (image != NULL) show_image_put(image);
+    return 1;
+  }
+  snprintf(job->fileName, sizeof(job->fileName), "%s", fileName);
+  job->num = backupNum;
+  job->delta = delta;
+  job->changed = changed;
+  job->num_changed = num_changed;
+  job->image = image;
+  if (image == NULL) {
+    table_snapshot_begin(kvs_table, &job->snap);
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, snapshot_backup, job) != 0) {
+    if (image != NULL) {
+      show_image_put(image);
+    } else {
+      table_snapshot_release(kvs_table, &job->snap);
+    }
+    free(changed);
+    free(job);
+    return 1;
+  }
+  return 0;
+}
+
+int kvs_backup(const char *fileName, BackupState *state, int max_backups) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+  // O número só é gasto se o backup começar
+  int backupNum = state->num + 1;
+
+  // Só esperamos se já houver max_backups a correr, nunca pelos backups dos outros ficheiros
+  pthread_mutex_lock(&backups.mutex);
+  while (backups.reserved >= max_backups) {
+    pthread_cond_wait(&backups.changed, &backups.mutex);
+  }
+  backups.reserved++;
+  pthread_mutex_unlock(&backups.mutex);
+
+  // O backup é tirado com todas as stripes bloqueadas para leitura: nenhuma escrita está a
+  // meio. No fork, nenhum lock fica preso no filho, que percorre a tabela sem locks (é a
+  // única tarefa lá); no snapshot, só o registo da versão é feito aqui.
+  read_lock_kvs_mutex();
+  uint64_t version = table_version(kvs_table);
+  // Um delta só compensa se tiver menos chaves do que a tabela inteira
+  char (*changed)[MAX_STRING_SIZE] = NULL;
+  size_t num_changed = 0;
+  int delta = backups.delta && !backups.binary && state->has_base &&
+              table_changed_keys(kvs_table, state->version, &changed, &num_changed) == 0 &&
+              num_changed < atomic_load(&kvs_table->count);
+  // Um backup completo em texto do mesmo estado que o último SHOW é o texto desse SHOW
+  ShowImage *image = NULL;
+  if (!delta && !backups.binary) {
+    unsigned int seq[LOCK_STRIPES];
+    read_stripe_seqs(seq);
+    image = show_image_get(seq);
+  }
+  pid_t pid;
+  if (backups.snapshot) {
+    pid = start_snapshot_backup(fileName, backupNum, delta, changed, num_changed, image) ? -1 : 0;
+    changed = NULL;
+    image = NULL;
+  } else if ((pid = fork()) == 0) {  // Processo filho
+    // O filho não liberta nada nem chama malloc: outras tarefas do pai podiam ter locks do
+    // alocador no momento do fork. Sai com _exit e o sistema liberta tudo.
+    int backupFd = createBackupFile(fileName, backupNum, backups.binary ? "snap" : "bck");
+    if (backupFd == -1) {
+      _exit(EXIT_FAILURE);
+    }
+    OutputBuffer backup;
+    output_init(&backup, backupFd);
+    int status;
+    if (backups.binary) {
+      status = write_binary_snapshot(&backup);
+    } else {
+      if (delta) {
+        write_delta(&backup, backupNum - 1, changed, num_changed);
+      } else if (image != NULL) {
+        output_write(&backup, image->data, image->len);
+      } else {
+        show_table(&backup);
+      }
+      status = output_flush(&backup);
+    }
+    close(backupFd);
+    _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&backups.mutex);
+  if (pid == -1) {  // Erro no fork
+    backups.reserved--;
+  } else {
+    if (!backups.snapshot) {
+      backups.running++;
+    }
+    state->num = backupNum;
+    // Este backup passa a ser a base do próximo. Ainda com as stripes bloqueadas, para que
+    // nenhuma alteração posterior seja descartada antes de a base contar.
+    if (backups.delta) {
+      state->version = version;
+      if (!state->has_base) {
+        state->has_base = 1;
+        state->prev = NULL;
+        state->next = backups.bases;
+        if (backups.bases != NULL) {
+          backups.bases->prev = state;
+        }
+        backups.bases = state;
+      }
+      update_changes_floor();
+    }
+  }
+  pthread_cond_broadcast(&backups.changed);
+  pthread_mutex_unlock(&backups.mutex);
+  unlock_kvs_mutex();
+  free(changed);
+  if (image != NULL) {
+    show_image_put(image);
+  }
+
+  if (pid == -1) {
+    perror(backups.snapshot ? "Failed to start backup" : "Failed to fork");
+    return 1;
+  }
+  return 0;
+}
+
+void kvs_backup_done(BackupState *state) {
+  pthread_mutex_lock(&backups.mutex);
+  if (state->has_base) {
+    if (state->prev != NULL) {
+      state->prev->next = state->next;
+    } else {
+      backups.bases = state->next;
+    }
+    if (state->next != NULL) {
+      state->next->prev = state->prev;
+    }
+    state->has_base = 0;
+    update_changes_floor();
+  }
+  pthread_mutex_unlock(&backups.mutex);
+}
+
+// Lê o número N de um backup chamado <job>-N.bck.
+// @return 0 se o nome tem o número, 1 caso contrário.
+static int backup_number(const char *path, unsigned int *num) {
+  const char *end = strrchr(path, '.');
+  if (end == NULL) {
+    return 1;
+  }
+  const char *start = end;
+  while (start > path && start[-1] >= '0' && start[-1] <= '9') {
+    start--;
+  }
+  if (start == end || start == path || start[-1] != '-' || end - start > 9) {
+    return 1;
+  }
+  *num = 0;
+  for (const char *digit = start; digit < end; digit++) {
+    *num = *num * 10 + (unsigned int)(*digit - '0');
+  }
+  return 0;
+}
+
+static void report_invalid_backup(const char *path, int line, const char *reason) {
+  char message[512];
+  int len = snprintf(message, sizeof(message), "Invalid backup file %s (line %d)%s\n", path, line, reason);
+  if (len >= (int)sizeof(message)) {
+    len = (int)sizeof(message) - 1;
+    message[len - 1] = '\n';
+  }
+  if (len > 0) {
+    write(STDERR_FILENO, message, (size_t)len);
+  }
+}
+
+int kvs_fold(int num_files, char *files[], int outputFd) {
+  if (kvs_table == NULL) {
+    write(STDERR_FILENO, "KVS state must be initialized\n", strlen("KVS state must be initialized\n"));
+    return 1;
+  }
+
+  // Os ficheiros são aplicados por ordem a uma tabela vazia: um backup completo repõe todos
+  // os pares e cada delta escreve ou apaga as chaves que mudaram
+  JobReader *reader = malloc(sizeof(JobReader));
+  if (reader == NULL) {
+    return 1;
+  }
+  int result = 0;
+  for (int i = 0; i < num_files && result == 0; i++) {
+    int fd = open(files[i], O_RDONLY);
+    if (fd == -1) {
+      perror("Couldn't open backup file");
+      result = 1;
+      break;
+    }
+    reader_init(reader, fd);
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+    int line = 0;
+    const char *reason = "";
+    enum BackupLine type;
+    unsigned int base;
+    while ((type = parse_backup_line(reader, key, value, MAX_STRING_SIZE, &base)) != BACKUP_END) {
+      // Depois do primeiro ficheiro só há deltas, e cada um começa pelo cabeçalho
+      if (line == 0 && i > 0 && type != BACKUP_DELTA) {
+        type = BACKUP_INVALID;
+        reason = ": not a delta";
+      }
+      switch (type) {
+        case BACKUP_DELTA: {
+          // Só a primeira linha de um delta, e nunca no primeiro ficheiro
+          unsigned int previous;
+          if (line != 0 || i == 0) {
+            result = 1;
+          } else if (backup_number(files[i - 1], &previous) != 0 || base != previous) {
+            // O delta tem de ser do backup do ficheiro anterior, senão faltam alterações
+            result = 1;
+            reason = ": not a delta of the previous file";
+          }
           break;
         }
+        case BACKUP_PAIR:
+          if (write_pair(kvs_table, key, value) != 0) {
+            result = 1;
+          }
+          break;
+        case BACKUP_TOMBSTONE:
+          delete_pair(kvs_table, key);
+          break;
+        case BACKUP_INVALID:
+        case BACKUP_END:
+          result = 1;
+          break;
       }
+      if (result != 0) {
+        report_invalid_backup(files[i], line + 1, reason);
+        break;
+      }
+      line++;
+    }
+    if (result == 0 && line == 0 && i > 0) {
+      result = 1;
+      report_invalid_backup(files[i], 1, ": not a delta");
+    }
+    reader_close(reader);
+    close(fd);
+  }
+  free(reader);
+
+  if (result == 0) {
+    OutputBuffer *out = malloc(sizeof(OutputBuffer));
+    if (out == NULL) {
+      return 1;
     }
+    output_init(out, outputFd);
+    kvs_show(out);
+    result = output_flush(out) != 0;
+    free(out);
+  }
+  return result;
+}
+
+void kvs_wait_backup() {
+  pthread_mutex_lock(&backups.mutex);
+  while (backups.reserved > 0) {
+    pthread_cond_wait(&backups.changed, &backups.mutex);
+  }
+  pthread_mutex_unlock(&backups.mutex);
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -2,37 +2,48 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include "constants.h"
+#include "parser.h"
+#include "output.h"
+#include "wal.h"
+#include "pool.h"
 #include <dirent.h>
 
 
+// Estado dos backups de um ficheiro .job
+typedef struct BackupState {
+  int num;          // Número do último backup (o N de <nome>-N.bck)
+  int has_base;     // Já houve um backup a partir do qual se podem fazer deltas
+  uint64_t version; // Versão da tabela nesse backup
+  struct BackupState *prev, *next; // Ficheiros com backup base, para saber que alterações guardar
+} BackupState;
+
 // @brief Estrutura que guarda os file descriptors e outras informações necessárias para cada tarefa.
 typedef struct fds{
   int input; // File descriptor of the file that we are reading from
+  JobReader reader; // Leitor com buffer do ficheiro de input, partilhado por todo o parser
   int output; // File descriptor of the output file
+  OutputBuffer out; // Buffer de output do ficheiro, despejado para output
   int max_backups; // Máximo de backups que podem acontecer em simultâneo
-  int backupNum;
-  const char *fileName;
-  DIR *dir;
-  pthread_t *threads;
+  BackupState backup; // Backups deste ficheiro
+  char fileName[MAX_JOB_FILE_NAME_SIZE];
+  ThreadPool *pool; // Pool onde corre o ficheiro (e os seus comandos, com -p)
+  int parallel;     // Comandos do ficheiro em paralelo (-p)
+  unsigned int id;  // Número do ficheiro, o thread_id dos WAIT (job_register)
+  atomic_uint delay; // Atraso pedido por WAITs de outros ficheiros, antes do próximo comando
 } in_out_fds;
 
-typedef struct generalInfo{
-  struct dirent *fileDir;
-  int max_backups;
-  DIR *dir;
-  pthread_t *threads;
-} info;
-
 
-/// Locks the kvs table mutex in write mode.
+/// Locks every stripe of the kvs table in write mode.
 void write_lock_kvs_mutex();
 
-/// Locks the kvs table mutex in read mode.
+/// Locks every stripe of the kvs table in read mode.
 void read_lock_kvs_mutex();
 
-/// Unlocks the kvs table mutex.
+/// Unlocks every stripe of the kvs table.
 void unlock_kvs_mutex();
 
 /// Initializes the KVS state.
@@ -48,38 +59,136 @@ int kvs_terminate();
 /// @param keys Array of keys' strings.
 /// @param values Array of values' strings.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int outputFd);
+int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param out Buffer to write the (successful) output.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int outputFd);
+int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
 /// @param keys Array of keys' strings.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int outputFd);
+int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], OutputBuffer *out);
 
-/// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int outputFd);
+/// Writes key value pairs to the KVS, like kvs_write, reporting the result of each pair
+/// instead of writing it to an output buffer.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys' strings.
+/// @param values Array of values' strings.
+/// @param failed Set to 1 for each pair that could not be written, 0 otherwise.
+/// @return 0 if the command was applied (and logged, with a WAL), 1 otherwise. With a WAL,
+/// 1 can also mean that the pairs were applied but their record couldn't be written: they
+/// are in the table but would be lost on a restart. Once that happens every later write
+/// or delete returns 1 without changing the table.
+int kvs_write_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int failed[]);
+
+/// Reads values from the KVS, like kvs_read, as one consistent snapshot.
+/// @param num_pairs Number of keys to read.
+/// @param keys Array of keys' strings.
+/// @param values Receives the value of each key that exists.
+/// @param found Set to 1 for each key that exists, 0 otherwise.
+/// @return 0 if the keys were read, 1 otherwise.
+int kvs_read_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], int found[]);
 
-/// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-void kvs_backup(const char *fileName, pthread_mutex_t *backup_mutex, int *backup_counter, int *backupNum, DIR *directory, in_out_fds *fd);
+/// Deletes key value pairs from the KVS, like kvs_delete.
+/// @param num_pairs Number of keys to delete.
+/// @param keys Array of keys' strings.
+/// @param missing Set to 1 for each key that did not exist, 0 otherwise.
+/// @return 0 if the command was applied (and logged, with a WAL), 1 otherwise (see
+/// kvs_write_pairs for what 1 means after a WAL failure).
+int kvs_delete_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE], int missing[]);
+
+/// Writes the state of the KVS. The pairs are copied from a snapshot of the table and
+/// written without holding any lock, so writers are not blocked by the output I/O.
+/// @param out Buffer to write the output.
+void kvs_show(OutputBuffer *out);
+
+/// Writes the pairs whose key starts with a prefix, in key order, without walking the
+/// whole table.
+/// @param prefix Prefix of the keys (empty for every key).
+/// @param out Buffer to write the output.
+/// @return 0 if the scan was successful, 1 otherwise.
+int kvs_scan(const char *prefix, OutputBuffer *out);
+
+/// Writes counters of the table: number of keys and buckets, and how many lookups of
+/// missing keys the Bloom filters answered without searching a bucket (bloom_negatives)
+/// or failed to rule out (bloom_false_positives).
+/// @param out Buffer to write the output.
+void kvs_stats(OutputBuffer *out);
+
+/// Makes every following backup after the first one of each file a delta with only the
+/// keys written or deleted since that file's previous backup. Must be called after kvs_init.
+/// @param enable 1 for delta backups, 0 for full ones.
+void kvs_set_delta_backups(int enable);
+
+/// Takes backups from an in-process snapshot of the table, written by a backup thread
+/// while writers continue, instead of forking a child process.
+/// @param enable 1 for snapshot backups, 0 for fork backups.
+void kvs_set_snapshot_backups(int enable);
+
+/// Writes backups as binary snapshots (<name>-N.snap, see snapshot.h) instead of text
+/// .bck files. Binary backups are always full, even with delta backups enabled.
+/// @param enable 1 for binary backups, 0 for text ones.
+void kvs_set_binary_backups(int enable);
+
+/// Loads a binary snapshot into the (empty) KVS. The file is checked before any pair is
+/// written.
+/// @param snapshotFd File descriptor of the snapshot.
+/// @return 0 if the snapshot was loaded, 1 otherwise.
+int kvs_restore(int snapshotFd);
+
+/// Replays a write-ahead log on top of the current state of the KVS (e.g. a restored
+/// snapshot) and appends every following WRITE/DELETE to it. Replaying commands that are
+/// already in the snapshot leaves the same state, so the log never has to be truncated.
+/// @param walFd File descriptor of the log, open for reading and writing.
+/// @param policy When the records of a command are synced to disk (see wal.h).
+/// @return 0 if the log was replayed and opened, 1 otherwise.
+int kvs_open_wal(int walFd, enum WalSync policy);
+
+/// From now on, WRITE, READ and DELETE are applied by one owner thread per shard of the
+/// table instead of by the threads that run them (see shard.h). A command with keys of
+/// several shards is only atomic within each shard.
+/// @param num_shards Number of shards (1 to LOCK_STRIPES).
+/// @return 0 if the owner threads were started, 1 otherwise.
+int kvs_start_shards(size_t num_shards);
 
-/// Waits for the last backup to be called.
+/// Creates a backup of the KVS state and stores it in the correspondent
+/// backup file. The state is captured when the function is called and written by a
+/// child process (or a backup thread, in snapshot mode) in the background; the caller only waits when max_backups backups
+/// are already running.
+/// @param fileName Name of the .job file.
+/// @param state Backups of this file; the backup gets number state->num + 1.
+/// @param max_backups Maximum number of backups running at the same time.
+/// @return 0 if the backup was started, 1 otherwise.
+int kvs_backup(const char *fileName, BackupState *state, int max_backups);
+
+/// Forgets the last backup of a file, once the file has no more commands, so its changes
+/// stop being recorded.
+/// @param state Backups of the file.
+void kvs_backup_done(BackupState *state);
+
+/// Rebuilds a full backup from a full one and the deltas taken after it.
+/// @param num_files Number of backup files.
+/// @param files Paths of a full backup followed by its deltas, in order. Every file after
+/// the first must be a delta whose base is the backup of the file before it (<job>-N.bck).
+/// @param outputFd File descriptor to write the full backup.
+/// @return 0 if the backup was rebuilt, 1 otherwise.
+int kvs_fold(int num_files, char *files[], int outputFd);
+
+/// Waits until every backup that was started has finished.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
 void kvs_wait(unsigned int delay_ms);
 
-void *tableOperations(void *fd_info);
+/// Runs every command of a .job file (a task of the thread pool) and frees its in_out_fds.
+/// @param fd_info in_out_fds of the file, with fileName, max_backups and backup set.
+void tableOperations(void *fd_info);
 
 
 #endif  // KVS_OPERATIONS_H
@@ -0,0 +1,96 @@
+#include "output.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void output_init(OutputBuffer *out, int fd) {
+  out->fd = fd;
+  out->sink = NULL;
+  out->sink_arg = NULL;
+  out->len = 0;
+}
+
+void output_init_sink(OutputBuffer *out, OutputSink sink, void *arg) {
+  out->fd = -1;
+  out->sink = sink;
+  out->sink_arg = arg;
+  out->len = 0;
+}
+
+// Escreve os iovecs por inteiro com writev, repetindo em escritas parciais e em EINTR.
+static int write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    size_t left = (size_t)written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+void output_write(OutputBuffer *out, const char *data, size_t len) {
+  // Sem bytes data pode ser NULL (a imagem de uma tabela vazia), e o memcpy não o aceita
+  if (len == 0) {
+    return;
+  }
+  if (len <= OUTPUT_BUFFER_SIZE - out->len) {
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return;
+  }
+
+  if (out->sink != NULL) {
+    out->sink(out->sink_arg, out->data, out->len);
+    out->sink(out->sink_arg, data, len);
+    out->len = 0;
+    return;
+  }
+
+  // Não cabe: o que está no buffer e os bytes novos seguem juntos num único writev
+  struct iovec iov[2] = {
+    {.iov_base = out->data, .iov_len = out->len},
+    {.iov_base = (void *)data, .iov_len = len},
+  };
+  write_all(out->fd, iov, 2);
+  out->len = 0;
+}
+
+void output_string(OutputBuffer *out, const char *string) {
+  output_write(out, string, strlen(string));
+}
+
+void output_reserve(OutputBuffer *out, size_t len) {
+  if (len > OUTPUT_BUFFER_SIZE - out->len) {
+    output_flush(out);
+  }
+}
+
+int output_flush(OutputBuffer *out) {
+  if (out->len == 0) {
+    return 0;
+  }
+  if (out->sink != NULL) {
+    out->sink(out->sink_arg, out->data, out->len);
+    out->len = 0;
+    return 0;
+  }
+  struct iovec iov = {.iov_base = out->data, .iov_len = out->len};
+  out->len = 0;
+  return write_all(out->fd, &iov, 1);
+}
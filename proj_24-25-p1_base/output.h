@@ -0,0 +1,57 @@
+#ifndef KVS_OUTPUT_H
+#define KVS_OUTPUT_H
+
+#include <stddef.h>
+
+/* Buffer de output de um ficheiro .out. Os comandos acumulam o output em memória em vez de
+ fazerem um write() por bocado de texto; o buffer só é escrito no ficheiro quando enche ou
+ quando é despejado explicitamente (antes de um comando que bloqueia e no fim do ficheiro).
+ Em vez de um ficheiro, o buffer pode ser despejado para uma função (output_init_sink), que
+ guarda os bytes onde quiser (o buffer de envio de um cliente do servidor, por exemplo). */
+
+// Tamanho do buffer de output de cada ficheiro .job
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef void (*OutputSink)(void *arg, const char *data, size_t len);
+
+typedef struct OutputBuffer {
+  int fd;
+  OutputSink sink; // Se não for NULL, recebe os bytes em vez de fd
+  void *sink_arg;
+  size_t len; // Bytes por escrever em data
+  char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
+/// Initializes an empty output buffer.
+/// @param out Buffer to initialize.
+/// @param fd File descriptor the buffer is flushed to.
+void output_init(OutputBuffer *out, int fd);
+
+/// Initializes an empty output buffer that is flushed to a function instead of a file.
+/// @param out Buffer to initialize.
+/// @param sink Called with the bytes of every flush, in order.
+/// @param arg Argument passed to sink.
+void output_init_sink(OutputBuffer *out, OutputSink sink, void *arg);
+
+/// Appends bytes to the buffer, flushing it first if they don't fit.
+/// @param out Output buffer.
+/// @param data Bytes to append.
+/// @param len Number of bytes.
+void output_write(OutputBuffer *out, const char *data, size_t len);
+
+/// Appends a NUL-terminated string to the buffer.
+/// @param out Output buffer.
+/// @param string String to append.
+void output_string(OutputBuffer *out, const char *string);
+
+/// Makes sure the next len bytes can be appended without flushing in the middle.
+/// @param out Output buffer.
+/// @param len Number of bytes (at most OUTPUT_BUFFER_SIZE).
+void output_reserve(OutputBuffer *out, size_t len);
+
+/// Writes every buffered byte to the file descriptor.
+/// @param out Output buffer.
+/// @return 0 if everything was written, -1 otherwise.
+int output_flush(OutputBuffer *out);
+
+#endif  // KVS_OUTPUT_H
@@ -7,24 +7,176 @@
 #include <dirent.h>
 #include "constants.h"
 #include <stdio.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
-static int read_string(int fd, char *buffer, size_t max)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void reader_init(JobReader *reader, int fd)
+{
+  reader->fd = fd;
+  reader->data = reader->buffer;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->mapped = 0;
+  reader->in_memory = 0;
+
+  // Se for um ficheiro regular mapeamo-lo inteiro: o parser lê diretamente do mapeamento e
+  // nunca mais faz read(). Se o mmap falhar usamos o buffer.
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode) || fileStat.st_size <= 0)
+  {
+    return;
+  }
+  void *map = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    return;
+  }
+  posix_madvise(map, (size_t)fileStat.st_size, POSIX_MADV_SEQUENTIAL);
+  reader->data = map;
+  reader->len = (size_t)fileStat.st_size;
+  reader->mapped = 1;
+}
+
+void reader_init_memory(JobReader *reader, const char *data, size_t len)
+{
+  reader->fd = -1;
+  reader->data = data;
+  reader->pos = 0;
+  reader->len = len;
+  reader->mapped = 0;
+  reader->in_memory = 1;
+}
+
+void reader_close(JobReader *reader)
+{
+  if (reader->mapped)
+  {
+    munmap((void *)reader->data, reader->len);
+    reader->mapped = 0;
+  }
+  reader->data = reader->buffer;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->in_memory = 0;
+}
+
+// Volta a encher o buffer com um único read() do ficheiro.
+// @return Número de bytes disponíveis, 0 no fim do ficheiro ou em caso de erro.
+static size_t reader_refill(JobReader *reader)
 {
+  if (reader->mapped || reader->in_memory)
+  {
+    return 0; // O mapeamento (ou o buffer de quem chamou) já tem tudo
+  }
+
   ssize_t bytes_read;
-  char ch;
+  do
+  {
+    bytes_read = read(reader->fd, reader->buffer, READER_BUFFER_SIZE);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  reader->pos = 0;
+  reader->len = bytes_read > 0 ? (size_t)bytes_read : 0;
+  return reader->len;
+}
+
+// Equivalente a read(fd, buf, count), mas servido a partir do buffer do ficheiro.
+// @return Número de bytes copiados (menos de count só no fim do ficheiro).
+static size_t reader_read(JobReader *reader, char *buf, size_t count)
+{
+  size_t copied = 0;
+  while (copied < count)
+  {
+    if (reader->pos == reader->len && reader_refill(reader) == 0)
+    {
+      break;
+    }
+    size_t chunk = reader->len - reader->pos;
+    if (chunk > count - copied)
+    {
+      chunk = count - copied;
+    }
+    memcpy(buf + copied, reader->data + reader->pos, chunk);
+    reader->pos += chunk;
+    copied += chunk;
+  }
+  return copied;
+}
+
+// Devolve o índice do primeiro delimitador de uma string (' ', ',', ')' ou ']') entre os
+// primeiros n bytes de data, ou n se não houver nenhum. Com SSE2 compara 16 bytes de cada vez.
+static size_t scan_delimiters(const char *data, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i comma = _mm_set1_epi8(',');
+  const __m128i close_paren = _mm_set1_epi8(')');
+  const __m128i close_bracket = _mm_set1_epi8(']');
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, comma)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(chunk, close_paren), _mm_cmpeq_epi8(chunk, close_bracket)));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(found);
+    if (mask != 0)
+    {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < n; i++)
+  {
+    char ch = data[i];
+    if (ch == ' ' || ch == ',' || ch == ')' || ch == ']')
+    {
+      return i;
+    }
+  }
+  return n;
+}
+
+static int read_string(JobReader *reader, char *buffer, size_t max)
+{
   size_t i = 0;
   int value = -1;
 
-  while (i < max)
+  // Só guardamos max - 1 caracteres (o buffer tem max bytes, com o '\0'), mas lemos sempre
+  // mais um: o delimitador de uma string com max - 1 caracteres
+  while (1)
   {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0)
+    if (reader->pos == reader->len && reader_refill(reader) == 0)
     {
       return -1;
     }
 
+    // Copiamos de uma vez tudo o que está antes do próximo delimitador
+    size_t room = max - 1 - i;
+    size_t available = reader->len - reader->pos;
+    if (available > room + 1)
+    {
+      available = room + 1;
+    }
+    size_t length = scan_delimiters(reader->data + reader->pos, available);
+    if (length > room)
+    {
+      return -1; // A string não cabe no buffer
+    }
+    memcpy(buffer + i, reader->data + reader->pos, length);
+    i += length;
+    reader->pos += length;
+    if (length == available)
+    {
+      continue;
+    }
+
+    char ch = reader->data[reader->pos++];
     if (ch == ' ')
     {
       return -1;
@@ -33,20 +185,16 @@ static int read_string(int fd, char *buffer, size_t max)
     if (ch == ',')
     {
       value = 0;
-      break;
     }
     else if (ch == ')')
     {
       value = 1;
-      break;
     }
-    else if (ch == ']')
+    else
     {
       value = 2;
-      break;
     }
-
-    buffer[i++] = ch;
+    break;
   }
 
   buffer[i] = '\0';
@@ -54,14 +202,14 @@ static int read_string(int fd, char *buffer, size_t max)
   return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next)
+static int read_uint(JobReader *reader, unsigned int *value, char *next)
 {
   char buf[16];
 
   int i = 0;
   while (1)
   {
-    if (read(fd, buf + i, 1) == 0)
+    if (reader_read(reader, buf + i, 1) == 0)
     {
       *next = '\0';
       break;
@@ -90,24 +238,31 @@ static int read_uint(int fd, unsigned int *value, char *next)
   return 0;
 }
 
-static void cleanup(int fd)
+static void cleanup(JobReader *reader)
 {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+  while (reader->pos < reader->len || reader_refill(reader) > 0)
+  {
+    const char *newline = memchr(reader->data + reader->pos, '\n', reader->len - reader->pos);
+    if (newline != NULL)
+    {
+      reader->pos = (size_t)(newline - reader->data) + 1;
+      return;
+    }
+    reader->pos = reader->len;
+  }
 }
 
+// Só fecha os ficheiros: consumir o resto do input aqui (num processo filho de um backup, por
+// exemplo) avançava o offset que o ficheiro partilha com o processo pai.
 void cleanFds(int fd1, int fd2){
-  cleanup(fd1);
-  cleanup(fd2);
   close(fd1);
   close(fd2);
 }
 
-enum Command get_next(int fd)
+enum Command get_next(JobReader *reader)
 {
   char buf[16];
-  if (read(fd, buf, 1) != 1)
+  if (reader_read(reader, buf, 1) != 1)
   {
     return EOC;
   }
@@ -115,11 +270,11 @@ enum Command get_next(int fd)
   switch (buf[0])
   {
   case 'W':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0)
+    if (reader_read(reader, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0)
     {
-      if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0)
+      if (reader_read(reader, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0)
       {
-        cleanup(fd);
+        cleanup(reader);
         return CMD_INVALID;
       }
       return CMD_WRITE;
@@ -128,131 +283,170 @@ enum Command get_next(int fd)
     return CMD_WAIT;
 
   case 'R':
-    if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0)
+    if (reader_read(reader, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_READ;
 
   case 'D':
-    if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0)
+    if (reader_read(reader, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_DELETE;
 
   case 'S':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0)
+    if (reader_read(reader, buf + 1, 3) != 3)
+    {
+      cleanup(reader);
+      return CMD_INVALID;
+    }
+
+    if (strncmp(buf, "SCAN", 4) == 0)
+    {
+      // No fim do ficheiro buf[4] não foi lido e não há linha para saltar
+      size_t got = reader_read(reader, buf + 4, 1);
+      if (got != 1 || buf[4] != ' ')
+      {
+        if (got == 1 && buf[4] != '\n')
+        {
+          cleanup(reader);
+        }
+        return CMD_INVALID;
+      }
+      return CMD_SCAN;
+    }
+
+    if (strncmp(buf, "STAT", 4) == 0)
+    {
+      // No fim do ficheiro buf[4] não foi lido e não há linha para saltar
+      size_t got = reader_read(reader, buf + 4, 1);
+      if (got != 1 || buf[4] != 'S')
+      {
+        if (got == 1 && buf[4] != '\n')
+        {
+          cleanup(reader);
+        }
+        return CMD_INVALID;
+      }
+      if (reader_read(reader, buf + 5, 1) != 0 && buf[5] != '\n')
+      {
+        cleanup(reader);
+        return CMD_INVALID;
+      }
+      return CMD_STATS;
+    }
+
+    if (strncmp(buf, "SHOW", 4) != 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n')
+    if (reader_read(reader, buf + 4, 1) != 0 && buf[4] != '\n')
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_SHOW;
 
   case 'B':
-    if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0)
+    if (reader_read(reader, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n')
+    if (reader_read(reader, buf + 6, 1) != 0 && buf[6] != '\n')
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_BACKUP;
 
   case 'H':
-    if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0)
+    if (reader_read(reader, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
-    if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n')
+    if (reader_read(reader, buf + 4, 1) != 0 && buf[4] != '\n')
     {
-      cleanup(fd);
+      cleanup(reader);
       return CMD_INVALID;
     }
 
     return CMD_HELP;
 
   case '#':
-    cleanup(fd);
+    cleanup(reader);
     return CMD_EMPTY;
 
   case '\n':
     return CMD_EMPTY;
 
   default:
-    cleanup(fd);
+    cleanup(reader);
     return CMD_INVALID;
   }
 }
 
-int parse_pair(int fd, char *key, char *value)
+int parse_pair(JobReader *reader, char *key, char *value)
 {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0)
+  if (read_string(reader, key, MAX_STRING_SIZE) != 0)
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1)
+  if (read_string(reader, value, MAX_STRING_SIZE) != 1)
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
   return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size)
+size_t parse_write(JobReader *reader, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size)
 {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[')
+  if (reader_read(reader, &ch, 1) != 1 || ch != '[')
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(')
+  if (reader_read(reader, &ch, 1) != 1 || ch != '(')
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
   size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
+  (void)max_string_size; // Os arrays de destino têm MAX_STRING_SIZE bytes por string
   while (num_pairs < max_pairs)
   {
-    if (parse_pair(fd, key, value) == 0)
+    // O par é lido diretamente para os arrays de destino, sem cópias intermédias
+    if (parse_pair(reader, keys[num_pairs], values[num_pairs]) == 0)
     {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
+    num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']'))
+    if (reader_read(reader, &ch, 1) != 1 || (ch != '(' && ch != ']'))
     {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
@@ -264,41 +458,39 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 
   if (num_pairs == max_pairs)
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0'))
+  if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0'))
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
   return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size)
+size_t parse_read_delete(JobReader *reader, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size)
 {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[')
+  if (reader_read(reader, &ch, 1) != 1 || ch != '[')
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
   size_t num_keys = 0;
-  char key[max_string_size];
   while (num_keys < max_keys)
   {
-    int output = read_string(fd, key, max_string_size);
+    int output = read_string(reader, keys[num_keys], max_string_size);
     if (output < 0 || output == 1)
     {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
-
-    strcpy(keys[num_keys++], key);
+    num_keys++;
 
     if (output == 2)
     {
@@ -308,35 +500,108 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 
   if (num_keys == max_keys)
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0'))
+  if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0'))
   {
-    cleanup(fd);
+    cleanup(reader);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_scan(JobReader *reader, char *prefix, size_t max_string_size)
+{
+  char ch;
+
+  if (reader_read(reader, &ch, 1) != 1 || ch != '[')
+  {
+    cleanup(reader);
+    return 1;
+  }
+
+  // O prefixo tem de ser o único elemento da lista
+  if (read_string(reader, prefix, max_string_size) != 2)
+  {
+    cleanup(reader);
+    return 1;
+  }
+
+  if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0'))
+  {
+    cleanup(reader);
+    return 1;
+  }
+
+  return 0;
+}
+
+enum BackupLine parse_backup_line(JobReader *reader, char *key, char *value, size_t max_string_size, unsigned int *base)
+{
+  char ch;
+
+  if (reader_read(reader, &ch, 1) != 1)
+  {
+    return BACKUP_END;
+  }
+
+  if (ch == 'D')
+  {
+    // Cabeçalho de um delta: "DELTA <backup base>"
+    char buf[5];
+    if (reader_read(reader, buf, 5) != 5 || strncmp(buf, "ELTA ", 5) != 0 ||
+        read_uint(reader, base, &ch) != 0 || ch != '\n')
+    {
+      return BACKUP_INVALID;
+    }
+    return BACKUP_DELTA;
+  }
+
+  if (ch != '(')
+  {
+    return BACKUP_INVALID;
+  }
+
+  int delimiter = read_string(reader, key, max_string_size);
+  if (delimiter == 1)
+  {
+    // "(key)": a chave foi apagada
+    if (reader_read(reader, &ch, 1) != 1 || ch != '\n')
+    {
+      return BACKUP_INVALID;
+    }
+    return BACKUP_TOMBSTONE;
+  }
+
+  // "(key, value)"
+  if (delimiter != 0 || reader_read(reader, &ch, 1) != 1 || ch != ' ' ||
+      read_string(reader, value, max_string_size) != 1 ||
+      reader_read(reader, &ch, 1) != 1 || ch != '\n')
+  {
+    return BACKUP_INVALID;
+  }
+  return BACKUP_PAIR;
+}
+
+int parse_wait(JobReader *reader, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(reader, delay, &ch) != 0) {
+    cleanup(reader);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(reader);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(reader);
       return -1;
     }
 
@@ -344,7 +609,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(reader);
     return -1;
   }
 }
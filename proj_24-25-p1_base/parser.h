@@ -6,11 +6,38 @@
 #include <pthread.h>
 
 
+// Tamanho do buffer de leitura de cada ficheiro .job
+#define READER_BUFFER_SIZE (64 * 1024)
+
+// Leitor de um ficheiro .job. Um ficheiro regular é mapeado inteiro em memória (mmap) e o
+// parser lê diretamente do mapeamento; caso contrário o parser lê do buffer, que é enchido
+// com um read() de READER_BUFFER_SIZE bytes de cada vez. Também pode ler comandos que já estão
+// em memória (os pedidos de um cliente do servidor, por exemplo).
+typedef struct JobReader {
+  int fd;
+  const char *data; // Mapeamento do ficheiro ou buffer
+  size_t pos;       // Próximo byte de data a ler
+  size_t len;       // Bytes válidos em data
+  int mapped;
+  int in_memory;    // data é um buffer de quem chamou reader_init_memory, sem ficheiro
+  char buffer[READER_BUFFER_SIZE];
+} JobReader;
+
+enum BackupLine {
+  BACKUP_PAIR,
+  BACKUP_TOMBSTONE,
+  BACKUP_DELTA,
+  BACKUP_END,
+  BACKUP_INVALID
+};
+
 enum Command {
   CMD_WRITE,
   CMD_READ,
   CMD_DELETE,
   CMD_SHOW,
+  CMD_SCAN,
+  CMD_STATS,
   CMD_WAIT,
   CMD_BACKUP,
   CMD_HELP,
@@ -19,34 +46,67 @@ enum Command {
   EOC  // End of commands
 };
 
-/// Reads a line and returns the corresponding command.
+/// Initializes the buffered reader of a job file.
+/// @param reader Reader to initialize.
 /// @param fd File descriptor to read from.
+void reader_init(JobReader *reader, int fd);
+
+/// Initializes a reader over commands that are already in memory. The reader doesn't copy
+/// them, so data must stay valid while it is used.
+/// @param reader Reader to initialize.
+/// @param data Commands to parse.
+/// @param len Number of bytes.
+void reader_init_memory(JobReader *reader, const char *data, size_t len);
+
+/// Releases the mapping of a job file (the file descriptor is closed by cleanFds).
+/// @param reader Reader to release.
+void reader_close(JobReader *reader);
+
+/// Reads a line and returns the corresponding command.
+/// @param reader Buffered reader of the job file.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(JobReader *reader);
 
 /// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// @param reader Buffered reader of the job file.
 /// @param keys Array of keys to be written.
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(JobReader *reader, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
 /// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
+/// @param reader Buffered reader of the job file.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(JobReader *reader, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+
+/// Parses a SCAN command.
+/// @param reader Buffered reader of the job file.
+/// @param prefix Buffer to store the prefix in (may be empty).
+/// @param max_string_size maximum size for the prefix.
+/// @return 0 if the command was parsed successfully, 1 otherwise.
+int parse_scan(JobReader *reader, char *prefix, size_t max_string_size);
+
+/// Parses one line of a backup file: "(key, value)" for a pair, "(key)" for a deleted key
+/// and "DELTA <n>" as the first line of a delta backup.
+/// @param reader Buffered reader of the backup file.
+/// @param key Buffer to store the key in.
+/// @param value Buffer to store the value in (only for BACKUP_PAIR).
+/// @param max_string_size maximum size for keys and values.
+/// @param base Number of the backup the delta is based on (only for BACKUP_DELTA).
+/// @return Type of the line, BACKUP_END at the end of the file.
+enum BackupLine parse_backup_line(JobReader *reader, char *key, char *value, size_t max_string_size, unsigned int *base);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param reader Buffered reader of the job file.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(JobReader *reader, unsigned int *delay, unsigned int *thread_id);
 int outputFile(const char *nomeFicheiro);
 
 void perform_backup(const char *fileName, pthread_mutex_t *backup_mutex);
@@ -0,0 +1,297 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Worker que está a correr nesta thread (NULL fora da pool)
+static _Thread_local WorkerInfo *current_worker = NULL;
+
+static void *run_timers(void *arg);
+
+static int deque_init(TaskDeque *deque) {
+  deque->tasks = malloc(POOL_DEQUE_CAPACITY * sizeof(Task));
+  if (deque->tasks == NULL) return 1;
+  deque->head = 0;
+  deque->count = 0;
+  deque->capacity = POOL_DEQUE_CAPACITY;
+  pthread_mutex_init(&deque->mutex, NULL);
+  return 0;
+}
+
+static int deque_push(TaskDeque *deque, Task task) {
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count == deque->capacity) {
+    // Copiamos o buffer circular para o início de um buffer com o dobro do tamanho
+    Task *tasks = malloc(2 * deque->capacity * sizeof(Task));
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&deque->mutex);
+      return 1;
+    }
+    size_t first = deque->capacity - deque->head;
+    memcpy(tasks, deque->tasks + deque->head, first * sizeof(Task));
+    memcpy(tasks + first, deque->tasks, deque->head * sizeof(Task));
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->capacity *= 2;
+  }
+  deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->mutex);
+  return 0;
+}
+
+// Tira uma tarefa do fim (o dono) ou do início (um ladrão).
+static int deque_take(TaskDeque *deque, int steal, Task *task) {
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->count == 0) {
+    pthread_mutex_unlock(&deque->mutex);
+    return 0;
+  }
+  if (steal) {
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+  } else {
+    *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+  }
+  deque->count--;
+  pthread_mutex_unlock(&deque->mutex);
+  return 1;
+}
+
+// Procura uma tarefa: primeiro na própria deque, depois nas dos outros workers.
+static int find_task(WorkerInfo *worker, Task *task) {
+  ThreadPool *pool = worker->pool;
+  if (deque_take(&pool->deques[worker->index], 0, task)) return 1;
+  for (size_t i = 1; i < pool->num_workers; i++) {
+    if (deque_take(&pool->deques[(worker->index + i) % pool->num_workers], 1, task)) return 1;
+  }
+  return 0;
+}
+
+static void *run_worker(void *arg) {
+  WorkerInfo *worker = arg;
+  ThreadPool *pool = worker->pool;
+  current_worker = worker;
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (pool->queued == 0 && !pool->stop) {
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    }
+    if (pool->queued == 0) break; // A pool vai parar e já não há tarefas
+    pthread_mutex_unlock(&pool->mutex);
+
+    Task task;
+    int found = find_task(worker, &task);
+    pthread_mutex_lock(&pool->mutex);
+    if (!found) continue; // Outro worker ficou com ela
+    pool->queued--;
+    pthread_mutex_unlock(&pool->mutex);
+
+    task.run(task.arg);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0) {
+      pthread_cond_broadcast(&pool->idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+// Liberta a pool depois de os workers terem parado.
+static void free_pool(ThreadPool *pool, size_t num_deques) {
+  for (size_t i = 0; i < num_deques; i++) {
+    pthread_mutex_destroy(&pool->deques[i].mutex);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->timer);
+  free(pool->timers);
+  free(pool->deques);
+  free(pool->workers);
+  free(pool);
+}
+
+// Para os workers que já estão a correr (e a tarefa dos temporizadores) e espera que terminem.
+static void stop_workers(ThreadPool *pool, size_t num_started) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_cond_signal(&pool->timer);
+  pthread_mutex_unlock(&pool->mutex);
+  pthread_join(pool->timer_thread, NULL);
+  for (size_t i = 0; i < num_started; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+}
+
+ThreadPool *pool_create(size_t num_workers) {
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  if (pool == NULL) return NULL;
+  pool->num_workers = num_workers;
+  pool->deques = calloc(num_workers, sizeof(TaskDeque));
+  pool->workers = calloc(num_workers, sizeof(WorkerInfo));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  // Os prazos das tarefas adiadas não mudam se o relógio do sistema for acertado
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool->timer, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pool->deques == NULL || pool->workers == NULL) {
+    free_pool(pool, 0);
+    return NULL;
+  }
+
+  // Os workers só são lançados depois de todas as deques existirem, porque roubam de todas
+  for (size_t i = 0; i < num_workers; i++) {
+    if (deque_init(&pool->deques[i]) != 0) {
+      free_pool(pool, i);
+      return NULL;
+    }
+  }
+  if (pthread_create(&pool->timer_thread, NULL, run_timers, pool) != 0) {
+    free_pool(pool, num_workers);
+    return NULL;
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    pool->workers[i] = (WorkerInfo){.pool = pool, .index = i};
+    if (pthread_create(&pool->workers[i].thread, NULL, run_worker, &pool->workers[i]) != 0) {
+      stop_workers(pool, i);
+      free_pool(pool, num_workers);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+// Põe uma tarefa numa deque e acorda um worker. Os workers põem-na na sua deque.
+static int enqueue(ThreadPool *pool, Task task, int new_task) {
+  pthread_mutex_lock(&pool->mutex);
+  size_t index;
+  if (current_worker != NULL && current_worker->pool == pool) {
+    index = current_worker->index;
+  } else {
+    index = pool->next;
+    pool->next = (pool->next + 1) % pool->num_workers;
+  }
+
+  // A tarefa entra na deque e é contada sob o mesmo lock: um worker pode tirá-la da deque
+  // logo a seguir, mas só a desconta de queued (e de pending) depois de o lock ser largado
+  if (deque_push(&pool->deques[index], task) != 0) {
+    pthread_mutex_unlock(&pool->mutex);
+    return 1;
+  }
+  pool->queued++;
+  if (new_task) pool->pending++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int pool_submit(ThreadPool *pool, TaskFunction run, void *arg) {
+  return enqueue(pool, (Task){.run = run, .arg = arg}, 1);
+}
+
+static int timer_before(const TimedTask *a, const TimedTask *b) {
+  return a->deadline.tv_sec < b->deadline.tv_sec ||
+         (a->deadline.tv_sec == b->deadline.tv_sec && a->deadline.tv_nsec < b->deadline.tv_nsec);
+}
+
+// Tira a primeira tarefa do heap. Chamada com pool->mutex.
+static TimedTask pop_timer(ThreadPool *pool) {
+  TimedTask first = pool->timers[0];
+  TimedTask last = pool->timers[--pool->num_timers];
+  size_t i = 0;
+  while (2 * i + 1 < pool->num_timers) {
+    size_t child = 2 * i + 1;
+    if (child + 1 < pool->num_timers && timer_before(&pool->timers[child + 1], &pool->timers[child])) child++;
+    if (!timer_before(&pool->timers[child], &last)) break;
+    pool->timers[i] = pool->timers[child];
+    i = child;
+  }
+  pool->timers[i] = last;
+  return first;
+}
+
+int pool_submit_after(ThreadPool *pool, unsigned int delay_ms, TaskFunction run, void *arg) {
+  TimedTask timed = {.task = {.run = run, .arg = arg}};
+  clock_gettime(CLOCK_MONOTONIC, &timed.deadline);
+  timed.deadline.tv_sec += delay_ms / 1000;
+  timed.deadline.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+  if (timed.deadline.tv_nsec >= 1000000000) {
+    timed.deadline.tv_sec++;
+    timed.deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->num_timers == pool->timers_capacity) {
+    size_t capacity = pool->timers_capacity == 0 ? POOL_DEQUE_CAPACITY : 2 * pool->timers_capacity;
+    TimedTask *timers = realloc(pool->timers, capacity * sizeof(TimedTask));
+    if (timers == NULL) {
+      pthread_mutex_unlock(&pool->mutex);
+      return 1;
+    }
+    pool->timers = timers;
+    pool->timers_capacity = capacity;
+  }
+  size_t i = pool->num_timers++;
+  while (i > 0 && timer_before(&timed, &pool->timers[(i - 1) / 2])) {
+    pool->timers[i] = pool->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  pool->timers[i] = timed;
+  pool->pending++;
+  if (i == 0) pthread_cond_signal(&pool->timer);
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+// Tarefa dos temporizadores: passa as tarefas adiadas para as deques quando chega o prazo.
+static void *run_timers(void *arg) {
+  ThreadPool *pool = arg;
+  pthread_mutex_lock(&pool->mutex);
+  while (!pool->stop) {
+    if (pool->num_timers == 0) {
+      pthread_cond_wait(&pool->timer, &pool->mutex);
+      continue;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    TimedTask now_task = {.deadline = now};
+    if (timer_before(&now_task, &pool->timers[0])) {
+      pthread_cond_timedwait(&pool->timer, &pool->mutex, &pool->timers[0].deadline);
+      continue;
+    }
+    TimedTask timed = pop_timer(pool);
+    pthread_mutex_unlock(&pool->mutex);
+    if (enqueue(pool, timed.task, 0) != 0) {
+      timed.task.run(timed.task.arg); // Sem memória para a deque corremo-la aqui
+      pthread_mutex_lock(&pool->mutex);
+      if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+      pthread_mutex_unlock(&pool->mutex);
+    }
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+void pool_wait(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->idle, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(ThreadPool *pool) {
+  pool_wait(pool);
+  stop_workers(pool, pool->num_workers);
+  free_pool(pool, pool->num_workers);
+}
@@ -0,0 +1,93 @@
+#ifndef KVS_POOL_H
+#define KVS_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Pool de tarefas com roubo de trabalho (work stealing). Cada worker tem a sua deque de
+ tarefas: tira as suas do fim (a última que lá pôs, ainda quente na cache) e, quando fica
+ sem nenhuma, rouba do início da deque de outro worker. As tarefas submetidas de fora da
+ pool (pela main) são distribuídas pelas deques à vez. Uma tarefa também pode ser adiada
+ (pool_submit_after): fica num heap de temporizadores até ao seu prazo e só então é posta numa
+ deque pela tarefa dos temporizadores, sem ocupar nenhum worker entretanto. */
+
+// Capacidade inicial de cada deque (cresce quando enche)
+#define POOL_DEQUE_CAPACITY 64
+
+typedef void (*TaskFunction)(void *arg);
+
+typedef struct Task {
+  TaskFunction run;
+  void *arg;
+} Task;
+
+// Tarefa adiada, no heap de temporizadores da pool
+typedef struct TimedTask {
+  struct timespec deadline; // CLOCK_MONOTONIC
+  Task task;
+} TimedTask;
+
+typedef struct TaskDeque {
+  pthread_mutex_t mutex;
+  Task *tasks;  // Buffer circular
+  size_t head;  // Primeira tarefa (onde se rouba)
+  size_t count;
+  size_t capacity;
+} TaskDeque;
+
+typedef struct WorkerInfo {
+  struct ThreadPool *pool;
+  size_t index;
+  pthread_t thread;
+} WorkerInfo;
+
+typedef struct ThreadPool {
+  size_t num_workers;
+  TaskDeque *deques;   // Uma por worker
+  WorkerInfo *workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t work; // Sinalizada quando há tarefas novas (ou a pool vai parar)
+  pthread_cond_t idle; // Sinalizada quando deixa de haver tarefas por acabar
+  size_t queued;       // Tarefas nas deques
+  size_t pending;      // Tarefas submetidas e ainda não acabadas
+  size_t next;         // Próxima deque a receber uma tarefa de fora da pool
+  int stop;
+  TimedTask *timers;   // Heap de tarefas adiadas, a do prazo mais próximo primeiro
+  size_t num_timers, timers_capacity;
+  pthread_cond_t timer; // Sinalizada quando muda a primeira tarefa adiada (ou a pool vai parar)
+  pthread_t timer_thread;
+} ThreadPool;
+
+/// Creates a pool and starts its workers.
+/// @param num_workers Number of worker threads.
+/// @return The pool, NULL on failure.
+ThreadPool *pool_create(size_t num_workers);
+
+/// Submits a task. A task submitted by a worker goes to its own deque; otherwise the
+/// deques take turns.
+/// @param pool The pool.
+/// @param run Function to run.
+/// @param arg Argument passed to run.
+/// @return 0 if the task was submitted, 1 otherwise.
+int pool_submit(ThreadPool *pool, TaskFunction run, void *arg);
+
+/// Submits a task that only becomes runnable after a delay. No worker is used while the
+/// task waits.
+/// @param pool The pool.
+/// @param delay_ms Delay in milliseconds.
+/// @param run Function to run.
+/// @param arg Argument passed to run.
+/// @return 0 if the task was submitted, 1 otherwise.
+int pool_submit_after(ThreadPool *pool, unsigned int delay_ms, TaskFunction run, void *arg);
+
+/// Waits until every submitted task (including tasks submitted by tasks and delayed tasks)
+/// has finished.
+/// @param pool The pool.
+void pool_wait(ThreadPool *pool);
+
+/// Waits for every task, stops the workers and frees the pool.
+/// @param pool The pool.
+void pool_destroy(ThreadPool *pool);
+
+#endif  // KVS_POOL_H
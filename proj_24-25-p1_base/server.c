@@ -0,0 +1,362 @@
+// accept4 é uma extensão do Linux, como o epoll e o signalfd
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Caminho absoluto do socket, para o apagarmos no fim (o servidor muda de diretoria)
+static char socket_path[PATH_MAX];
+// Clientes ligados
+static Connection *clients = NULL;
+// Marcas dos sockets que não são clientes, em epoll_event.data.ptr
+static int listen_marker, signal_marker;
+
+static void signal_set(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGTERM);
+}
+
+int server_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    write(STDERR_FILENO, "Socket path too long\n", strlen("Socket path too long\n"));
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (path[0] == '/') {
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+  } else {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL ||
+        snprintf(socket_path, sizeof(socket_path), "%s/%s", cwd, path) >= (int)sizeof(socket_path)) {
+      perror("Couldn't resolve socket path");
+      return -1;
+    }
+  }
+
+  // Um socket que ficou de um servidor anterior impedia o bind. Só o apagamos se ninguém
+  // o estiver a usar: um servidor ainda a correr aceita a ligação
+  struct stat fileStat;
+  if (stat(path, &fileStat) == 0 && S_ISSOCK(fileStat.st_mode)) {
+    int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probeFd == -1) {
+      perror("Couldn't create socket");
+      return -1;
+    }
+    int connected = connect(probeFd, (struct sockaddr *)&addr, sizeof(addr));
+    int connectErrno = errno;
+    close(probeFd);
+    if (connected == 0) {
+      write(STDERR_FILENO, "Socket already in use by another server\n",
+            strlen("Socket already in use by another server\n"));
+      return -1;
+    }
+    if (connectErrno == ECONNREFUSED) {
+      unlink(path);
+    }
+  }
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenFd == -1) {
+    perror("Couldn't create socket");
+    return -1;
+  }
+  if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenFd, SOMAXCONN) == -1) {
+    perror("Couldn't listen on socket");
+    close(listenFd);
+    return -1;
+  }
+
+  // Os sinais de paragem são lidos pelo ciclo de eventos (signalfd), por isso nenhuma tarefa
+  // os pode receber
+  sigset_t set;
+  signal_set(&set);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  return listenFd;
+}
+
+// Garante espaço para mais len bytes num buffer que cresce.
+static int reserve(char **buffer, size_t *capacity, size_t used, size_t len) {
+  if (*capacity - used >= len) return 0;
+  size_t newCapacity = *capacity == 0 ? 4096 : *capacity;
+  while (newCapacity - used < len) newCapacity *= 2;
+  char *newBuffer = realloc(*buffer, newCapacity);
+  if (newBuffer == NULL) return 1;
+  *buffer = newBuffer;
+  *capacity = newCapacity;
+  return 0;
+}
+
+// Recebe o output dos comandos de um cliente (o sink do seu OutputBuffer).
+static void append_output(void *arg, const char *data, size_t len) {
+  Connection *conn = arg;
+  if (reserve(&conn->output, &conn->output_capacity, conn->output_len, len) != 0) {
+    conn->failed = 1;
+    return;
+  }
+  memcpy(conn->output + conn->output_len, data, len);
+  conn->output_len += len;
+}
+
+static void update_events(int epollFd, Connection *conn) {
+  uint32_t events = 0;
+  if (!conn->closed && conn->input_len < SERVER_MAX_PENDING) events |= EPOLLIN;
+  if (conn->output_sent < conn->output_len) events |= EPOLLOUT;
+  if (events != conn->events) {
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->socket, &event);
+    conn->events = events;
+  }
+}
+
+static void send_output(Connection *conn) {
+  while (conn->output_sent < conn->output_len) {
+    ssize_t sent = send(conn->socket, conn->output + conn->output_sent,
+                        conn->output_len - conn->output_sent, MSG_NOSIGNAL);
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) conn->failed = 1;
+      break;
+    }
+    conn->output_sent += (size_t)sent;
+  }
+  if (conn->output_sent == conn->output_len) {
+    conn->output_sent = 0;
+    conn->output_len = 0;
+  }
+}
+
+static void suspend(Connection *conn, unsigned int delay_ms, Connection **suspended) {
+  clock_gettime(CLOCK_MONOTONIC, &conn->resume);
+  conn->resume.tv_sec += delay_ms / 1000;
+  conn->resume.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+  if (conn->resume.tv_nsec >= 1000000000) {
+    conn->resume.tv_sec++;
+    conn->resume.tv_nsec -= 1000000000;
+  }
+  conn->suspended = 1;
+  conn->next_suspended = *suspended;
+  *suspended = conn;
+}
+
+// Corre as linhas completas que o cliente já enviou, até um WAIT ou até haver demasiado
+// output por enviar.
+static void run_commands(Connection *conn, Connection **suspended) {
+  size_t consumed = 0;
+  while (!conn->suspended && !conn->failed && conn->output_len - conn->output_sent < SERVER_MAX_PENDING) {
+    // Um WAIT de outro cliente (ou ficheiro) para este atrasa o próximo comando
+    unsigned int delay = atomic_exchange(&conn->job.delay, 0);
+    if (delay > 0) {
+      suspend(conn, delay, suspended);
+      break;
+    }
+    char *line = conn->input + consumed;
+    char *end = memchr(line, '\n', conn->input_len - consumed);
+    if (end == NULL) break;
+    size_t lineLen = (size_t)(end - line) + 1;
+    consumed += lineLen;
+
+    JobCommand command;
+    reader_init_memory(&conn->job.reader, line, lineLen);
+    enum Command type = job_parse_command(&conn->job.reader, &command);
+    if (type == CMD_EMPTY || type == EOC) continue;
+    delay = job_run_command(&command, &conn->job, &conn->job.out);
+    output_write(&conn->job.out, "OK\n", 3);
+    if (delay > 0) {
+      suspend(conn, delay, suspended);
+    }
+  }
+  output_flush(&conn->job.out);
+
+  conn->input_len -= consumed;
+  memmove(conn->input, conn->input + consumed, conn->input_len);
+  // Uma linha que não cabe em SERVER_MAX_PENDING nunca vai ser um comando válido
+  if (conn->input_len >= SERVER_MAX_PENDING && memchr(conn->input, '\n', conn->input_len) == NULL) {
+    conn->failed = 1;
+  }
+}
+
+static void receive_input(Connection *conn) {
+  while (conn->input_len < SERVER_MAX_PENDING) {
+    if (reserve(&conn->input, &conn->input_capacity, conn->input_len, SERVER_READ_SIZE) != 0) {
+      conn->failed = 1;
+      return;
+    }
+    ssize_t received = recv(conn->socket, conn->input + conn->input_len, SERVER_READ_SIZE, 0);
+    if (received == 0) {
+      conn->closed = 1;
+      return;
+    }
+    if (received == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) conn->failed = 1;
+      return;
+    }
+    conn->input_len += (size_t)received;
+  }
+}
+
+static void accept_clients(int epollFd, int listenFd, int max_backups) {
+  while (1) {
+    int socketFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (socketFd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Couldn't accept client");
+      return;
+    }
+
+    Connection *conn = calloc(1, sizeof(Connection));
+    if (conn == NULL || job_register(&conn->job) != 0) {
+      free(conn);
+      close(socketFd);
+      continue;
+    }
+    conn->socket = socketFd;
+    conn->job.input = -1;
+    conn->job.output = -1;
+    conn->job.max_backups = max_backups;
+    snprintf(conn->job.fileName, sizeof(conn->job.fileName), "client-%u.job", conn->job.id);
+    output_init_sink(&conn->job.out, append_output, conn);
+
+    conn->events = EPOLLIN;
+    struct epoll_event event = {.events = conn->events, .data.ptr = conn};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, socketFd, &event) == -1) {
+      job_unregister(&conn->job);
+      close(socketFd);
+      free(conn);
+      continue;
+    }
+    conn->next = clients;
+    if (clients != NULL) clients->prev = conn;
+    clients = conn;
+  }
+}
+
+static void close_connection(Connection *conn, Connection **suspended) {
+  for (Connection **prev = suspended; *prev != NULL; prev = &(*prev)->next_suspended) {
+    if (*prev == conn) {
+      *prev = conn->next_suspended;
+      break;
+    }
+  }
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    clients = conn->next;
+  }
+  if (conn->next != NULL) conn->next->prev = conn->prev;
+  kvs_backup_done(&conn->job.backup);
+  job_unregister(&conn->job);
+  close(conn->socket); // Também o tira do epoll
+  free(conn->input);
+  free(conn->output);
+  free(conn);
+}
+
+// Trata de um cliente depois de um evento ou do fim de um WAIT. Devolve 1 se foi desligado.
+static int serve(int epollFd, Connection *conn, Connection **suspended) {
+  if (!conn->suspended) run_commands(conn, suspended);
+  send_output(conn);
+  // Depois de o cliente fechar, só esperamos pelo fim dos seus comandos e respostas
+  if (conn->failed || conn->hangup || (conn->closed && !conn->suspended && conn->output_len == 0 &&
+                       memchr(conn->input, '\n', conn->input_len) == NULL)) {
+    close_connection(conn, suspended);
+    return 1;
+  }
+  update_events(epollFd, conn);
+  return 0;
+}
+
+// Retoma os clientes cujo WAIT acabou e devolve o timeout até ao próximo (-1 se nenhum).
+static int resume_clients(int epollFd, Connection **suspended) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long timeout = -1;
+  Connection **prev = suspended;
+  while (*prev != NULL) {
+    Connection *conn = *prev;
+    long left = (conn->resume.tv_sec - now.tv_sec) * 1000 + (conn->resume.tv_nsec - now.tv_nsec + 999999) / 1000000;
+    if (left > 0) {
+      if (timeout == -1 || left < timeout) timeout = left;
+      prev = &conn->next_suspended;
+      continue;
+    }
+    *prev = conn->next_suspended;
+    conn->suspended = 0;
+    serve(epollFd, conn, suspended);
+    // serve pode ter voltado a suspender o cliente, à cabeça da lista: recomeçamos
+    prev = suspended;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout = -1;
+  }
+  return timeout > INT_MAX ? INT_MAX : (int)timeout;
+}
+
+int server_run(int listenFd, int max_backups) {
+  sigset_t set;
+  signal_set(&set);
+  int signalFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event listenEvent = {.events = EPOLLIN, .data.ptr = &listen_marker};
+  struct epoll_event signalEvent = {.events = EPOLLIN, .data.ptr = &signal_marker};
+  if (signalFd == -1 || epollFd == -1 ||
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent) == -1 ||
+      epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &signalEvent) == -1) {
+    perror("Couldn't start server");
+    if (signalFd != -1) close(signalFd);
+    if (epollFd != -1) close(epollFd);
+    close(listenFd);
+    unlink(socket_path);
+    return 1;
+  }
+
+  Connection *suspended = NULL;
+  int stop = 0;
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  while (!stop) {
+    int timeout = resume_clients(epollFd, &suspended);
+    int count = epoll_wait(epollFd, events, SERVER_MAX_EVENTS, timeout);
+    if (count == -1 && errno != EINTR) {
+      perror("Error waiting for clients");
+      break;
+    }
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == &listen_marker) {
+        accept_clients(epollFd, listenFd, max_backups);
+      } else if (events[i].data.ptr == &signal_marker) {
+        stop = 1;
+      } else {
+        Connection *conn = events[i].data.ptr;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive_input(conn);
+        // O que o cliente enviou antes de fechar ainda corre, mas a ligação acaba aqui
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) conn->hangup = 1;
+        serve(epollFd, conn, &suspended);
+      }
+    }
+  }
+
+  // Os clientes ainda ligados são desligados; os comandos que já correram ficam na tabela
+  close(listenFd);
+  unlink(socket_path);
+  close(signalFd);
+  close(epollFd);
+  while (clients != NULL) {
+    close_connection(clients, &suspended);
+  }
+  return 0;
+}
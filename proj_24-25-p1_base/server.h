@@ -0,0 +1,62 @@
+#ifndef KVS_SERVER_H
+#define KVS_SERVER_H
+
+#include <stddef.h>
+#include <time.h>
+#include "jobs.h"
+#include "operations.h"
+
+/* Modo servidor: depois de correr os ficheiros .job da diretoria, o kvs mantém a tabela e
+ aceita comandos de clientes num socket UNIX, até receber SIGINT ou SIGTERM. Um único ciclo
+ de eventos (epoll) trata de todos os clientes com I/O não bloqueante e corre os comandos,
+ que são os mesmos dos ficheiros .job (parser.c e jobs.c), uma linha por comando.
+
+ A resposta a cada comando é o que ele escreveria no .out, seguido de uma linha "OK". Um
+ cliente pode enviar vários comandos sem esperar pelas respostas, que chegam pela ordem dos
+ comandos. Um WAIT suspende só o seu cliente (os comandos que ele ainda não correu perdem-se
+ se o cliente fechar a ligação de vez entretanto); os backups de um cliente chamam-se
+ client-<id>-N.bck, em que id é o thread_id do cliente (numerado a seguir aos ficheiros).
+
+ Limite: os comandos correm na própria thread do ciclo de eventos, por isso um comando lento
+ atrasa todos os clientes até acabar. É o caso de um WRITE ou DELETE com -w e a política
+ group (espera pelo fdatasync do WAL) e de um SHOW de uma tabela grande (formata-a toda).
+ Os backups não contam: correm num processo filho. */
+
+// Eventos tratados por cada epoll_wait
+#define SERVER_MAX_EVENTS 64
+// Bytes lidos de um cliente de cada vez
+#define SERVER_READ_SIZE (64 * 1024)
+// Deixamos de ler de um cliente com mais do que isto por processar ou por enviar
+#define SERVER_MAX_PENDING (1024 * 1024)
+
+typedef struct Connection {
+  int socket;
+  in_out_fds job;           // Estado do cliente como ficheiro .job (backups, WAIT, output)
+  char *input;              // Bytes recebidos e ainda por processar
+  size_t input_len, input_capacity;
+  char *output;             // Respostas por enviar, a partir de output_sent
+  size_t output_len, output_sent, output_capacity;
+  uint32_t events;          // Eventos pedidos ao epoll
+  int closed;               // O cliente já não vai enviar mais nada
+  int failed;               // Erro no socket: o cliente é desligado
+  int hangup;               // O cliente fechou a ligação de vez: não recebe mais respostas
+  int suspended;            // Num WAIT até resume
+  struct timespec resume;   // CLOCK_MONOTONIC
+  struct Connection *next_suspended;
+  struct Connection *prev, *next; // Todos os clientes ligados
+} Connection;
+
+/// Creates the listening socket of the server. Must be called before any other thread is
+/// created: it also blocks SIGINT and SIGTERM, which server_run waits for, in every thread.
+/// @param path Path of the socket (an old socket file there is replaced, unless a server is
+/// still accepting connections on it).
+/// @return File descriptor of the socket, -1 on failure.
+int server_listen(const char *path);
+
+/// Serves clients until SIGINT or SIGTERM and removes the socket file.
+/// @param listenFd Socket returned by server_listen.
+/// @param max_backups Maximum number of backups running at the same time.
+/// @return 0 if the server stopped normally, 1 otherwise.
+int server_run(int listenFd, int max_backups);
+
+#endif  // KVS_SERVER_H
@@ -0,0 +1,257 @@
+// syscall (para o futex) e as funções de afinidade de CPU não fazem parte do POSIX
+#define _GNU_SOURCE
+
+#include "shard.h"
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Chaves de um comando que pertencem a um dono, copiadas para arrays contíguos para serem
+// aplicadas de uma vez por write_pairs, read_pairs ou delete_pairs
+typedef struct ShardPart {
+  size_t num_pairs;
+  size_t index[MAX_WRITE_SIZE]; // Posição de cada chave no comando
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  int result[MAX_WRITE_SIZE];
+} ShardPart;
+
+// Chamada por read_pairs; se a leitura for repetida os valores são todos escritos outra vez
+static void copy_part_value(void *arg, size_t index, const char *value) {
+  ShardPart *part = arg;
+  part->result[index] = value != NULL;
+  if (value != NULL) {
+    strcpy(part->values[index], value);
+  }
+}
+
+// Devolve o que write_pairs/delete_pairs devolveram
+static uint64_t run_part(ShardOwner *owner, ShardCommand *command, ShardPart *part) {
+  part->num_pairs = 0;
+  for (size_t i = 0; i < command->num_pairs; i++) {
+    if (command->owner[i] != owner->id) continue;
+    size_t n = part->num_pairs++;
+    part->index[n] = i;
+    strcpy(part->keys[n], command->keys[i]);
+    if (command->operation == SHARD_WRITE) {
+      strcpy(part->values[n], command->values[i]);
+    }
+  }
+
+  uint64_t record = 0;
+  switch (command->operation) {
+  case SHARD_WRITE:
+    record = write_pairs(owner->table, part->num_pairs, part->keys, part->values, part->result);
+    break;
+  case SHARD_READ:
+    read_pairs(owner->table, part->num_pairs, part->keys, copy_part_value, part);
+    break;
+  case SHARD_DELETE:
+    record = delete_pairs(owner->table, part->num_pairs, part->keys, part->result);
+    break;
+  }
+
+  for (size_t n = 0; n < part->num_pairs; n++) {
+    size_t i = part->index[n];
+    command->result[i] = part->result[n];
+    if (command->operation == SHARD_READ && part->result[n]) {
+      strcpy(command->values[i], part->values[n]);
+    }
+  }
+  return record;
+}
+
+static void reply(ShardCommand *command) {
+  uint32_t before = atomic_fetch_sub(&command->pending, 1);
+  // Depois do fetch_sub o comando pode já ter desaparecido da stack de quem o corre: o
+  // endereço só é usado para o futex, e um wake a mais é só um regresso antecipado
+  if (before == (SHARD_WAITING | 1)) {
+    syscall(SYS_futex, &command->pending, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+// Corre as mensagens que o dono levou da fila, pela ordem em que foram entregues
+static void run_messages(ShardOwner *owner, ShardMessage *messages, ShardPart *part) {
+  ShardMessage *ordered = NULL;
+  while (messages != NULL) {
+    ShardMessage *next = messages->next;
+    messages->next = ordered;
+    ordered = messages;
+    messages = next;
+  }
+  while (ordered != NULL) {
+    // A mensagem deixa de existir com a resposta
+    ShardMessage *next = ordered->next;
+    // O fetch_sub da resposta publica o número a quem espera
+    ordered->record = run_part(owner, ordered->command, part);
+    reply(ordered->command);
+    ordered = next;
+  }
+}
+
+static void *serve_shard(void *arg) {
+  ShardOwner *owner = arg;
+  if (owner->cpu != -1) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET((size_t)owner->cpu, &cpus);
+    // Sem permissão para fixar a thread o dono corre na mesma, onde o sistema quiser
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  ShardPart *part = malloc(sizeof(ShardPart));
+  if (part == NULL) {
+    // Sem o espaço de trabalho o dono não pode responder; quem corre comandos ficaria à espera
+    write(STDERR_FILENO, "Failed to start shard owner\n", strlen("Failed to start shard owner\n"));
+    abort();
+  }
+  unsigned int idle = 0;
+  while (!atomic_load(&owner->stop)) {
+    ShardMessage *messages = atomic_exchange_explicit(&owner->inbox, NULL, memory_order_acquire);
+    if (messages != NULL) {
+      run_messages(owner, messages, part);
+      idle = 0;
+      continue;
+    }
+    if (++idle < SHARD_IDLE_ROUNDS) {
+      if (idle > SHARD_SPIN_ROUNDS) sched_yield();
+      continue;
+    }
+
+    // Como no shm_server: marcamos sleeping antes de voltar a ver a fila, e quem entrega uma
+    // mensagem depois disso vê a marca e toca a campainha
+    uint32_t doorbell = atomic_load(&owner->doorbell);
+    atomic_store(&owner->sleeping, 1);
+    if (atomic_load(&owner->inbox) == NULL && !atomic_load(&owner->stop)) {
+      syscall(SYS_futex, &owner->doorbell, FUTEX_WAIT_PRIVATE, doorbell, NULL, NULL, 0);
+    }
+    atomic_store(&owner->sleeping, 0);
+    idle = 0;
+  }
+  free(part);
+  return NULL;
+}
+
+static void wake_owner(ShardOwner *owner) {
+  atomic_fetch_add(&owner->doorbell, 1);
+  syscall(SYS_futex, &owner->doorbell, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void deliver(ShardOwner *owner, ShardMessage *message) {
+  ShardMessage *head = atomic_load_explicit(&owner->inbox, memory_order_relaxed);
+  do {
+    message->next = head;
+    // seq_cst: o dono que marcou sleeping antes de voltar a ver a fila vê esta mensagem, ou
+    // nós vemos sleeping e acordamo-lo
+  } while (!atomic_compare_exchange_weak(&owner->inbox, &head, message));
+  if (atomic_load(&owner->sleeping) && atomic_exchange(&owner->sleeping, 0)) {
+    wake_owner(owner);
+  }
+}
+
+static void stop_owners(ShardSet *shards, size_t started) {
+  for (size_t i = 0; i < started; i++) {
+    atomic_store(&shards->owners[i].stop, 1);
+    wake_owner(&shards->owners[i]);
+    pthread_join(shards->owners[i].thread, NULL);
+  }
+}
+
+ShardSet *shard_set_create(HashTable *ht, size_t num_shards) {
+  if (num_shards == 0 || num_shards > LOCK_STRIPES) return NULL;
+  ShardSet *shards = malloc(sizeof(ShardSet));
+  if (shards == NULL) return NULL;
+  if (posix_memalign((void **)&shards->owners, _Alignof(ShardOwner), num_shards * sizeof(ShardOwner)) != 0) {
+    free(shards);
+    return NULL;
+  }
+  shards->num_shards = num_shards;
+
+  // Os donos são repartidos pelos CPUs onde o processo pode correr
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int num_cpus = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET((size_t)cpu, &allowed)) cpus[num_cpus++] = cpu;
+    }
+  }
+
+  for (size_t i = 0; i < num_shards; i++) {
+    ShardOwner *owner = &shards->owners[i];
+    atomic_init(&owner->inbox, NULL);
+    atomic_init(&owner->sleeping, 0);
+    atomic_init(&owner->doorbell, 0);
+    atomic_init(&owner->stop, 0);
+    owner->table = ht;
+    owner->id = i;
+    owner->cpu = num_cpus > 0 ? cpus[i % (size_t)num_cpus] : -1;
+    if (pthread_create(&owner->thread, NULL, serve_shard, owner) != 0) {
+      stop_owners(shards, i);
+      free(shards->owners);
+      free(shards);
+      return NULL;
+    }
+  }
+  return shards;
+}
+
+uint64_t shard_run(ShardSet *shards, enum ShardOperation operation, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], int result[]) {
+  ShardCommand command;
+  command.operation = operation;
+  command.num_pairs = num_pairs;
+  command.keys = keys;
+  command.values = values;
+  command.result = result;
+
+  // O shard de uma chave é o resto da divisão da sua stripe pelo número de shards
+  uint64_t involved = 0;
+  uint32_t count = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    size_t stripe = (size_t)__builtin_ctzll(key_stripe(keys[i]));
+    size_t owner = stripe % shards->num_shards;
+    command.owner[i] = (uint8_t)owner;
+    if (!(involved & (1ULL << owner))) {
+      involved |= 1ULL << owner;
+      count++;
+    }
+  }
+  // Todas as respostas são contadas antes de o primeiro dono poder responder
+  atomic_init(&command.pending, count);
+  for (size_t owner = 0; owner < shards->num_shards; owner++) {
+    if (involved & (1ULL << owner)) {
+      command.messages[owner].command = &command;
+      deliver(&shards->owners[owner], &command.messages[owner]);
+    }
+  }
+
+  // Esperamos a rodar e, se os donos demorarem, no futex de pending
+  for (unsigned int round = 0; (atomic_load_explicit(&command.pending, memory_order_acquire) & ~SHARD_WAITING) != 0;
+       round++) {
+    if (round < SHARD_SPIN_ROUNDS) continue;
+    uint32_t pending = atomic_fetch_or(&command.pending, SHARD_WAITING) | SHARD_WAITING;
+    if (pending != SHARD_WAITING) {
+      syscall(SYS_futex, &command.pending, FUTEX_WAIT_PRIVATE, pending, NULL, NULL, 0);
+    }
+  }
+
+  // Os registos de um WAL são numerados por ordem, por isso basta esperar pelo último
+  uint64_t record = 0;
+  for (size_t owner = 0; owner < shards->num_shards; owner++) {
+    if ((involved & (1ULL << owner)) && command.messages[owner].record > record) {
+      record = command.messages[owner].record;
+    }
+  }
+  return record;
+}
+
+void shard_set_destroy(ShardSet *shards) {
+  stop_owners(shards, shards->num_shards);
+  free(shards->owners);
+  free(shards);
+}
@@ -0,0 +1,100 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+#include "kvs.h"
+
+/* Modo com dono por shard (kvs -k N). As stripes da tabela são repartidas por N shards, e
+ só a thread dona de um shard (fixada num CPU) altera ou lê as chaves das suas stripes. Quem
+ corre um WRITE, READ ou DELETE não toca na tabela: parte o comando pelos donos das chaves,
+ mete uma mensagem na fila de cada dono envolvido e espera pelas respostas, que os donos
+ escrevem diretamente nos arrays de resultados (por isso a ordem do output não muda).
+
+ As filas são pilhas sem locks com vários produtores e um consumidor: os produtores fazem
+ push com CAS e o dono leva a pilha inteira de uma vez com um exchange (sem ABA). Como só o
+ dono escreve nas suas stripes, os locks das stripes nunca são disputados entre escritores;
+ continuam a existir para o SHOW, o SCAN e os backups, que leem a tabela toda.
+
+ Um comando com chaves de vários shards é aplicado por partes, uma por shard: cada parte é
+ atómica, mas o comando inteiro não (um SHOW pode ver só algumas das suas escritas). */
+
+// Voltas sem mensagens em que um dono não larga o CPU
+#define SHARD_SPIN_ROUNDS 256
+// Voltas sem mensagens antes de um dono adormecer
+#define SHARD_IDLE_ROUNDS 4096
+// Bit de pending que diz que quem espera pelo comando vai dormir no futex
+#define SHARD_WAITING 0x80000000u
+
+enum ShardOperation {
+  SHARD_WRITE,
+  SHARD_READ,
+  SHARD_DELETE,
+};
+
+typedef struct ShardCommand ShardCommand;
+
+// Parte de um comando entregue a um dono
+typedef struct ShardMessage {
+  struct ShardMessage *next;
+  ShardCommand *command;
+  uint64_t record; // Resposta: o que write_pairs/delete_pairs devolveram (o registo no WAL)
+} ShardMessage;
+
+// Um comando à espera dos donos. Vive na stack de quem o corre, até pending chegar a 0.
+struct ShardCommand {
+  enum ShardOperation operation;
+  size_t num_pairs;
+  char (*keys)[MAX_STRING_SIZE];
+  char (*values)[MAX_STRING_SIZE]; // Valores a escrever, ou onde os valores lidos são copiados
+  int *result;                     // failed (WRITE), found (READ) ou missing (DELETE)
+  uint8_t owner[MAX_WRITE_SIZE];   // Dono de cada chave
+  _Atomic uint32_t pending;        // Donos que ainda não responderam (e SHARD_WAITING)
+  ShardMessage messages[LOCK_STRIPES];
+};
+
+// Um dono, na sua linha de cache
+typedef struct ShardOwner {
+  _Alignas(64) _Atomic(ShardMessage *) inbox;
+  _Atomic uint32_t sleeping; // O dono vai adormecer (ou dorme) em doorbell
+  _Atomic uint32_t doorbell;
+  pthread_t thread;
+  HashTable *table;
+  size_t id;
+  int cpu; // CPU onde a thread fica, -1 se não for fixada
+  atomic_int stop;
+} ShardOwner;
+
+typedef struct ShardSet {
+  size_t num_shards;
+  ShardOwner *owners;
+} ShardSet;
+
+/// Starts one owner thread per shard, each pinned to a CPU (if the system allows it).
+/// @param ht Hash table whose stripes are split among the shards.
+/// @param num_shards Number of shards (1 to LOCK_STRIPES).
+/// @return The shards, or NULL on failure.
+ShardSet *shard_set_create(HashTable *ht, size_t num_shards);
+
+/// Runs a WRITE, READ or DELETE through the owners of its keys and waits for every reply.
+/// The results are as for write_pairs, read_pairs (found[i] and values[i]) and delete_pairs.
+/// @param shards Shards.
+/// @param operation Operation.
+/// @param num_pairs Number of keys (1 to MAX_WRITE_SIZE).
+/// @param keys Keys.
+/// @param values Values to write (WRITE), or buffers for the values read (READ). Unused by
+/// DELETE.
+/// @param result failed (WRITE), found (READ) or missing (DELETE) of each key.
+/// @return The largest number returned by write_pairs/delete_pairs on the owners (the last
+/// WAL record of the command to wait for), 0 for a READ.
+uint64_t shard_run(ShardSet *shards, enum ShardOperation operation, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE], int result[]);
+
+/// Stops the owner threads and frees the shards. No command may be running.
+/// @param shards Shards.
+void shard_set_destroy(ShardSet *shards);
+
+#endif  // KVS_SHARD_H
@@ -0,0 +1,172 @@
+// syscall (para o futex) não faz parte do POSIX
+#define _DEFAULT_SOURCE
+
+#include "shm_server.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "operations.h"
+
+// Uma chave ou um valor que os ficheiros .job também aceitariam: não vazio, terminado dentro
+// do slot e sem os delimitadores do parser (senão os backups deixavam de se ler)
+static int valid_string(const char *string) {
+  if (memchr(string, '\0', MAX_STRING_SIZE) == NULL) return 0;
+  return string[0] != '\0' && string[strcspn(string, " ,()[]\n")] == '\0';
+}
+
+// Corre um pedido e escreve a resposta no próprio slot. O pedido é primeiro copiado para
+// request: validar o slot e corrê-lo depois deixava o cliente trocar as chaves entretanto.
+static void answer(ShmRequest *request, KvsShmSlot *slot) {
+  uint32_t command = slot->command;
+  size_t num_keys = slot->num_keys;
+  int valid = num_keys >= 1 && num_keys <= MAX_WRITE_SIZE;
+  for (size_t i = 0; valid && i < num_keys; i++) {
+    memcpy(request->keys[i], slot->keys[i], MAX_STRING_SIZE);
+    valid = valid_string(request->keys[i]);
+    if (valid && command == KVS_SHM_WRITE) {
+      memcpy(request->values[i], slot->values[i], MAX_STRING_SIZE);
+      valid = valid_string(request->values[i]);
+    }
+  }
+  int failed = 1;
+  if (valid) {
+    switch (command) {
+    case KVS_SHM_WRITE:
+      failed = kvs_write_pairs(num_keys, request->keys, request->values, request->status);
+      break;
+    case KVS_SHM_READ:
+      failed = kvs_read_pairs(num_keys, request->keys, request->values, request->status);
+      break;
+    case KVS_SHM_DELETE:
+      failed = kvs_delete_pairs(num_keys, request->keys, request->status);
+      break;
+    default:
+      break;
+    }
+  }
+  if (!failed) {
+    for (size_t i = 0; i < num_keys; i++) {
+      slot->status[i] = request->status[i];
+      if (command == KVS_SHM_READ && request->status[i]) {
+        memcpy(slot->values[i], request->values[i], MAX_STRING_SIZE);
+      }
+    }
+  }
+  slot->result = failed ? -1 : 0;
+}
+
+// Responde a todos os pedidos publicados; devolve quantos havia
+static size_t poll_channels(ShmServer *server) {
+  size_t answered = 0;
+  for (int i = 0; i < KVS_SHM_CHANNELS; i++) {
+    KvsShmChannel *channel = &server->region->channels[i];
+    uint32_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    uint32_t head = atomic_load(&channel->head);
+    for (; tail != head; tail++) {
+      answer(&server->request, &channel->slots[tail % KVS_SHM_SLOTS]);
+      atomic_store_explicit(&channel->tail, tail + 1, memory_order_release);
+      answered++;
+    }
+  }
+  return answered;
+}
+
+static void *serve_clients(void *arg) {
+  ShmServer *server = arg;
+  KvsShmRegion *region = server->region;
+  unsigned int idle = 0;
+  while (!atomic_load(&server->stop)) {
+    if (poll_channels(server) > 0) {
+      idle = 0;
+      continue;
+    }
+    if (++idle < SHM_IDLE_ROUNDS) {
+      // Só com um CPU para os dois lados é que o cliente precisa que a thread lhe ceda o CPU
+      if (idle > SHM_SPIN_ROUNDS) sched_yield();
+      continue;
+    }
+
+    // Marcamos sleeping antes de voltar a ver os canais: um cliente que publicou depois
+    // disto vê a marca e toca a campainha, e o futex não espera se ela já mudou
+    uint32_t doorbell = atomic_load(&region->doorbell);
+    atomic_store(&region->sleeping, 1);
+    if (poll_channels(server) == 0 && !atomic_load(&server->stop)) {
+      syscall(SYS_futex, &region->doorbell, FUTEX_WAIT, doorbell, NULL, NULL, 0);
+    }
+    atomic_store(&region->sleeping, 0);
+    idle = 0;
+  }
+  return NULL;
+}
+
+ShmServer *shm_server_open(const char *name) {
+  ShmServer *server = malloc(sizeof(ShmServer));
+  if (server == NULL) return NULL;
+  if (snprintf(server->name, sizeof(server->name), "%s", name) >= (int)sizeof(server->name)) {
+    write(STDERR_FILENO, "Shared memory name too long\n", strlen("Shared memory name too long\n"));
+    free(server);
+    return NULL;
+  }
+
+  // Uma região que ficou de um kvs anterior já não tem ninguém a responder
+  shm_unlink(name);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1 || ftruncate(fd, (off_t)sizeof(KvsShmRegion)) == -1) {
+    perror("Couldn't create shared memory");
+    if (fd != -1) {
+      close(fd);
+      shm_unlink(name);
+    }
+    free(server);
+    return NULL;
+  }
+  server->region = mmap(NULL, sizeof(KvsShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (server->region == MAP_FAILED) {
+    perror("Couldn't map shared memory");
+    shm_unlink(name);
+    free(server);
+    return NULL;
+  }
+
+  // A região nova está a zeros: os canais estão livres e vazios
+  KvsShmRegion *region = server->region;
+  region->version = KVS_SHM_VERSION;
+  region->server = (int32_t)getpid();
+  atomic_store(&region->running, 1);
+  atomic_store_explicit(&region->magic, KVS_SHM_MAGIC, memory_order_release);
+  server->started = 0;
+  atomic_init(&server->stop, 0);
+  return server;
+}
+
+int shm_server_start(ShmServer *server) {
+  if (pthread_create(&server->thread, NULL, serve_clients, server) != 0) {
+    return 1;
+  }
+  server->started = 1;
+  return 0;
+}
+
+void shm_server_close(ShmServer *server) {
+  KvsShmRegion *region = server->region;
+  if (server->started) {
+    atomic_store(&server->stop, 1);
+    atomic_fetch_add(&region->doorbell, 1);
+    syscall(SYS_futex, &region->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    pthread_join(server->thread, NULL);
+  }
+  // Os clientes à espera de resposta veem que o kvs parou
+  atomic_store_explicit(&region->running, 0, memory_order_release);
+  shm_unlink(server->name);
+  munmap(region, sizeof(KvsShmRegion));
+  free(server);
+}
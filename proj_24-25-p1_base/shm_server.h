@@ -0,0 +1,53 @@
+#ifndef KVS_SHM_SERVER_H
+#define KVS_SHM_SERVER_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "kvs_client.h"
+
+/* Lado do kvs do acesso por memória partilhada (ver kvs_client.h). Uma thread percorre os
+ canais dos clientes e corre os seus pedidos. O cliente pode mexer no slot a qualquer
+ momento, por isso as chaves e os valores são copiados antes de serem validados, e o
+ comando corre sobre a cópia; só a resposta é escrita no slot. Enquanto há pedidos a thread não dorme; sem pedidos, começa a ceder o
+ CPU depois de SHM_SPIN_ROUNDS voltas e, depois de SHM_IDLE_ROUNDS, marca sleeping e espera
+ no futex doorbell até um cliente a acordar. */
+
+// Voltas sem pedidos em que a thread não larga o CPU
+#define SHM_SPIN_ROUNDS 256
+// Voltas sem pedidos antes de a thread adormecer
+#define SHM_IDLE_ROUNDS 4096
+
+// Cópia de um pedido, sobre a qual ele é validado e corrido
+typedef struct ShmRequest {
+  char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  int status[MAX_WRITE_SIZE];
+} ShmRequest;
+
+typedef struct ShmServer {
+  KvsShmRegion *region;
+  ShmRequest request; // Só usada pela thread que responde
+  char name[NAME_MAX];
+  pthread_t thread;
+  int started;
+  atomic_int stop;
+} ShmServer;
+
+/// Creates the shared memory region of the clients (an old region with the same name is
+/// replaced). Clients can connect right away; their requests are answered once
+/// shm_server_start is called.
+/// @param name Name of the region, as for shm_open (e.g. "/kvs").
+/// @return The server, or NULL on failure.
+ShmServer *shm_server_open(const char *name);
+
+/// Starts the thread that answers the clients.
+/// @param server Server returned by shm_server_open.
+/// @return 0 if the thread was started, 1 otherwise.
+int shm_server_start(ShmServer *server);
+
+/// Stops answering the clients, removes the region and frees the server.
+/// @param server Server returned by shm_server_open.
+void shm_server_close(ShmServer *server);
+
+#endif  // KVS_SHM_SERVER_H
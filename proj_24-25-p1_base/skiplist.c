@@ -0,0 +1,100 @@
+#include "skiplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "kvs.h"
+
+static size_t index_node_size(int level) {
+  return sizeof(IndexNode) + (size_t)level * sizeof(IndexNode *);
+}
+
+int index_pools_init(IndexPools *pools) {
+  if (slab_init(&pools->small, index_node_size(SKIPLIST_SMALL_LEVEL), sizeof(void *)) != 0) return 1;
+  if (slab_init(&pools->large, index_node_size(SKIPLIST_MAX_LEVEL), sizeof(void *)) != 0) {
+    slab_destroy(&pools->small);
+    return 1;
+  }
+  return 0;
+}
+
+void index_pools_destroy(IndexPools *pools) {
+  slab_destroy(&pools->small);
+  slab_destroy(&pools->large);
+}
+
+int skiplist_init(SkipList *list) {
+  list->level = 1;
+  list->head = calloc(1, index_node_size(SKIPLIST_MAX_LEVEL));
+  if (list->head == NULL) return 1;
+  list->head->level = SKIPLIST_MAX_LEVEL;
+  return 0;
+}
+
+void skiplist_destroy(SkipList *list) {
+  free(list->head);
+  list->head = NULL;
+}
+
+// Nível com distribuição geométrica (p = 1/4), tirado dos bits altos do hash: os bits baixos
+// já escolheram a stripe e o bucket.
+static int level_for(uint64_t hash) {
+  int level = 1;
+  uint64_t bits = hash >> 32;
+  while ((bits & 3) == 0 && level < SKIPLIST_MAX_LEVEL) {
+    level++;
+    bits >>= 2;
+  }
+  return level;
+}
+
+// Preenche update[i] com o último nó do nível i cuja chave é menor que key.
+static void find_predecessors(SkipList *list, const char *key, IndexNode *update[]) {
+  IndexNode *current = list->head;
+  for (int i = list->level - 1; i >= 0; i--) {
+    while (current->forward[i] != NULL && strcmp(current->forward[i]->node->key, key) < 0) {
+      current = current->forward[i];
+    }
+    update[i] = current;
+  }
+}
+
+IndexNode *skiplist_insert(SkipList *list, IndexPools *pools, struct KeyNode *node, uint64_t hash) {
+  int level = level_for(hash);
+  IndexNode *index = slab_alloc(level <= SKIPLIST_SMALL_LEVEL ? &pools->small : &pools->large);
+  if (index == NULL) return NULL;
+  index->node = node;
+  index->level = level;
+
+  IndexNode *update[SKIPLIST_MAX_LEVEL];
+  find_predecessors(list, node->key, update);
+  for (int i = list->level; i < level; i++) {
+    update[i] = list->head;
+  }
+  if (level > list->level) list->level = level;
+
+  for (int i = 0; i < level; i++) {
+    index->forward[i] = update[i]->forward[i];
+    update[i]->forward[i] = index;
+  }
+  return index;
+}
+
+void skiplist_remove(SkipList *list, IndexNode *index) {
+  IndexNode *update[SKIPLIST_MAX_LEVEL];
+  find_predecessors(list, index->node->key, update);
+  for (int i = 0; i < index->level; i++) {
+    if (update[i]->forward[i] == index) {
+      update[i]->forward[i] = index->forward[i];
+    }
+  }
+  while (list->level > 1 && list->head->forward[list->level - 1] == NULL) {
+    list->level--;
+  }
+  slab_free(index);
+}
+
+IndexNode *skiplist_seek(SkipList *list, const char *key) {
+  IndexNode *update[SKIPLIST_MAX_LEVEL];
+  find_predecessors(list, key, update);
+  return update[0]->forward[0];
+}
@@ -0,0 +1,64 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stdint.h>
+#include "slab.h"
+
+/* Índice ordenado das chaves de uma stripe, mantido ao lado da hash table. Cada IndexNode
+ aponta para o KeyNode atual da chave (que muda quando a chave é reescrita). A skip list é
+ protegida pelo lock da stripe a que pertence. */
+
+#define SKIPLIST_MAX_LEVEL 16
+// Os nós com nível até aqui (~98% deles) vêm de uma pool de objetos mais pequenos
+#define SKIPLIST_SMALL_LEVEL 3
+
+struct KeyNode;
+
+typedef struct IndexNode {
+  struct KeyNode *node;
+  int level;
+  struct IndexNode *forward[];
+} IndexNode;
+
+typedef struct SkipList {
+  int level;
+  IndexNode *head;
+} SkipList;
+
+// Pools partilhadas pelas skip lists de uma tabela
+typedef struct IndexPools {
+  SlabPool small;
+  SlabPool large;
+} IndexPools;
+
+/// Initializes the pools of index nodes.
+/// @return 0 on success, 1 otherwise.
+int index_pools_init(IndexPools *pools);
+
+/// Frees every index node of the pools.
+void index_pools_destroy(IndexPools *pools);
+
+/// Initializes an empty skip list.
+/// @return 0 on success, 1 otherwise.
+int skiplist_init(SkipList *list);
+
+/// Frees the head of the list (the nodes belong to the pools).
+void skiplist_destroy(SkipList *list);
+
+/// Inserts a node whose key isn't in the list yet. The level of the new index node is
+/// derived from the key's hash, so no random number generator is shared between threads.
+/// @param list List to insert in.
+/// @param pools Pools to allocate the index node from.
+/// @param node Node with the key.
+/// @param hash Hash of the key.
+/// @return The new index node, NULL if out of memory.
+IndexNode *skiplist_insert(SkipList *list, IndexPools *pools, struct KeyNode *node, uint64_t hash);
+
+/// Removes an index node from the list and frees it.
+void skiplist_remove(SkipList *list, IndexNode *index);
+
+/// Finds the first index node whose key is greater than or equal to the given key.
+/// @return The index node, NULL if every key is smaller.
+IndexNode *skiplist_seek(SkipList *list, const char *key);
+
+#endif // KVS_SKIPLIST_H
@@ -0,0 +1,165 @@
+#include "slab.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Cabeçalho no início de cada slab
+typedef struct Slab {
+  SlabPool *pool;
+  struct Slab *next;
+} Slab;
+
+// Um objeto livre guarda nos primeiros bytes o próximo objeto livre
+typedef struct FreeObject {
+  struct FreeObject *next;
+} FreeObject;
+
+typedef struct SlabCache {
+  SlabPool *pool;
+  FreeObject *head;
+  size_t count;
+} SlabCache;
+
+static _Thread_local SlabCache caches[SLAB_THREAD_CACHES];
+static atomic_size_t next_pool_id = 0;
+static pthread_key_t flush_key;
+static pthread_once_t flush_key_once = PTHREAD_ONCE_INIT;
+
+static size_t round_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Devolve à pool os objetos da cache além dos primeiros keep.
+static void flush_cache(SlabCache *cache, size_t keep) {
+  if (cache->count <= keep) return;
+
+  FreeObject *first = cache->head;
+  FreeObject *last = first;
+  for (size_t i = 1; i < cache->count - keep; i++) {
+    last = last->next;
+  }
+  cache->head = last->next;
+  cache->count = keep;
+
+  pthread_mutex_lock(&cache->pool->lock);
+  last->next = cache->pool->free_list;
+  cache->pool->free_list = first;
+  pthread_mutex_unlock(&cache->pool->lock);
+}
+
+// Quando uma thread termina os objetos da sua cache voltam para as pools.
+static void flush_thread_caches(void *arg) {
+  (void)arg;
+  for (int i = 0; i < SLAB_THREAD_CACHES; i++) {
+    if (caches[i].pool != NULL) {
+      flush_cache(&caches[i], 0);
+      caches[i].pool = NULL;
+    }
+  }
+}
+
+static void create_flush_key() {
+  pthread_key_create(&flush_key, flush_thread_caches);
+}
+
+static SlabCache *get_cache(SlabPool *pool) {
+  SlabCache *cache = &caches[pool->id % SLAB_THREAD_CACHES];
+  if (cache->pool != pool) {
+    if (cache->pool != NULL) {
+      flush_cache(cache, 0);
+    } else {
+      pthread_once(&flush_key_once, create_flush_key);
+      pthread_setspecific(flush_key, caches);
+    }
+    cache->pool = pool;
+  }
+  return cache;
+}
+
+int slab_init(SlabPool *pool, size_t object_size, size_t alignment) {
+  if (alignment < sizeof(void *)) alignment = sizeof(void *);
+  pool->object_size = round_up(object_size, alignment);
+  size_t first = round_up(sizeof(Slab), alignment);
+  if (first + pool->object_size > SLAB_SIZE) return 1;
+  pool->objects_per_slab = (SLAB_SIZE - first) / pool->object_size;
+  pool->id = atomic_fetch_add(&next_pool_id, 1);
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+  return pthread_mutex_init(&pool->lock, NULL) != 0;
+}
+
+// Vai buscar SLAB_BATCH objetos à pool, criando um slab novo se não houver nenhum livre.
+// Tem de ser chamada com o lock da pool.
+static void refill_cache(SlabPool *pool, SlabCache *cache) {
+  if (pool->free_list == NULL) {
+    Slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == NULL) return;
+    slab->pool = pool;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // Os objetos ficam no fim do slab, depois do cabeçalho, e continuam alinhados
+    char *object = (char *)slab + (SLAB_SIZE - pool->objects_per_slab * pool->object_size);
+    for (size_t i = 0; i < pool->objects_per_slab; i++) {
+      FreeObject *free_object = (FreeObject *)(void *)object;
+      free_object->next = pool->free_list;
+      pool->free_list = free_object;
+      object += pool->object_size;
+    }
+  }
+
+  while (pool->free_list != NULL && cache->count < SLAB_BATCH) {
+    FreeObject *free_object = pool->free_list;
+    pool->free_list = free_object->next;
+    free_object->next = cache->head;
+    cache->head = free_object;
+    cache->count++;
+  }
+}
+
+void *slab_alloc(SlabPool *pool) {
+  SlabCache *cache = get_cache(pool);
+  if (cache->head == NULL) {
+    pthread_mutex_lock(&pool->lock);
+    refill_cache(pool, cache);
+    pthread_mutex_unlock(&pool->lock);
+    if (cache->head == NULL) return NULL;
+  }
+
+  FreeObject *object = cache->head;
+  cache->head = object->next;
+  cache->count--;
+  return object;
+}
+
+void slab_free(void *object) {
+  Slab *slab = (Slab *)(void *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+  SlabCache *cache = get_cache(slab->pool);
+
+  FreeObject *free_object = object;
+  free_object->next = cache->head;
+  cache->head = free_object;
+  if (++cache->count > SLAB_CACHE_MAX) {
+    flush_cache(cache, SLAB_CACHE_MAX - SLAB_BATCH);
+  }
+}
+
+void slab_destroy(SlabPool *pool) {
+  Slab *slab = pool->slabs;
+  while (slab != NULL) {
+    Slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+  pthread_mutex_destroy(&pool->lock);
+
+  SlabCache *cache = &caches[pool->id % SLAB_THREAD_CACHES];
+  if (cache->pool == pool) {
+    cache->pool = NULL;
+    cache->head = NULL;
+    cache->count = 0;
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Alocador de objetos de tamanho fixo. A memória é pedida ao sistema em slabs de SLAB_SIZE
+ bytes alinhados a SLAB_SIZE, cujo cabeçalho aponta para a pool, por isso um objeto sabe
+ sempre a que pool pertence. Cada thread tem uma cache de objetos livres e só vai à lista
+ global da pool (protegida por um mutex) de SLAB_BATCH em SLAB_BATCH objetos. */
+
+#define SLAB_SIZE (64 * 1024)
+// Objetos trocados de cada vez entre a cache de uma thread e a pool
+#define SLAB_BATCH 64
+// Máximo de objetos livres na cache de uma thread
+#define SLAB_CACHE_MAX (4 * SLAB_BATCH)
+// Número de caches por thread (pools diferentes usadas pela mesma thread)
+#define SLAB_THREAD_CACHES 8
+
+typedef struct SlabPool {
+  size_t object_size;
+  size_t objects_per_slab;
+  size_t id;
+  pthread_mutex_t lock;
+  void *free_list; // Objetos livres devolvidos pelas caches das threads
+  void *slabs;     // Lista de slabs, para libertar tudo de uma vez
+} SlabPool;
+
+/// Initializes a pool of objects.
+/// @param pool Pool to initialize.
+/// @param object_size Size of each object (rounded up to a multiple of the pointer size).
+/// @param alignment Alignment of each object (power of 2, at most SLAB_SIZE / 2).
+/// @return 0 on success, 1 otherwise.
+int slab_init(SlabPool *pool, size_t object_size, size_t alignment);
+
+/// Allocates an object from the pool.
+/// @param pool Pool to allocate from.
+/// @return Uninitialized object, NULL if out of memory.
+void *slab_alloc(SlabPool *pool);
+
+/// Returns an object to the pool it was allocated from.
+/// @param object Object returned by slab_alloc.
+void slab_free(void *object);
+
+/// Frees every slab of the pool at once, including objects still in use.
+/// Other threads must not use the pool anymore.
+/// @param pool Pool to destroy.
+void slab_destroy(SlabPool *pool);
+
+#endif // KVS_SLAB_H
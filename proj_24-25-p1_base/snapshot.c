@@ -0,0 +1,159 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t checksum_update(uint64_t checksum, const unsigned char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    checksum ^= data[i];
+    checksum *= FNV_PRIME;
+  }
+  return checksum;
+}
+
+// Escreve value em little-endian nos size bytes de data
+static void put_le(unsigned char *data, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_le(const unsigned char *data, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= (uint64_t)data[i] << (8 * i);
+  }
+  return value;
+}
+
+static void encode_header(const SnapshotHeader *header, unsigned char data[SNAPSHOT_HEADER_SIZE]) {
+  memcpy(data, header->magic, 8);
+  put_le(data + 8, header->version, 4);
+  put_le(data + 12, header->reserved, 4);
+  put_le(data + 16, header->count, 8);
+  put_le(data + 24, header->checksum, 8);
+}
+
+static void decode_header(const unsigned char data[SNAPSHOT_HEADER_SIZE], SnapshotHeader *header) {
+  memcpy(header->magic, data, 8);
+  header->version = (uint32_t)get_le(data + 8, 4);
+  header->reserved = (uint32_t)get_le(data + 12, 4);
+  header->count = get_le(data + 16, 8);
+  header->checksum = get_le(data + 24, 8);
+}
+
+void snapshot_writer_init(SnapshotWriter *writer, OutputBuffer *out) {
+  writer->out = out;
+  writer->count = 0;
+  writer->checksum = FNV_OFFSET;
+  // O lugar do cabeçalho, preenchido em snapshot_writer_finish
+  unsigned char header[SNAPSHOT_HEADER_SIZE] = {0};
+  output_write(out, (const char *)header, sizeof(header));
+}
+
+void snapshot_write_pair(SnapshotWriter *writer, const char *key, const char *value) {
+  size_t keyLen = strlen(key);
+  size_t valueLen = strlen(value);
+  unsigned char lengths[2] = {(unsigned char)keyLen, (unsigned char)valueLen};
+  output_write(writer->out, (const char *)lengths, 2);
+  output_write(writer->out, key, keyLen);
+  output_write(writer->out, value, valueLen);
+  writer->checksum = checksum_update(writer->checksum, lengths, 2);
+  writer->checksum = checksum_update(writer->checksum, (const unsigned char *)key, keyLen);
+  writer->checksum = checksum_update(writer->checksum, (const unsigned char *)value, valueLen);
+  writer->count++;
+}
+
+int snapshot_writer_finish(SnapshotWriter *writer) {
+  if (output_flush(writer->out) != 0) {
+    return -1;
+  }
+  SnapshotHeader header = {.magic = SNAPSHOT_MAGIC,
+                           .version = SNAPSHOT_FORMAT_VERSION,
+                           .reserved = 0,
+                           .count = writer->count,
+                           .checksum = writer->checksum};
+  unsigned char data[SNAPSHOT_HEADER_SIZE];
+  encode_header(&header, data);
+  if (pwrite(writer->out->fd, data, sizeof(data), 0) != (ssize_t)sizeof(data)) {
+    return -1;
+  }
+  return 0;
+}
+
+// Percorre os registos de um snapshot mapeado. Com load a NULL só valida o ficheiro.
+// @return 0 se os registos estão bem formados (e foram todos carregados), 1 caso contrário.
+static int walk_records(const unsigned char *data, size_t size, const SnapshotHeader *header,
+                        int (*load)(void *arg, const char *key, const char *value), void *arg) {
+  size_t pos = SNAPSHOT_HEADER_SIZE;
+  uint64_t checksum = FNV_OFFSET;
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  for (uint64_t i = 0; i < header->count; i++) {
+    if (size - pos < 2) {
+      return 1;
+    }
+    size_t keyLen = data[pos];
+    size_t valueLen = data[pos + 1];
+    if (keyLen >= MAX_STRING_SIZE || valueLen >= MAX_STRING_SIZE || size - pos - 2 < keyLen + valueLen) {
+      return 1;
+    }
+    if (load == NULL) {
+      checksum = checksum_update(checksum, data + pos, 2 + keyLen + valueLen);
+    } else {
+      memcpy(key, data + pos + 2, keyLen);
+      key[keyLen] = '\0';
+      memcpy(value, data + pos + 2 + keyLen, valueLen);
+      value[valueLen] = '\0';
+      if (load(arg, key, value) != 0) {
+        return 1;
+      }
+    }
+    pos += 2 + keyLen + valueLen;
+  }
+  if (pos != size) {
+    return 1;
+  }
+  return load == NULL && checksum != header->checksum;
+}
+
+int snapshot_load(int fd, void (*reserve)(void *arg, uint64_t count),
+                  int (*load)(void *arg, const char *key, const char *value), void *arg) {
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) == -1 || fileStat.st_size < SNAPSHOT_HEADER_SIZE) {
+    write(STDERR_FILENO, "Invalid snapshot file\n", strlen("Invalid snapshot file\n"));
+    return 1;
+  }
+  size_t size = (size_t)fileStat.st_size;
+  const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("Couldn't map snapshot file");
+    return 1;
+  }
+  posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+
+  SnapshotHeader header;
+  decode_header(data, &header);
+  int result = 1;
+  // O ficheiro é validado por inteiro antes de a tabela ser tocada
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_FORMAT_VERSION) {
+    write(STDERR_FILENO, "Invalid snapshot file (bad header)\n", strlen("Invalid snapshot file (bad header)\n"));
+  } else if (walk_records(data, size, &header, NULL, NULL) != 0) {
+    write(STDERR_FILENO, "Invalid snapshot file (corrupted records)\n", strlen("Invalid snapshot file (corrupted records)\n"));
+  } else {
+    if (reserve != NULL) {
+      reserve(arg, header.count);
+    }
+    result = walk_records(data, size, &header, load, arg);
+  }
+  munmap((void *)data, size);
+  return result;
+}
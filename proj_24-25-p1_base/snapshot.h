@@ -0,0 +1,63 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "output.h"
+
+/* Formato binário dos snapshots (.snap), que ao contrário dos .bck pode ser carregado de
+ volta para a tabela. O ficheiro começa com um SnapshotHeader e segue-se um registo por
+ par, por ordem de chave: 1 byte com o tamanho da chave, 1 byte com o tamanho do valor, a
+ chave e o valor (sem '\0'). O checksum é o FNV-1a de 64 bits de todos os registos.
+
+ No ficheiro o cabeçalho ocupa SNAPSHOT_HEADER_SIZE bytes, com os campos pela ordem do
+ SnapshotHeader e os inteiros em little-endian, qualquer que seja a máquina. */
+
+#define SNAPSHOT_MAGIC "KVSSNAP"
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+
+// Cabeçalho já descodificado (snapshot.c converte-o de e para os bytes do ficheiro)
+typedef struct SnapshotHeader {
+  char magic[8];     // SNAPSHOT_MAGIC, com o '\0'
+  uint32_t version;  // SNAPSHOT_FORMAT_VERSION
+  uint32_t reserved;
+  uint64_t count;    // Número de registos
+  uint64_t checksum; // FNV-1a dos registos
+} SnapshotHeader;
+
+// Escreve um snapshot através de um buffer de output. O cabeçalho só é escrito no fim,
+// quando o número de pares e o checksum já são conhecidos.
+typedef struct SnapshotWriter {
+  OutputBuffer *out;
+  uint64_t count;
+  uint64_t checksum;
+} SnapshotWriter;
+
+/// Starts a snapshot, leaving room for the header. Doesn't allocate memory, so it can be
+/// used in a forked child.
+/// @param writer Writer to initialize.
+/// @param out Empty output buffer of the snapshot file.
+void snapshot_writer_init(SnapshotWriter *writer, OutputBuffer *out);
+
+/// Appends a pair. Pairs must be written in key order.
+/// @param writer Snapshot writer.
+/// @param key Null terminated key.
+/// @param value Null terminated value.
+void snapshot_write_pair(SnapshotWriter *writer, const char *key, const char *value);
+
+/// Flushes the records and writes the header at the start of the file.
+/// @param writer Snapshot writer.
+/// @return 0 on success, -1 otherwise.
+int snapshot_writer_finish(SnapshotWriter *writer);
+
+/// Maps a snapshot file, checks its header and checksum and calls load for every pair.
+/// @param fd File descriptor of the snapshot.
+/// @param reserve Called once with the number of pairs before any of them (may be NULL).
+/// @param load Called for every pair, in key order; a non-zero return stops the load.
+/// @param arg Argument passed to reserve and load.
+/// @return 0 if every pair was loaded, 1 if the file is invalid or a load failed.
+int snapshot_load(int fd, void (*reserve)(void *arg, uint64_t count),
+                  int (*load)(void *arg, const char *key, const char *value), void *arg);
+
+#endif  // KVS_SNAPSHOT_H
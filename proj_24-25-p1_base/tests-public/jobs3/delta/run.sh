@@ -0,0 +1,10 @@
+# -d: o segundo backup é um delta do primeiro; -F junta os dois num backup completo
+"$1" -d . 1 1 && "$1" -F delta-1.bck delta-2.bck > fold.txt
+"$1" -F delta-1.bck delta-2.bck delta-3.bck > fold-all.txt
+# -F recusa uma cadeia partida: um delta que salta o anterior, um ficheiro depois do
+# primeiro que não é um delta e um delta no lugar do backup completo
+for chain in "delta-1.bck delta-3.bck" "delta-1.bck delta-1.bck" "delta-2.bck delta-3.bck"; do
+  "$1" -F $chain > /dev/null 2>> rejected.txt
+  echo "$chain: $?" >> rejected.txt
+done
+exit 0
@@ -0,0 +1,9 @@
+# -s: cada backup é copiado de um snapshot da tabela por uma tarefa, enquanto os comandos
+# seguintes escrevem e apagam as mesmas chaves. Os backups têm de ser iguais aos feitos com
+# fork (os resultados), completos e com -d.
+mkdir full delta && cp mvcc.job full/ && mv mvcc.job delta/
+"$1" -s full 2 1 && "$1" -s -d delta 2 1 || exit 1
+mv full/mvcc.out full-mvcc.out
+for n in 1 2 3; do
+  mv "full/mvcc-$n.bck" "full-mvcc-$n.bck" && mv "delta/mvcc-$n.bck" "delta-mvcc-$n.bck"
+done
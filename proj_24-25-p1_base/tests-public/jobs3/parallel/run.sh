@@ -0,0 +1,2 @@
+# -p: os comandos do ficheiro correm em paralelo, mas o output sai pela ordem do ficheiro
+"$1" -p . 1 4
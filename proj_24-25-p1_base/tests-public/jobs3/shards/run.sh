@@ -0,0 +1,4 @@
+# -k: as chaves de cada comando são repartidas pelos donos dos shards, mas o output é o
+# mesmo que sem shards; as escritas feitas pelos donos ficam no WAL e são repostas sem -k
+mkdir replay && mv replay.job replay/
+"$1" -k 4 -w kvs.wal . 1 2 && "$1" -w kvs.wal replay 1 1 && mv replay/replay.out .
@@ -0,0 +1,76 @@
+// Cliente de teste do modo de memória partilhada (kvs -M): corre pedidos pela biblioteca
+// kvs_client e escreve no stdout o que o kvs respondeu
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "kvs_client.h"
+
+// Publica um pedido já preenchido no slot e espera pela resposta
+static KvsShmSlot *run(KvsClient *client) {
+  uint32_t ticket = kvs_client_submit(client);
+  if (kvs_client_wait(client, ticket) != 0) return NULL;
+  return kvs_client_slot(client, ticket);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s SHM_NAME\n", argv[0]);
+    return 1;
+  }
+  // O kvs só cria a região depois de ler os ficheiros .job: tentamos durante 5 segundos
+  KvsClient *client = NULL;
+  for (int tries = 0; client == NULL && tries < 500; tries++) {
+    if ((client = kvs_client_open(argv[1])) == NULL) {
+      nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+  }
+  if (client == NULL) {
+    fprintf(stderr, "Couldn't connect to %s\n", argv[1]);
+    return 1;
+  }
+
+  char value[MAX_STRING_SIZE];
+  printf("write a: %d\n", kvs_client_write(client, "a", "1"));
+  printf("write b: %d\n", kvs_client_write(client, "b", "2"));
+  int found = kvs_client_read(client, "a", value);
+  printf("read a: %d %s\n", found, found == 0 ? value : "-");
+  printf("read c: %d\n", kvs_client_read(client, "c", value));
+  printf("delete a: %d\n", kvs_client_delete(client, "a"));
+  printf("delete a: %d\n", kvs_client_delete(client, "a"));
+
+  // Um pedido com várias chaves, preenchido diretamente no slot
+  KvsShmSlot *slot = kvs_client_reserve(client);
+  slot->command = KVS_SHM_READ;
+  slot->num_keys = 3;
+  strcpy(slot->keys[0], "b");
+  strcpy(slot->keys[1], "a");
+  strcpy(slot->keys[2], "b");
+  slot = run(client);
+  printf("read [b,a,b]: %d", slot->result);
+  for (size_t i = 0; i < 3; i++) {
+    printf(" %d:%s", slot->status[i], slot->status[i] ? slot->values[i] : "-");
+  }
+  printf("\n");
+
+  // Chaves que um ficheiro .job não aceitaria são recusadas sem mexer na tabela
+  slot = kvs_client_reserve(client);
+  slot->command = KVS_SHM_WRITE;
+  slot->num_keys = 1;
+  strcpy(slot->keys[0], "bad,key");
+  strcpy(slot->values[0], "x");
+  printf("write bad,key: %d\n", run(client)->result);
+  slot = kvs_client_reserve(client);
+  slot->command = KVS_SHM_DELETE;
+  slot->num_keys = 1;
+  memset(slot->keys[0], 'k', MAX_STRING_SIZE); // Sem o '\0'
+  printf("delete unterminated key: %d\n", run(client)->result);
+  slot = kvs_client_reserve(client);
+  slot->command = KVS_SHM_READ;
+  slot->num_keys = 0;
+  printf("read no keys: %d\n", run(client)->result);
+  printf("read b: %d\n", kvs_client_read(client, "b", value));
+
+  kvs_client_close(client);
+  return 0;
+}
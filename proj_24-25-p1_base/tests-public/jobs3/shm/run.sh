@@ -0,0 +1,14 @@
+# -M: os clientes locais falam com o kvs por memória partilhada, através de kvs_client.h.
+# Chaves inválidas são recusadas com result -1. O SIGINT para o kvs e apaga a região.
+src=$(dirname "$1")
+gcc -std=c17 -D_POSIX_C_SOURCE=200809L -I"$src" -o client client.c "$src/kvs_client.c" || exit 1
+mkdir jobs
+name="/kvs-test-$$"
+"$1" -M "$name" jobs 1 1 &
+kvs=$!
+./client "$name" > replies.txt
+kill -INT "$kvs"
+wait "$kvs"
+echo "$?" > stopped.txt
+[ -e "/dev/shm$name" ] && echo "region left behind" >> stopped.txt
+exit 0
@@ -0,0 +1,7 @@
+# -b: o backup é um snapshot binário; -r arranca outra tabela a partir dele
+mkdir restore corrupted && mv restore.job restore/
+"$1" -b . 1 1 && "$1" -r snapshot-1.snap restore 1 1 && mv restore/restore.out .
+# Um snapshot com um byte trocado é recusado
+cp snapshot-1.snap corrupted.snap && printf 'X' | dd conv=notrunc of=corrupted.snap bs=1 seek=36 2> /dev/null
+"$1" -r corrupted.snap corrupted 1 1 2> /dev/null
+echo "$?" > corrupted.txt
@@ -0,0 +1,41 @@
+// Cliente de teste do modo servidor (kvs -S): envia o stdin inteiro, fecha o envio e
+// escreve no stdout tudo o que o kvs responder até fechar a ligação
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s SOCKET < COMMANDS\n", argv[0]);
+    return 1;
+  }
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  // O kvs só cria o socket depois de ler os ficheiros .job: tentamos durante 5 segundos
+  int tries = 0;
+  while (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    if (++tries == 500) {
+      perror("connect");
+      return 1;
+    }
+    usleep(10000);
+  }
+
+  char buffer[4096];
+  ssize_t len;
+  while ((len = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+    if (write(fd, buffer, (size_t)len) != len) {
+      perror("write");
+      return 1;
+    }
+  }
+  shutdown(fd, SHUT_WR);
+  while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, (size_t)len, stdout);
+  }
+  close(fd);
+  return len == 0 ? 0 : 1;
+}
@@ -0,0 +1,14 @@
+# -S: depois dos ficheiros .job o kvs serve clientes num socket UNIX. Um cliente manda
+# vários comandos de uma vez e recebe as respostas por ordem, cada uma acabada em OK; o
+# segundo cliente vê o que o primeiro escreveu. O SIGINT para o kvs e apaga o socket.
+gcc -std=c17 -D_DEFAULT_SOURCE -o client client.c || exit 1
+mkdir jobs && mv start.job jobs/
+"$1" -S "$PWD/kvs.sock" jobs 1 1 &
+kvs=$!
+./client "$PWD/kvs.sock" < requests.txt > replies.txt
+./client "$PWD/kvs.sock" < show.txt > second.txt
+kill -INT "$kvs"
+wait "$kvs"
+echo "$?" > stopped.txt
+[ -e kvs.sock ] && echo "socket left behind" >> stopped.txt
+exit 0
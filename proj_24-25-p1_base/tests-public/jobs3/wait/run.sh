@@ -0,0 +1,10 @@
+# Com um só ficheiro, o thread_id 1 é o próprio ficheiro e um thread_id que não existe é ignorado
+mkdir single pair && mv wait.job single/ && mv first.job second.job pair/
+"$1" single 1 1 && mv single/wait.out .
+# Os ids de dois ficheiros dependem da ordem do readdir, por isso cada um espera pelos dois:
+# um WAIT é para ele próprio e o outro atrasa o outro ficheiro, sem output. Os WAIT suspendem
+# o ficheiro em vez de ocuparem o worker, por isso com um só worker os WAIT 400 sobrepõem-se.
+start=$(date +%s%N)
+"$1" pair 1 1 && mv pair/first.out pair/second.out .
+elapsed=$((($(date +%s%N) - start) / 1000000))
+if [ "$elapsed" -lt 800 ]; then echo "overlapped"; else echo "took $elapsed ms"; fi > timing.txt
@@ -0,0 +1,14 @@
+# -w: cada arranque repõe o WAL dos anteriores. O último registo do primeiro arranque fica
+# a meio (uma escrita interrompida) e tem de ser descartado sem perder os que vêm depois.
+for job in first replay after; do
+  mkdir "$job" && mv "$job.job" "$job"/
+done
+"$1" -w kvs.wal first 1 1 && truncate -s -2 kvs.wal &&
+  "$1" -w kvs.wal replay 1 1 && "$1" -w kvs.wal after 1 1 &&
+  mv replay/replay.out after/after.out .
+# Um registo corrompido a meio do WAL não é cortado: o kvs recusa-se a arrancar com ele
+mkdir corrupted && cp kvs.wal corrupted.wal && printf 'X' | dd of=corrupted.wal bs=1 seek=10 conv=notrunc 2> /dev/null
+"$1" -w corrupted.wal corrupted 1 1 2> corrupted.txt
+echo "$?" >> corrupted.txt
+[ "$(wc -c < corrupted.wal)" -eq "$(wc -c < kvs.wal)" ] && echo "not truncated" >> corrupted.txt
+exit 0
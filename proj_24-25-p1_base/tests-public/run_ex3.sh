@@ -0,0 +1,39 @@
+#!/bin/bash
+
+# Tests of the command line options. Each folder in jobs3 has the .job files of the test and
+# a run.sh that runs the executable on them (with the options being tested); every file in
+# the matching results3 folder must then exist with the same contents.
+
+# Executable path
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit 1
+fi
+executable=$(realpath "$1")
+
+test_dir="tests-public/jobs3"
+results_dir="tests-public/results3"
+
+for job_folder in "$test_dir"/*/; do
+    test_name=$(basename "$job_folder")
+    temp_dir=$(mktemp -d)
+    cp "$job_folder"* "$temp_dir"
+
+    echo -e "\e[34mRunning $test_name\e[0m"
+    if ! (cd "$temp_dir" && bash ./run.sh "$executable" &> run.log); then
+        echo -e "\e[31mExecutable failed for $test_name\e[0m"
+        cat "$temp_dir/run.log"
+    fi
+
+    for result_file in "$results_dir/$test_name"/*; do
+        filename=$(basename "$result_file")
+        if [[ ! -f "$temp_dir/$filename" ]]; then
+            echo -e "\e[31mOutput file $filename not found for $test_name\e[0m"
+        elif diff "$temp_dir/$filename" "$result_file"; then
+            echo -e "\e[32mTest passed for $filename in $test_name\e[0m"
+        else
+            echo -e "\e[31mTest failed for $filename in $test_name\e[0m"
+        fi
+    done
+    rm -rf "$temp_dir"
+done
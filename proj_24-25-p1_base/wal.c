@@ -0,0 +1,309 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Cabeçalho de cada registo
+typedef struct WalHeader {
+  uint32_t len;      // Bytes do registo depois do cabeçalho
+  uint32_t checksum; // FNV-1a desses bytes
+} WalHeader;
+
+static uint32_t record_checksum(const unsigned char *data, size_t len) {
+  uint32_t checksum = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    checksum ^= data[i];
+    checksum *= 16777619u;
+  }
+  return checksum;
+}
+
+int wal_parse_sync(const char *name, enum WalSync *policy) {
+  if (strcmp(name, "group") == 0) {
+    *policy = WAL_SYNC_GROUP;
+  } else if (strcmp(name, "interval") == 0) {
+    *policy = WAL_SYNC_INTERVAL;
+  } else if (strcmp(name, "none") == 0) {
+    *policy = WAL_SYNC_NONE;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+// Reads every complete record of a mapped WAL.
+// @return Size of the valid prefix of the file.
+static size_t replay(const unsigned char *data, size_t size,
+                     void (*apply)(void *arg, enum WalRecord type, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]),
+                     void *arg) {
+  static _Thread_local char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  static _Thread_local char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  size_t pos = 0;
+  while (size - pos >= sizeof(WalHeader)) {
+    WalHeader header;
+    memcpy(&header, data + pos, sizeof(header));
+    const unsigned char *record = data + pos + sizeof(header);
+    if (header.len < 1 || size - pos - sizeof(header) < header.len ||
+        record_checksum(record, header.len) != header.checksum) {
+      break;
+    }
+
+    enum WalRecord type = record[0];
+    size_t i = 1;
+    size_t n = 0;
+    int valid = type == WAL_WRITE || type == WAL_DELETE;
+    while (valid && i < header.len) {
+      for (int field = 0; field < (type == WAL_WRITE ? 2 : 1); field++) {
+        size_t len = i < header.len ? record[i] : MAX_STRING_SIZE;
+        if (n == MAX_WRITE_SIZE || len >= MAX_STRING_SIZE || header.len - i - 1 < len) {
+          valid = 0;
+          break;
+        }
+        char *dest = field == 0 ? keys[n] : values[n];
+        memcpy(dest, record + i + 1, len);
+        dest[len] = '\0';
+        i += 1 + len;
+      }
+      n++;
+    }
+    if (!valid) {
+      break;
+    }
+    apply(arg, type, n, keys, type == WAL_WRITE ? values : NULL);
+    pos += sizeof(header) + header.len;
+  }
+  return pos;
+}
+
+// Diz se o que sobra depois do prefixo válido é o fim de uma escrita interrompida: um
+// registo que não chega ao fim do ficheiro ou que acaba nele, ou só zeros (o ficheiro
+// cresceu mas os dados não chegaram ao disco). Outro registo inválido com bytes depois é
+// corrupção a meio do WAL, e cortá-lo perdia os registos seguintes.
+static int torn_tail(const unsigned char *data, size_t size, size_t pos) {
+  if (size - pos < sizeof(WalHeader)) {
+    return 1;
+  }
+  WalHeader header;
+  memcpy(&header, data + pos, sizeof(header));
+  if (size - pos - sizeof(header) <= header.len) {
+    return 1;
+  }
+  for (size_t i = pos; i < size; i++) {
+    if (data[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Fsyncs periódicos da política WAL_SYNC_INTERVAL.
+static void *sync_periodically(void *arg) {
+  Wal *wal = arg;
+  struct timespec delay = {0, WAL_SYNC_INTERVAL_MS * 1000000L};
+  pthread_mutex_lock(&wal->mutex);
+  while (!wal->stop) {
+    pthread_mutex_unlock(&wal->mutex);
+    nanosleep(&delay, NULL);
+    fdatasync(wal->fd);
+    pthread_mutex_lock(&wal->mutex);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+  return NULL;
+}
+
+Wal *wal_open(int fd, enum WalSync policy,
+              void (*apply)(void *arg, enum WalRecord type, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]),
+              void *arg) {
+  // Repomos os registos e cortamos o que sobrar de uma escrita interrompida
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) == -1) {
+    perror("Couldn't stat WAL");
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)fileStat.st_size;
+  size_t valid = 0;
+  if (size > 0) {
+    const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("Couldn't map WAL");
+      close(fd);
+      return NULL;
+    }
+    posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+    valid = replay(data, size, apply, arg);
+    int torn = valid == size || torn_tail(data, size, valid);
+    munmap((void *)data, size);
+    if (!torn) {
+      char message[64];
+      int len = snprintf(message, sizeof(message), "Corrupted WAL record at offset %zu\n", valid);
+      write(STDERR_FILENO, message, (size_t)len);
+      close(fd);
+      return NULL;
+    }
+  }
+  if ((valid != size && ftruncate(fd, (off_t)valid) == -1) || lseek(fd, 0, SEEK_END) == -1) {
+    perror("Couldn't truncate WAL");
+    close(fd);
+    return NULL;
+  }
+
+  Wal *wal = calloc(1, sizeof(Wal));
+  if (wal == NULL) {
+    close(fd);
+    return NULL;
+  }
+  wal->fd = fd;
+  wal->policy = policy;
+  pthread_mutex_init(&wal->mutex, NULL);
+  pthread_cond_init(&wal->done, NULL);
+  for (int i = 0; i < 2; i++) {
+    wal->buffers[i].data = malloc(WAL_BUFFER_SIZE);
+    wal->buffers[i].capacity = WAL_BUFFER_SIZE;
+  }
+  if (wal->buffers[0].data == NULL || wal->buffers[1].data == NULL ||
+      (policy == WAL_SYNC_INTERVAL && pthread_create(&wal->syncer, NULL, sync_periodically, wal) != 0)) {
+    free(wal->buffers[0].data);
+    free(wal->buffers[1].data);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->done);
+    free(wal);
+    close(fd);
+    return NULL;
+  }
+  return wal;
+}
+
+// Reserva espaço no buffer atual. Chamada com wal->mutex.
+static char *reserve(WalBuffer *buffer, size_t len) {
+  if (buffer->capacity - buffer->len < len) {
+    size_t capacity = buffer->capacity;
+    while (capacity - buffer->len < len) capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) return NULL;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  char *space = buffer->data + buffer->len;
+  buffer->len += len;
+  return space;
+}
+
+uint64_t wal_append(void *arg, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], const int skip[]) {
+  Wal *wal = arg;
+  // O registo é montado fora do mutex; só a cópia para o buffer é serializada
+  unsigned char record[sizeof(WalHeader) + 1 + MAX_WRITE_SIZE * 2 * MAX_STRING_SIZE];
+  size_t len = sizeof(WalHeader);
+  record[len++] = values != NULL ? WAL_WRITE : WAL_DELETE;
+  for (size_t i = 0; i < num_keys; i++) {
+    if (skip[i]) continue;
+    size_t keyLen = strlen(keys[i]);
+    record[len++] = (unsigned char)keyLen;
+    memcpy(record + len, keys[i], keyLen);
+    len += keyLen;
+    if (values != NULL) {
+      size_t valueLen = strlen(values[i]);
+      record[len++] = (unsigned char)valueLen;
+      memcpy(record + len, values[i], valueLen);
+      len += valueLen;
+    }
+  }
+  if (len == sizeof(WalHeader) + 1) return 0; // Nada mudou
+  WalHeader header = {.len = (uint32_t)(len - sizeof(WalHeader)),
+                      .checksum = record_checksum(record + sizeof(WalHeader), len - sizeof(WalHeader))};
+  memcpy(record, &header, sizeof(header));
+
+  pthread_mutex_lock(&wal->mutex);
+  char *space = reserve(&wal->buffers[wal->current], len);
+  if (space == NULL) {
+    wal->failed = 1; // wal_commit devolve a falha
+  } else {
+    memcpy(space, record, len);
+    ++wal->appended;
+  }
+  uint64_t number = wal->appended;
+  pthread_mutex_unlock(&wal->mutex);
+  return number;
+}
+
+// Escreve um buffer inteiro no ficheiro.
+static int write_buffer(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+int wal_commit(Wal *wal, uint64_t record) {
+  pthread_mutex_lock(&wal->mutex);
+  while (wal->written < record && !wal->failed) {
+    if (wal->writing) {
+      // Outra tarefa está a escrever; a próxima ronda leva os nossos registos
+      pthread_cond_wait(&wal->done, &wal->mutex);
+      continue;
+    }
+
+    // Passamos a líder: levamos os registos de todas as tarefas até agora
+    WalBuffer *buffer = &wal->buffers[wal->current];
+    wal->current = 1 - wal->current;
+    uint64_t target = wal->appended;
+    wal->writing = 1;
+    pthread_mutex_unlock(&wal->mutex);
+
+    int result = write_buffer(wal->fd, buffer->data, buffer->len);
+    if (result == 0 && wal->policy == WAL_SYNC_GROUP) {
+      result = fdatasync(wal->fd);
+    }
+    buffer->len = 0;
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->writing = 0;
+    if (result != 0) {
+      perror("Couldn't write WAL");
+      wal->failed = 1;
+    } else {
+      wal->written = target;
+    }
+    pthread_cond_broadcast(&wal->done);
+  }
+  int failed = wal->failed;
+  pthread_mutex_unlock(&wal->mutex);
+  return failed;
+}
+
+int wal_failed(Wal *wal) {
+  pthread_mutex_lock(&wal->mutex);
+  int failed = wal->failed;
+  pthread_mutex_unlock(&wal->mutex);
+  return failed;
+}
+
+void wal_close(Wal *wal) {
+  pthread_mutex_lock(&wal->mutex);
+  uint64_t last = wal->appended;
+  wal->stop = 1;
+  pthread_mutex_unlock(&wal->mutex);
+  wal_commit(wal, last);
+  if (wal->policy == WAL_SYNC_INTERVAL) {
+    pthread_join(wal->syncer, NULL);
+  }
+  fdatasync(wal->fd);
+  close(wal->fd);
+  free(wal->buffers[0].data);
+  free(wal->buffers[1].data);
+  pthread_mutex_destroy(&wal->mutex);
+  pthread_cond_destroy(&wal->done);
+  free(wal);
+}
@@ -0,0 +1,101 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "constants.h"
+
+/* Write-ahead log: cada WRITE/DELETE aplicado à tabela é acrescentado ao ficheiro do WAL,
+ para que as alterações feitas depois do último backup sobrevivam a uma falha. Os registos
+ são acumulados num buffer e escritos em grupo: a tarefa que faz commit quando ninguém
+ está a escrever passa a líder e escreve (e sincroniza) os registos de todas as outras.
+
+ Cada registo tem um cabeçalho {tamanho, checksum FNV-1a de 32 bits} seguido do tipo
+ (WAL_WRITE ou WAL_DELETE) e, por cada chave, 1 byte de tamanho e a chave (e o mesmo
+ para o valor num WAL_WRITE). Um registo incompleto ou corrompido no fim do ficheiro
+ (uma escrita interrompida) é descartado ao repor o WAL; um registo corrompido seguido de
+ outros impede que o WAL seja aberto, em vez de se perderem os registos depois dele. */
+
+// Intervalo entre fsyncs com a política WAL_SYNC_INTERVAL
+#define WAL_SYNC_INTERVAL_MS 10
+// Tamanho inicial de cada um dos dois buffers de registos
+#define WAL_BUFFER_SIZE (64 * 1024)
+
+enum WalRecord {
+  WAL_WRITE = 1,
+  WAL_DELETE = 2
+};
+
+enum WalSync {
+  WAL_SYNC_GROUP,    // Cada comando só termina depois de escrito e sincronizado (fsync partilhado)
+  WAL_SYNC_INTERVAL, // Cada comando termina depois de escrito; fsync a cada WAL_SYNC_INTERVAL_MS
+  WAL_SYNC_NONE      // Cada comando termina depois de escrito; o fsync fica para o sistema
+};
+
+typedef struct WalBuffer {
+  char *data;
+  size_t len, capacity;
+} WalBuffer;
+
+typedef struct Wal {
+  int fd;
+  enum WalSync policy;
+  pthread_mutex_t mutex;
+  pthread_cond_t done;     // Sinalizada quando um líder acaba de escrever
+  WalBuffer buffers[2];    // Um recebe registos enquanto o outro é escrito pelo líder
+  int current;             // Buffer que recebe os registos
+  uint64_t appended;       // Número do último registo acrescentado
+  uint64_t written;        // Número do último registo escrito (e sincronizado, em WAL_SYNC_GROUP)
+  int writing;             // Há um líder a escrever
+  int failed;              // Uma escrita falhou; os registos seguintes já não são garantidos
+  int stop;
+  pthread_t syncer;        // Tarefa dos fsyncs periódicos (WAL_SYNC_INTERVAL)
+} Wal;
+
+/// Parses the name of a sync policy ("group", "interval" or "none").
+/// @param name Name of the policy.
+/// @param policy Set to the policy.
+/// @return 0 on success, 1 if the name is unknown.
+int wal_parse_sync(const char *name, enum WalSync *policy);
+
+/// Replays the records of a WAL file, drops a torn record at its end and keeps it open for
+/// appending. Fails if a corrupted record is followed by more data.
+/// @param fd File descriptor of the WAL, open for reading and writing; owned by the WAL.
+/// @param policy Sync policy.
+/// @param apply Called for every record, in order (values is NULL for a WAL_DELETE).
+/// @param arg Argument passed to apply.
+/// @return The WAL, NULL on failure.
+Wal *wal_open(int fd, enum WalSync policy,
+              void (*apply)(void *arg, enum WalRecord type, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]),
+              void *arg);
+
+/// Appends the record of an applied WRITE/DELETE (a BatchHook for the table). Only copies
+/// it to memory; wal_commit makes it durable.
+/// @param wal The WAL.
+/// @param num_keys Number of keys of the command.
+/// @param keys Keys of the command.
+/// @param values Values of a WRITE, NULL for a DELETE.
+/// @param skip Keys that didn't change (and aren't logged).
+/// @return Number of the record, to pass to wal_commit (0 if nothing was appended).
+uint64_t wal_append(void *wal, size_t num_keys, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], const int skip[]);
+
+/// Waits until a record and every record before it are written (and synced, depending on
+/// the policy), writing the pending records of every thread if no other thread is already
+/// doing it. The record may have been appended by any thread.
+/// @param wal The WAL.
+/// @param record Number returned by wal_append (0 returns at once).
+/// @return 0 on success, 1 if the WAL couldn't be written.
+int wal_commit(Wal *wal, uint64_t record);
+
+/// Tells whether a write of the WAL has failed. Records appended after that are never
+/// made durable, so the caller should stop changing the table.
+/// @param wal The WAL.
+/// @return 1 if the WAL failed, 0 otherwise.
+int wal_failed(Wal *wal);
+
+/// Writes and syncs the pending records and closes the WAL.
+/// @param wal The WAL.
+void wal_close(Wal *wal);
+
+#endif  // KVS_WAL_H